@@ -7,6 +7,44 @@
 #define AKPFS_MAX_ENTRIES_PER_DIR AKPFS_MAX_BLOCKS_PER_FILE
 #define AKPFS_MAX_ACTUAL_FILE_PATH_SIZE (AKPFS_MAX_BLOCKS_PER_FILE * sizeof(int))
 
+/*
+ * Feature flags: Images created before these have 0 in feature_flags, & map
+ * the file blocks directly through file_blocks
+ */
+#define AKPFS_FEATURE_EXTENTS 0x1 /* File blocks mapped by extents */
+/*
+ * Only the first inodes_block_init_cnt inode blocks are initialized; The rest
+ * are zeroed on the first inode allotment in them
+ */
+#define AKPFS_FEATURE_LAZY_ITABLE 0x2
+#define AKPFS_FEATURE_JOURNAL 0x4 /* Metadata updates go through the journal blocks */
+#define AKPFS_SUPPORTED_FEATURES (AKPFS_FEATURE_EXTENTS | AKPFS_FEATURE_LAZY_ITABLE | AKPFS_FEATURE_JOURNAL)
+
+/*
+ * With AKPFS_FEATURE_JOURNAL, the journal_block_cnt blocks just after the free
+ * bits blocks hold the last committed transaction: The header block, then the
+ * tag blocks having the (home) block #s of the logged blocks, & then the copies
+ * of the logged blocks. The transaction is valid, only if the header's magic &
+ * checksum (crc32_le over the tag blocks, the copies, seq & block_cnt) match.
+ * A header with 0 magic means no transaction to be replayed
+ */
+#define AKPFS_JOURNAL_MAGIC 0x4A504B41 /* "AKPJ" */
+/*
+ * Blocks logged by one operation, other than the free bits blocks: 4 inode
+ * blocks (rename), a lazily zeroed inode block, the super block & an extent block
+ */
+#define AKPFS_JOURNAL_HANDLE_EXTRA 7
+#define AKPFS_JOURNAL_DEF_BLOCKS 64 /* Minimum default size */
+
+/*
+ * With AKPFS_FEATURE_EXTENTS, the first AKPFS_DIRECT_EXTENTS extents are in the
+ * inode itself, & the block of its last extent slot (AKPFS_EXTENT_BLOCK), if
+ * non-zero, holds the further extents. Unused extents have block_cnt as 0
+ */
+#define AKPFS_EXTENTS_PER_INODE (AKPFS_MAX_BLOCKS_PER_FILE / 3)
+#define AKPFS_DIRECT_EXTENTS (AKPFS_EXTENTS_PER_INODE - 1)
+#define AKPFS_EXTENT_BLOCK AKPFS_DIRECT_EXTENTS
+
 enum file_type
 {
 	akpfs_dir = -1,
@@ -27,6 +65,35 @@ struct akpfs_sb
 	unsigned int data_block_start;
 	unsigned int data_block_cnt;
 	unsigned int root_inode;
+	unsigned int feature_flags;
+	unsigned int inodes_block_init_cnt; // Only with AKPFS_FEATURE_LAZY_ITABLE
+	unsigned int journal_block_start; // Only with AKPFS_FEATURE_JOURNAL
+	unsigned int journal_block_cnt; // Only with AKPFS_FEATURE_JOURNAL
+};
+/*
+ * Orphan list, in the super block's block just after the struct akpfs_sb:
+ * Inodes unlinked from their dir, but not yet freed, as still open. Each goes
+ * in, in the unlink's transaction, & out, in the one freeing it. So, the ones
+ * left after a crash are freed on the next mount. A cnt beyond the
+ * akpfs_max_orphans (say, from an older mkfs) is taken as an empty list
+ */
+struct akpfs_orphans
+{
+	unsigned int cnt;
+	unsigned int ino[];
+};
+struct akpfs_journal_header
+{
+	unsigned int magic;
+	unsigned int seq; // Transaction # - just for reference
+	unsigned int block_cnt; // Count of the logged blocks
+	unsigned int checksum;
+};
+struct akpfs_extent
+{
+	unsigned int file_block; // First file block in the extent
+	unsigned int block; // Its block #
+	unsigned int block_cnt; // Count of its contiguous blocks; 0, if unused
 };
 struct akpfs_inode
 {
@@ -35,22 +102,152 @@ struct akpfs_inode
 	union
 	{
 		unsigned int file_blocks[AKPFS_MAX_BLOCKS_PER_FILE];
+		struct akpfs_extent extents[AKPFS_EXTENTS_PER_INODE];
 		unsigned int dir_entries[AKPFS_MAX_ENTRIES_PER_DIR];
 		char actual_file_path[AKPFS_MAX_ACTUAL_FILE_PATH_SIZE];
 	} u;
 };
 
+/* Most blocks a transaction can log, in a journal of journal_block_cnt blocks */
+static inline unsigned int akpfs_journal_capacity(unsigned int journal_block_cnt, unsigned int block_size)
+{
+	unsigned int tags_per_block = block_size / sizeof(unsigned int);
+
+	if (journal_block_cnt < 3)
+	{
+		return 0;
+	}
+	/* 1 header block, & a tag block per tags_per_block logged blocks */
+	return (journal_block_cnt - 1) / (tags_per_block + 1) * tags_per_block +
+		(((journal_block_cnt - 1) % (tags_per_block + 1)) ?
+			((journal_block_cnt - 1) % (tags_per_block + 1)) - 1 : 0);
+}
+static inline struct akpfs_orphans *akpfs_orphans(struct akpfs_sb *sb)
+{
+	return (struct akpfs_orphans *)(sb + 1);
+}
+static inline unsigned int akpfs_max_orphans(unsigned int block_size)
+{
+	return (block_size - sizeof(struct akpfs_sb) - sizeof(struct akpfs_orphans)) / sizeof(unsigned int);
+}
+/* Blocks to be reserved for an operation (a journal handle) */
+static inline unsigned int akpfs_journal_handle_blocks(unsigned int free_bits_block_cnt)
+{
+	return free_bits_block_cnt + AKPFS_JOURNAL_HANDLE_EXTRA;
+}
+
 #ifdef __KERNEL__
 #include <linux/fs.h>
 #include <linux/buffer_head.h>
 #include <linux/types.h>
+#include <linux/mutex.h>
 
 struct akpfs_fs_info
 {
 	struct akpfs_sb *akpfs_sb;
 	struct buffer_head *bh;
+	/*
+	 * In-memory copy of the free bits blocks, in their on-disk (little endian)
+	 * bit order, written back lazily - only the modified blocks, on write_inode
+	 * & sync_fs
+	 */
+	unsigned long *free_bits;
+	unsigned long *dirty_free_bits; // Free bits blocks modified, but not yet written back
+	unsigned int free_cursor; // Block # from where the next free block search starts
+	struct mutex free_bits_lock; // Protects free_bits, dirty_free_bits & free_cursor
+	/*
+	 * In-memory inode table usage (set bit for a used inode), built from the
+	 * inodes' file_name on the first inode allotment
+	 */
+	unsigned long *used_inodes;
+	unsigned int inode_cursor; // Inode # from where the next free inode search starts
+	struct mutex inode_bits_lock; // Protects used_inodes & inode_cursor
+	struct mutex orphan_lock; // Protects the orphan list, in the super block's buffer
+	int readahead; // Mount option: readahead (default) / noreadahead
+	struct akpfs_journal *journal; // Only with AKPFS_FEATURE_JOURNAL
+};
+
+/*
+ * Per directory name -> inode cache, kept in the directory's akpfs_inode_info.
+ * Built on the first lookup/readdir, & dropped on any change in the directory
+ * or on its eviction
+ */
+#define AKPFS_DIR_HASH_SIZE 32 /* Power of 2, not less than AKPFS_MAX_ENTRIES_PER_DIR */
+
+struct akpfs_dir_cache
+{
+	struct
+	{
+		unsigned int ino; // 0, if the slot is empty
+		umode_t type;
+		char file_name[AKPFS_MAX_FILE_NAME_SIZE];
+	} entries[AKPFS_MAX_ENTRIES_PER_DIR]; // Same slots as the dir_entries
+	signed char hash[AKPFS_DIR_HASH_SIZE]; // First slot of each hash chain, or -1
+	signed char next[AKPFS_MAX_ENTRIES_PER_DIR]; // Next slot in the hash chain, or -1
+};
+
+/*
+ * In-core inode, embedding the VFS inode. Allocated through akpfs_alloc_inode,
+ * from the akpfs_inode_cachep
+ */
+struct akpfs_inode_info
+{
+	/*
+	 * Copy of the on-disk file_blocks/extents, filled in when the inode is read
+	 * in, updated by akpfs_get_block, & written back by akpfs_super_write_inode
+	 */
+	union
+	{
+		unsigned int file_blocks[AKPFS_MAX_BLOCKS_PER_FILE];
+		struct akpfs_extent extents[AKPFS_EXTENTS_PER_INODE];
+	} u;
+	struct mutex map_lock; // Protects the extents across get_block & write_inode
+	struct akpfs_dir_cache *dir_cache; // Only for directories
+	struct inode vfs_inode;
 };
 
+/*
+ * Metadata transaction of a directory operation: Collects the inode table
+ * blocks it modifies, each read just once however many of its inodes are
+ * changed, & dirties (or for dirsync, writes) them all together at the commit.
+ * An operation completes all its checks & allotments before modifying any
+ * inode, so that an abort has nothing to undo
+ */
+#define AKPFS_TRANS_MAX_BH 4 /* rename: 2 directories + the renamed & the replaced inodes */
+
+/*
+ * Journal handle, i.e. a metadata update in progress: Lives in its caller's
+ * frame, from akpfs_journal_start till akpfs_journal_stop, & is reached by
+ * akpfs_journal_dirty through current->journal_info, as the handles neither
+ * nest nor cross tasks
+ */
+struct akpfs_journal_handle
+{
+	unsigned int credits; // Blocks it may yet add to the running transaction
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,12,0))
+	unsigned int nofs_flags; // No fs reclaim within the handle, as by memalloc_nofs_save
+#endif
+};
+
+struct akpfs_trans
+{
+	struct super_block *sb;
+	int bh_cnt;
+	struct buffer_head *bh[AKPFS_TRANS_MAX_BH];
+	struct akpfs_journal_handle handle;
+};
+
+static inline struct akpfs_inode_info *AKPFS_I(struct inode *inode)
+{
+	return container_of(inode, struct akpfs_inode_info, vfs_inode);
+}
+
+static inline int akpfs_has_extents(struct super_block *sb)
+{
+	return ((struct akpfs_fs_info *)(sb->s_fs_info))->akpfs_sb->feature_flags & AKPFS_FEATURE_EXTENTS;
+}
+
+extern struct kmem_cache *akpfs_inode_cachep;
 extern struct file_system_type akpfs;
 extern struct super_operations akpfs_sops;
 extern struct inode_operations akpfs_iops;
@@ -65,7 +262,52 @@ extern struct akpfs_inode *akpfs_get_inode(struct super_block *sb, int ino,
 	struct buffer_head **bhp);
 extern umode_t akpfs_get_file_type(struct akpfs_inode *i);
 extern umode_t akpfs_get_inode_flags(struct akpfs_inode *i);
+extern struct akpfs_dir_cache *akpfs_get_dir_cache(struct inode *dir);
+/* Returns the slot of the entry with the file_name, or -1 if not found */
+extern int akpfs_dir_cache_lookup(struct akpfs_dir_cache *dc, const char *file_name);
+extern void akpfs_invalidate_dir_cache(struct inode *dir);
+/* Following 2 are expected to be called with the directory's i_mutex held */
+extern void akpfs_dir_cache_add(struct inode *dir, int slot, unsigned int ino, umode_t type,
+	const char *file_name);
+extern void akpfs_dir_cache_remove(struct inode *dir, int slot);
+/*
+ * Journal: Every update of the metadata buffers is to be done within an
+ * akpfs_journal_start/stop pair (a handle), & the updated buffers are then to be
+ * passed to akpfs_journal_dirty, instead of mark_buffer_dirty. A handle may add
+ * at most akpfs_journal_handle_blocks buffers to the running transaction.
+ * Without the AKPFS_FEATURE_JOURNAL, these just fall back to mark_buffer_dirty
+ */
+extern int akpfs_journal_load(struct super_block *sb);
+extern void akpfs_journal_unload(struct super_block *sb);
+extern void akpfs_journal_start(struct super_block *sb, struct akpfs_journal_handle *handle);
+extern void akpfs_journal_stop(struct super_block *sb, struct akpfs_journal_handle *handle);
+extern void akpfs_journal_dirty(struct super_block *sb, struct buffer_head *bh);
+/* Not to be called within a handle */
+extern int akpfs_journal_commit(struct super_block *sb);
+/* Following starts a journal handle, which is stopped by the commit or abort */
+extern void akpfs_trans_init(struct akpfs_trans *trans, struct super_block *sb);
+/* Returns the inode in the transaction's blocks, or NULL on error */
+extern struct akpfs_inode *akpfs_trans_get_inode(struct akpfs_trans *trans, int ino);
+extern int akpfs_trans_commit(struct akpfs_trans *trans, int sync);
+extern void akpfs_trans_abort(struct akpfs_trans *trans);
+extern int akpfs_load_free_bits(struct super_block *sb);
+extern void akpfs_unload_free_bits(struct super_block *sb);
+/* Expects a journal handle */
+extern int akpfs_sync_free_bits(struct super_block *sb);
 extern unsigned int akpfs_get_free_block(struct super_block *sb);
+extern unsigned int akpfs_get_free_block_near(struct super_block *sb, unsigned int goal);
 int akpfs_put_free_block(struct super_block *sb, int block_no);
+/* Returns the free inode #, or 0 if no free inode */
+extern unsigned int akpfs_get_free_inode(struct super_block *sb);
+extern void akpfs_put_free_inode(struct super_block *sb, unsigned int ino);
+/* Following 2 expect a journal handle. Adding fails with -ENOSPC, if the list is full */
+extern int akpfs_orphan_add(struct super_block *sb, unsigned int ino);
+extern void akpfs_orphan_del(struct super_block *sb, unsigned int ino);
+/* Frees the orphans left by a crash. Not to be called within a handle */
+extern void akpfs_orphan_cleanup(struct super_block *sb);
+/* Returns the inode, read in if not in the inode cache, or an ERR_PTR */
+extern struct inode *akpfs_iget(struct super_block *sb, unsigned int ino);
+extern int akpfs_extent_truncate(struct inode *inode, unsigned int from);
+extern int akpfs_truncate_blocks(struct inode *inode, unsigned int from);
 #endif
 #endif
@@ -11,11 +11,13 @@
 
 sfs_super_block_t sb;
 byte1_t *used_blocks;
-byte1_t block[SIMULA_FS_BLOCK_SIZE];
+byte1_t block[SIMULA_FS_MAX_BLOCK_SIZE];
+
+static void mark_file_blocks(int sfs_handle, sfs_file_entry_t *fe, byte1_t used);
 
 void init_browsing(int sfs_handle)
 {
-	int i, j;
+	int i;
 	sfs_file_entry_t fe;
 
 	/* Mark used blocks */
@@ -34,11 +36,7 @@ void init_browsing(int sfs_handle)
 	{
 		read(sfs_handle, &fe, sizeof(sfs_file_entry_t));
 		if (!fe.name[0]) continue;
-		for (j = 0; j < SIMULA_FS_DATA_BLOCK_CNT; j++)
-		{
-			if (fe.blocks[j] == 0) break;
-			used_blocks[fe.blocks[j]] = 1;
-		}
+		mark_file_blocks(sfs_handle, &fe, 1);
 	}
 }
 void shut_browsing(int sfs_handle)
@@ -59,9 +57,128 @@ static int get_data_block(int sfs_handle)
 	}
 	return -1;
 }
-static void put_data_block(int sfs_handle, int i)
+/*
+ * File block tree: Older (SIMULA_FS_VERSION_DIRECT) images have all of the
+ * blocks[] as data blocks. Newer ones have all but the last 2 as data blocks,
+ * followed by a single indirect & a double indirect block
+ */
+static int direct_block_cnt(void)
+{
+	return (sb.version == SIMULA_FS_VERSION_DIRECT) ? SIMULA_FS_DATA_BLOCK_CNT : SIMULA_FS_IND_BLOCK;
+}
+static int ptrs_per_block(void)
+{
+	return sb.block_size / sizeof(byte4_t);
+}
+static int max_file_blocks(void)
+{
+	if (sb.version == SIMULA_FS_VERSION_DIRECT)
+		return SIMULA_FS_DATA_BLOCK_CNT;
+	return direct_block_cnt() + ptrs_per_block() + ptrs_per_block() * ptrs_per_block();
+}
+static void clear_block(int sfs_handle, byte4_t blk)
+{
+	static byte1_t zeroes[SIMULA_FS_MAX_BLOCK_SIZE];
+
+	pwrite(sfs_handle, zeroes, sb.block_size, (off_t)(blk) * sb.block_size);
+}
+static byte4_t read_ptr(int sfs_handle, byte4_t ptr_block, int idx)
+{
+	byte4_t ptr = 0;
+
+	pread(sfs_handle, &ptr, sizeof(ptr), (off_t)(ptr_block) * sb.block_size + idx * sizeof(byte4_t));
+	return ptr;
+}
+static void write_ptr(int sfs_handle, byte4_t ptr_block, int idx, byte4_t ptr)
+{
+	pwrite(sfs_handle, &ptr, sizeof(ptr), (off_t)(ptr_block) * sb.block_size + idx * sizeof(byte4_t));
+}
+static int get_file_block(int sfs_handle, sfs_file_entry_t *fe, int iblock, int create)
+/*
+ * Returns the block # of the file block iblock, 0 if none. If create is set,
+ * allocates it (& the indirect blocks on the way), updating fe in memory only
+ */
+{
+	int direct_cnt = direct_block_cnt(), ppb = ptrs_per_block();
+	byte4_t *slot, ptr_block;
+	int depth, rel, idx, blk;
+
+	if (iblock < direct_cnt)
+	{
+		depth = 0;
+		slot = &fe->blocks[iblock];
+		rel = 0;
+	}
+	else if (iblock >= max_file_blocks())
+	{
+		return 0;
+	}
+	else if (iblock - direct_cnt < ppb)
+	{
+		depth = 1;
+		slot = &fe->blocks[SIMULA_FS_IND_BLOCK];
+		rel = iblock - direct_cnt;
+	}
+	else
+	{
+		depth = 2;
+		slot = &fe->blocks[SIMULA_FS_DIND_BLOCK];
+		rel = iblock - direct_cnt - ppb;
+	}
+	if (!*slot)
+	{
+		if (!create || ((blk = get_data_block(sfs_handle)) == -1))
+			return 0;
+		if (depth)
+			clear_block(sfs_handle, blk);
+		*slot = blk;
+	}
+	for (ptr_block = *slot; depth; depth--)
+	{
+		idx = (depth == 1) ? rel % ppb : rel / ppb;
+		if (!(blk = read_ptr(sfs_handle, ptr_block, idx)))
+		{
+			if (!create || ((blk = get_data_block(sfs_handle)) == -1))
+				return 0;
+			if (depth > 1)
+				clear_block(sfs_handle, blk);
+			write_ptr(sfs_handle, ptr_block, idx, blk);
+		}
+		ptr_block = blk;
+	}
+	return ptr_block;
+}
+static void mark_ptr_block(int sfs_handle, byte4_t ptr_block, int depth, byte1_t used)
+{
+	byte4_t ptrs[SIMULA_FS_MAX_BLOCK_SIZE / sizeof(byte4_t)];
+	int i;
+
+	used_blocks[ptr_block] = used;
+	pread(sfs_handle, ptrs, sb.block_size, (off_t)(ptr_block) * sb.block_size);
+	for (i = 0; i < ptrs_per_block(); i++)
+	{
+		if (!ptrs[i]) continue;
+		if (depth == 1)
+			used_blocks[ptrs[i]] = used;
+		else
+			mark_ptr_block(sfs_handle, ptrs[i], depth - 1, used);
+	}
+}
+static void mark_file_blocks(int sfs_handle, sfs_file_entry_t *fe, byte1_t used)
+/* Marks all the blocks of the file, including the indirect ones, as used or free */
 {
-	used_blocks[i] = 0;
+	int i;
+
+	for (i = 0; i < direct_block_cnt(); i++)
+	{
+		if (fe->blocks[i]) used_blocks[fe->blocks[i]] = used;
+	}
+	if (sb.version == SIMULA_FS_VERSION_DIRECT)
+		return;
+	if (fe->blocks[SIMULA_FS_IND_BLOCK])
+		mark_ptr_block(sfs_handle, fe->blocks[SIMULA_FS_IND_BLOCK], 1, used);
+	if (fe->blocks[SIMULA_FS_DIND_BLOCK])
+		mark_ptr_block(sfs_handle, fe->blocks[SIMULA_FS_DIND_BLOCK], 2, used);
 }
 
 void sfs_list(int sfs_handle)
@@ -83,6 +200,51 @@ void sfs_list(int sfs_handle)
 			);
 	}
 }
+void sfs_frag(int sfs_handle)
+/*
+ * Fragmentation report: An extent is a run of physically contiguous blocks of
+ * a file, i.e. what could be read back in a single merged bio
+ */
+{
+	int i, j;
+	sfs_file_entry_t fe;
+	int file_cnt, block_cnt, extent_cnt, contig_file_cnt;
+	int file_blocks, file_extents;
+	byte4_t blk, prev_blk;
+
+	file_cnt = block_cnt = extent_cnt = contig_file_cnt = 0;
+	lseek(sfs_handle, sb.entry_table_block_start * sb.block_size, SEEK_SET);
+	for (i = 0; i < sb.entry_count; i++)
+	{
+		read(sfs_handle, &fe, sizeof(sfs_file_entry_t));
+		if (!fe.name[0]) continue;
+		file_blocks = file_extents = 0;
+		prev_blk = 0;
+		for (j = 0; j < max_file_blocks(); j++)
+		{
+			if ((blk = get_file_block(sfs_handle, &fe, j, 0)) == 0) break;
+			if ((j == 0) || (blk != prev_blk + 1))
+			{
+				file_extents++;
+			}
+			file_blocks++;
+			prev_blk = blk;
+		}
+		printf("%-15s  %6d blocks  %6d extents\n", fe.name, file_blocks, file_extents);
+		file_cnt++;
+		block_cnt += file_blocks;
+		extent_cnt += file_extents;
+		if (file_extents <= 1) contig_file_cnt++;
+	}
+	printf("Files: %d (%d contiguous); Blocks: %d; Extents: %d\n",
+		file_cnt, contig_file_cnt, block_cnt, extent_cnt);
+	if (block_cnt > file_cnt)
+	{
+		/* Adjacent block pairs within files, which are physically contiguous */
+		printf("Mergeable block pairs: %.1f%%\n",
+			100.0 * (block_cnt - extent_cnt) / (block_cnt - file_cnt));
+	}
+}
 void sfs_create(int sfs_handle, char *fn)
 {
 	int i;
@@ -135,7 +297,7 @@ int sfs_lookup(int sfs_handle, char *fn, sfs_file_entry_t *fe)
 }
 void sfs_remove(int sfs_handle, char *fn)
 {
-	int i, block_i;
+	int i;
 	sfs_file_entry_t fe;
 
 	if ((i = sfs_lookup(sfs_handle, fn, &fe)) == -1)
@@ -144,14 +306,7 @@ void sfs_remove(int sfs_handle, char *fn)
 		return;
 	}
 	/* Free up all allocated blocks, if any */
-	for (block_i = 0; block_i < SIMULA_FS_DATA_BLOCK_CNT; block_i++)
-	{
-		if (!fe.blocks[block_i])
-		{
-			break;
-		}
-		put_data_block(sfs_handle, fe.blocks[block_i]);
-	}
+	mark_file_blocks(sfs_handle, &fe, 0);
 	memset(&fe, 0, sizeof(sfs_file_entry_t));
 
 	lseek(sfs_handle, sb.entry_table_block_start * sb.block_size + i * sb.entry_size, SEEK_SET);
@@ -179,7 +334,7 @@ void sfs_chperm(int sfs_handle, char *fn, int perm)
 }
 void sfs_read(int sfs_handle, char *fn)
 {
-	int i, block_i, already_read, rem_to_read, to_read;
+	int i, block_i, already_read, rem_to_read, to_read, blk;
 	sfs_file_entry_t fe;
 
 	if ((i = sfs_lookup(sfs_handle, fn, &fe)) == -1)
@@ -194,11 +349,11 @@ void sfs_read(int sfs_handle, char *fn)
 	}
 	already_read = 0;
 	rem_to_read = fe.size;
-	for (block_i = 0; block_i < SIMULA_FS_DATA_BLOCK_CNT; block_i++)
+	for (block_i = 0; block_i < max_file_blocks(); block_i++)
 	{
-		if (!fe.blocks[block_i]) break;
+		if (!(blk = get_file_block(sfs_handle, &fe, block_i, 0))) break;
 		to_read = (rem_to_read >= sb.block_size) ? sb.block_size : rem_to_read;
-		lseek(sfs_handle, fe.blocks[block_i] * sb.block_size, SEEK_SET);
+		lseek(sfs_handle, (off_t)(blk) * sb.block_size, SEEK_SET);
 		read(sfs_handle, block, to_read);
 		write(1, block, to_read);
 		already_read += to_read;
@@ -222,14 +377,8 @@ void sfs_write(int sfs_handle, char *fn)
 		return;
 	}
 	/* Free up all previously allocated blocks, if any */
-	for (block_i = 0; block_i < SIMULA_FS_DATA_BLOCK_CNT; block_i++)
-	{
-		if (!fe.blocks[block_i])
-		{
-			break;
-		}
-		put_data_block(sfs_handle, fe.blocks[block_i]);
-	}
+	mark_file_blocks(sfs_handle, &fe, 0);
+	memset(fe.blocks, 0, sizeof(fe.blocks));
 	/* Let's get data & write */
 	cur_read_i = 0;
 	to_read = sb.block_size;
@@ -240,13 +389,12 @@ void sfs_write(int sfs_handle, char *fn)
 		if (cur_read == to_read)
 		{
 			/* Write this block */
-			if (block_i == SIMULA_FS_DATA_BLOCK_CNT)
+			if (block_i == max_file_blocks())
 				break; /* File size limit */
-			if ((free_i = get_data_block(sfs_handle)) == -1)
+			if (!(free_i = get_file_block(sfs_handle, &fe, block_i, 1)))
 				break; /* File system full */
-			lseek(sfs_handle, free_i * sb.block_size, SEEK_SET);
+			lseek(sfs_handle, (off_t)(free_i) * sb.block_size, SEEK_SET);
 			write(sfs_handle, block, sb.block_size);
-			fe.blocks[block_i] = free_i;
 			block_i++;
 			total_size += sb.block_size;
 			/* Reset various variables */
@@ -262,10 +410,10 @@ void sfs_write(int sfs_handle, char *fn)
 	if ((cur_read <= 0) && (cur_read_i))
 	{
 		/* Write this partial block */
-		if ((block_i != SIMULA_FS_DATA_BLOCK_CNT) &&
-			((fe.blocks[block_i] = get_data_block(sfs_handle)) != -1))
+		if ((block_i != max_file_blocks()) &&
+			((free_i = get_file_block(sfs_handle, &fe, block_i, 1)) != 0))
 		{
-			lseek(sfs_handle, fe.blocks[block_i] * sb.block_size, SEEK_SET);
+			lseek(sfs_handle, (off_t)(free_i) * sb.block_size, SEEK_SET);
 			write(sfs_handle, block, cur_read_i);
 			total_size += cur_read_i;
 		}
@@ -280,7 +428,7 @@ void sfs_write(int sfs_handle, char *fn)
 void usage(void)
 {
 	printf("Supported commands:\n");
-	printf("\t?\tquit\tlist\tcreate <file>\tremove <file>\n");
+	printf("\t?\tquit\tlist\tfrag\tcreate <file>\tremove <file>\n");
 	printf("\t\tchperm <0-7> <file>\tread <file>\twrite <file>\n");
 }
 
@@ -298,6 +446,7 @@ void browse_sfs(int sfs_handle)
 	printf("File entry size: %d bytes\n", sb.entry_size);
 	printf("Entry tbl size : %d blocks\n", sb.entry_table_size);
 	printf("Entry count    : %d\n", sb.entry_count);
+	printf("Version        : %d\n", sb.version);
 	printf("\n");
 	init_browsing(sfs_handle);
 	while (!done)
@@ -330,6 +479,11 @@ void browse_sfs(int sfs_handle)
 			sfs_list(sfs_handle);
 			continue;
 		}
+		else if (strcmp(cmd, "frag") == 0)
+		{
+			sfs_frag(sfs_handle);
+			continue;
+		}
 		else if (strncmp(cmd, "create", 6) == 0)
 		{
 			if (cmd[6] == ' ')
@@ -429,6 +583,12 @@ int main(int argc, char *argv[])
 		close(sfs_handle);
 		return 3;
 	}
+	if ((sb.version > SIMULA_FS_VERSION) || (sb.block_size > SIMULA_FS_MAX_BLOCK_SIZE))
+	{
+		fprintf(stderr, "Unsupported SFS version/block size. Giving up.\n");
+		close(sfs_handle);
+		return 4;
+	}
 	browse_sfs(sfs_handle);
 	close(sfs_handle);
 	return 0;
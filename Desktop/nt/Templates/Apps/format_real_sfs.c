@@ -7,7 +7,7 @@
 #include <errno.h> /* For errno */
 #include <string.h> /* For strerror() */
 #include <sys/ioctl.h> /* For ioctl() */
-#include <linux/fs.h> /* For BLKGETSIZE64 */
+#include <linux/fs.h> /* For BLKGETSIZE64, BLKZEROOUT */
 
 #include "real_sfs_ds.h"
 
@@ -19,7 +19,8 @@ sfs_super_block_t sb =
 	.type = SIMULA_FS_TYPE,
 	.block_size = SIMULA_FS_BLOCK_SIZE,
 	.entry_size = SIMULA_FS_ENTRY_SIZE,
-	.entry_table_block_start = SFS_ENTRY_TABLE_BLOCK_START
+	.entry_table_block_start = SFS_ENTRY_TABLE_BLOCK_START,
+	.version = SIMULA_FS_VERSION
 };
 sfs_file_entry_t fe; /* All 0's */
 
@@ -30,15 +31,24 @@ void write_super_block(int sfs_handle, sfs_super_block_t *sb)
 void clear_file_entries(int sfs_handle, sfs_super_block_t *sb)
 {
 	int i;
-	byte1_t block[SIMULA_FS_BLOCK_SIZE];
+	byte1_t block[SIMULA_FS_MAX_BLOCK_SIZE];
+	unsigned long long range[2] = {
+		(unsigned long long)(sb->entry_table_block_start) * sb->block_size,
+		(unsigned long long)(sb->entry_table_size) * sb->block_size };
 
+	/* As the entries are all 0's, have a block device zero them itself, if it can */
+	if (ioctl(sfs_handle, BLKZEROOUT, range) == 0)
+	{
+		return;
+	}
 	for (i = 0; i < sb->block_size / sb->entry_size; i++)
 	{
 		memcpy(block + i * sb->entry_size, &fe, sizeof(fe));
 	}
+	lseek(sfs_handle, sb->entry_table_block_start * sb->block_size, SEEK_SET);
 	for (i = 0; i < sb->entry_table_size; i++)
 	{
-		write(sfs_handle, block, sizeof(block));
+		write(sfs_handle, block, sb->block_size);
 	}
 }
 
@@ -46,29 +56,52 @@ int main(int argc, char *argv[])
 {
 	int sfs_handle;
 	byte8_t size;
+	struct stat st;
+	char *dev;
 
-	if (argc != 2)
+	if ((argc == 4) && (strcmp(argv[1], "-b") == 0))
+	{
+		sb.block_size = atoi(argv[2]);
+		dev = argv[3];
+	}
+	else if (argc == 2)
+	{
+		dev = argv[1];
+	}
+	else
+	{
+		fprintf(stderr, "Usage: %s [ -b <block size> ] <partition's device file>\n", argv[0]);
+		return 1;
+	}
+	if ((sb.block_size < SIMULA_FS_BLOCK_SIZE) || (sb.block_size > SIMULA_FS_MAX_BLOCK_SIZE) ||
+		(sb.block_size & (sb.block_size - 1)))
 	{
-		fprintf(stderr, "Usage: %s <partition's device file>\n", argv[0]);
+		fprintf(stderr, "Block size should be a power of 2 from %d to %d\n",
+			SIMULA_FS_BLOCK_SIZE, SIMULA_FS_MAX_BLOCK_SIZE);
 		return 1;
 	}
-	sfs_handle = open(argv[1], O_RDWR);
+	sfs_handle = open(dev, O_RDWR);
 	if (sfs_handle == -1)
 	{
-		fprintf(stderr, "Error formatting %s: %s\n", argv[1], strerror(errno));
+		fprintf(stderr, "Error formatting %s: %s\n", dev, strerror(errno));
 		return 2;
 	}
 	if (ioctl(sfs_handle, BLKGETSIZE64, &size) == -1)
 	{
-		fprintf(stderr, "Error getting size of %s: %s\n", argv[1], strerror(errno));
-		return 3;
+		/* Not a block device. May be an image file */
+		if ((fstat(sfs_handle, &st) == -1) || !S_ISREG(st.st_mode))
+		{
+			fprintf(stderr, "Error getting size of %s: %s\n", dev, strerror(errno));
+			return 3;
+		}
+		size = st.st_size;
 	}
-	sb.partition_size = size / SIMULA_FS_BLOCK_SIZE;
+	sb.partition_size = size / sb.block_size;
 	sb.entry_table_size = sb.partition_size * SFS_ENTRY_RATIO;
 	sb.entry_count = sb.entry_table_size * sb.block_size / sb.entry_size;
 	sb.data_block_start = SFS_ENTRY_TABLE_BLOCK_START +  sb.entry_table_size;
 
-	printf("Partitioning %Ld byte sized %s ... ", size, argv[1]);
+	printf("Partitioning %Ld byte sized %s with %d byte blocks ... ", size, dev, sb.block_size);
 	fflush(stdout);
 	write_super_block(sfs_handle, &sb);
 	clear_file_entries(sfs_handle, &sb);
@@ -0,0 +1,472 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <dirent.h>
+
+#define DEF_FILE_CNT 100000
+#define DEF_SEQ_FILE_CNT 1000
+#define DEF_SEQ_FILE_SIZE 4 /* in KiB */
+#define DEF_STRESS_THREADS 8
+#define DEF_STRESS_FILE_CNT 1000 /* per thread */
+#define DEF_STRESS_FILE_SIZE 4 /* in KiB */
+#define DEF_STAT_ROUNDS 1000
+#define DEF_CHURN_FILE_CNT 16 /* Fits in a small directory, e.g. of AKPFS */
+#define DEF_CHURN_ROUNDS 1000
+#define IO_BUF_SIZE (128 * 1024)
+#define MAX_PATH_LEN 256
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void get_path(char *path, char *dir, int i)
+{
+	/* Names kept within the 15 characters of SFS file names */
+	snprintf(path, MAX_PATH_LEN, "%s/f%d", dir, i);
+}
+
+static void report(char *op, int cnt, double secs)
+{
+	printf("%-8s: %8d ops in %8.3f secs = %10.0f ops/sec\n",
+		op, cnt, secs, secs > 0 ? cnt / secs : 0);
+}
+
+static void report_bw(char *op, long long bytes, double secs)
+{
+	printf("%-8s: %8lld KiB in %8.3f secs = %10.2f MiB/sec\n",
+		op, bytes / 1024, secs, secs > 0 ? bytes / secs / (1024 * 1024) : 0);
+}
+
+int meta_bench(char *dir, int file_cnt)
+{
+	char path[MAX_PATH_LEN];
+	struct stat st;
+	int i, fd;
+	double start;
+
+	start = now();
+	for (i = 0; i < file_cnt; i++)
+	{
+		get_path(path, dir, i);
+		if ((fd = open(path, O_CREAT | O_EXCL | O_WRONLY, 0644)) == -1)
+		{
+			fprintf(stderr, "Error creating %s: %s\n", path, strerror(errno));
+			file_cnt = i;
+			break;
+		}
+		close(fd);
+	}
+	report("create", file_cnt, now() - start);
+
+	start = now();
+	for (i = 0; i < file_cnt; i++)
+	{
+		get_path(path, dir, i);
+		if (stat(path, &st) == -1)
+		{
+			fprintf(stderr, "Error looking up %s: %s\n", path, strerror(errno));
+		}
+	}
+	report("lookup", file_cnt, now() - start);
+
+	start = now();
+	for (i = 0; i < file_cnt; i++)
+	{
+		get_path(path, dir, i);
+		if (unlink(path) == -1)
+		{
+			fprintf(stderr, "Error unlinking %s: %s\n", path, strerror(errno));
+		}
+	}
+	report("unlink", file_cnt, now() - start);
+
+	return 0;
+}
+
+/*
+ * Creates & then unlinks file_cnt files, rounds times over, for the metadata
+ * ops/sec of a file system with small directories, where meta_bench's large
+ * file count doesn't fit
+ */
+int churn_bench(char *dir, int file_cnt, int rounds)
+{
+	char path[MAX_PATH_LEN];
+	int i, r, fd, creates = 0, unlinks = 0;
+	double start, t, create_secs = 0, unlink_secs = 0;
+
+	for (r = 0; r < rounds; r++)
+	{
+		t = now();
+		for (i = 0; i < file_cnt; i++)
+		{
+			get_path(path, dir, i);
+			if ((fd = open(path, O_CREAT | O_EXCL | O_WRONLY, 0644)) == -1)
+			{
+				fprintf(stderr, "Error creating %s: %s\n", path, strerror(errno));
+				return -1;
+			}
+			close(fd);
+			creates++;
+		}
+		start = now();
+		create_secs += start - t;
+		for (i = 0; i < file_cnt; i++)
+		{
+			get_path(path, dir, i);
+			if (unlink(path) == -1)
+			{
+				fprintf(stderr, "Error unlinking %s: %s\n", path, strerror(errno));
+				return -1;
+			}
+			unlinks++;
+		}
+		unlink_secs += now() - start;
+	}
+	report("create", creates, create_secs);
+	report("unlink", unlinks, unlink_secs);
+	report("churn", creates + unlinks, create_secs + unlink_secs);
+
+	return 0;
+}
+
+/*
+ * Writes file_cnt files of file_size bytes each, drops them from the page
+ * cache & then reads them back sequentially, for a cold read throughput
+ */
+int seq_bench(char *dir, int file_cnt, long long file_size)
+{
+	char path[MAX_PATH_LEN];
+	static char buf[IO_BUF_SIZE];
+	int i, fd, cnt;
+	long long done, bytes;
+	double start;
+
+	memset(buf, 0xA5, sizeof(buf));
+	bytes = 0;
+	start = now();
+	for (i = 0; i < file_cnt; i++)
+	{
+		get_path(path, dir, i);
+		if ((fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0644)) == -1)
+		{
+			fprintf(stderr, "Error creating %s: %s\n", path, strerror(errno));
+			return -1;
+		}
+		for (done = 0; done < file_size; done += cnt)
+		{
+			cnt = (file_size - done < IO_BUF_SIZE) ? file_size - done : IO_BUF_SIZE;
+			if ((cnt = write(fd, buf, cnt)) <= 0)
+			{
+				fprintf(stderr, "Error writing %s: %s\n", path, strerror(errno));
+				break;
+			}
+		}
+		fsync(fd);
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		close(fd);
+		bytes += done;
+	}
+	report_bw("write", bytes, now() - start);
+
+	bytes = 0;
+	start = now();
+	for (i = 0; i < file_cnt; i++)
+	{
+		get_path(path, dir, i);
+		if ((fd = open(path, O_RDONLY)) == -1)
+		{
+			fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+			return -1;
+		}
+		while ((cnt = read(fd, buf, IO_BUF_SIZE)) > 0)
+		{
+			bytes += cnt;
+		}
+		close(fd);
+	}
+	report_bw("read", bytes, now() - start);
+
+	for (i = 0; i < file_cnt; i++)
+	{
+		get_path(path, dir, i);
+		unlink(path);
+	}
+
+	return 0;
+}
+
+typedef struct
+{
+	char *dir;
+	int id;
+	int file_cnt;
+	int file_size;
+	int ops; /* Successful creates, writes & unlinks */
+} stress_arg_t;
+
+static void *stress_thread(void *arg)
+{
+	stress_arg_t *sa = (stress_arg_t *)arg;
+	char path[MAX_PATH_LEN];
+	static char buf[IO_BUF_SIZE]; /* Only read from, so shared */
+	int i, fd, cnt, done;
+
+	for (i = 0; i < sa->file_cnt; i++)
+	{
+		/* Names kept within the 15 characters of SFS file names */
+		snprintf(path, MAX_PATH_LEN, "%s/t%d_%d", sa->dir, sa->id, i);
+		if ((fd = open(path, O_CREAT | O_EXCL | O_WRONLY, 0644)) == -1)
+		{
+			fprintf(stderr, "Error creating %s: %s\n", path, strerror(errno));
+			break;
+		}
+		sa->ops++;
+		for (done = 0; done < sa->file_size; done += cnt)
+		{
+			cnt = (sa->file_size - done < IO_BUF_SIZE) ? sa->file_size - done : IO_BUF_SIZE;
+			if ((cnt = write(fd, buf, cnt)) <= 0)
+			{
+				fprintf(stderr, "Error writing %s: %s\n", path, strerror(errno));
+				break;
+			}
+		}
+		if (done >= sa->file_size)
+		{
+			sa->ops++;
+		}
+		close(fd);
+		if (unlink(path) == -1)
+		{
+			fprintf(stderr, "Error unlinking %s: %s\n", path, strerror(errno));
+			break;
+		}
+		sa->ops++;
+	}
+	return NULL;
+}
+
+/*
+ * Runs file_cnt create/write/unlink rounds on each of 1, 2, 4, ... up to
+ * max_threads concurrent threads, for the ops/sec scaling by thread count
+ */
+int stress_bench(char *dir, int max_threads, int file_cnt, int file_size)
+{
+	pthread_t *tids;
+	stress_arg_t *args;
+	char op[16];
+	int threads, i, ops;
+	double start;
+
+	if (max_threads < 1)
+	{
+		fprintf(stderr, "Invalid thread count %d\n", max_threads);
+		return -1;
+	}
+	if (!(tids = malloc(max_threads * sizeof(pthread_t))) || !(args = malloc(max_threads * sizeof(stress_arg_t))))
+	{
+		fprintf(stderr, "Out of memory\n");
+		return -1;
+	}
+	for (threads = 1; ; threads = (threads * 2 < max_threads) ? threads * 2 : max_threads)
+	{
+		start = now();
+		for (i = 0; i < threads; i++)
+		{
+			args[i].dir = dir;
+			args[i].id = i;
+			args[i].file_cnt = file_cnt;
+			args[i].file_size = file_size;
+			args[i].ops = 0;
+			if (pthread_create(&tids[i], NULL, stress_thread, &args[i]) != 0)
+			{
+				fprintf(stderr, "Error creating thread %d\n", i);
+				threads = i;
+				break;
+			}
+		}
+		ops = 0;
+		for (i = 0; i < threads; i++)
+		{
+			pthread_join(tids[i], NULL);
+			ops += args[i].ops;
+		}
+		snprintf(op, sizeof(op), "%dthr", threads);
+		report(op, ops, now() - start);
+		if (threads >= max_threads)
+			break;
+	}
+	free(args);
+	free(tids);
+
+	return 0;
+}
+
+static int drop_caches(void)
+{
+	int fd;
+
+	sync();
+	if ((fd = open("/proc/sys/vm/drop_caches", O_WRONLY)) == -1)
+	{
+		return -1;
+	}
+	if (write(fd, "3", 1) != 1)
+	{
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	return 0;
+}
+
+static char *next_name(DIR *d, FILE *f, char *name)
+/* Next name from the dir, or from the names file (a name per line), if given */
+{
+	struct dirent *de;
+	char *nl;
+
+	if (f)
+	{
+		while (fgets(name, MAX_PATH_LEN, f))
+		{
+			if ((nl = strchr(name, '\n')))
+				*nl = 0;
+			if (name[0])
+				return name;
+		}
+		return NULL;
+	}
+	while ((de = readdir(d)))
+	{
+		if (strcmp(de->d_name, ".") && strcmp(de->d_name, ".."))
+			return de->d_name;
+	}
+	return NULL;
+}
+
+/*
+ * stat()s all the names in the dir: Once cold, i.e. just after dropping the
+ * dentry, inode & buffer caches, & then warm, for rounds times over. Reading
+ * the dir builds its in-core lookup structures (say, the AKPFS dir cache), &
+ * for a dir pinned in memory (say, the root), dropping the caches doesn't
+ * free those. So, for a cold pass including those, the names are to be listed
+ * in the names file beforehand, & the fs freshly mounted
+ */
+int stat_bench(char *dir, int rounds, char *names_file)
+{
+	DIR *d = NULL;
+	FILE *f = NULL;
+	char name[MAX_PATH_LEN], *n;
+	char (*paths)[MAX_PATH_LEN] = NULL, (*p)[MAX_PATH_LEN];
+	struct stat st;
+	int cnt, i, r;
+	double start;
+
+	if (names_file ? !(f = fopen(names_file, "r")) : !(d = opendir(dir)))
+	{
+		fprintf(stderr, "Error opening %s: %s\n", names_file ? names_file : dir, strerror(errno));
+		return -1;
+	}
+	for (cnt = 0; (n = next_name(d, f, name)); )
+	{
+		if (!(p = realloc(paths, (cnt + 1) * sizeof(*paths))))
+		{
+			fprintf(stderr, "Out of memory\n");
+			break;
+		}
+		paths = p;
+		if (snprintf(paths[cnt], MAX_PATH_LEN, "%s/%s", dir, n) >= MAX_PATH_LEN)
+		{
+			fprintf(stderr, "Skipping %s, as its path is too long\n", n);
+			continue;
+		}
+		cnt++;
+	}
+	if (f)
+		fclose(f);
+	else
+		closedir(d);
+
+	if (drop_caches() == -1)
+	{
+		fprintf(stderr, "Unable to drop caches (%s). So, cold is not cold\n", strerror(errno));
+	}
+	start = now();
+	for (i = 0; i < cnt; i++)
+	{
+		if (stat(paths[i], &st) == -1)
+		{
+			fprintf(stderr, "Error stating %s: %s\n", paths[i], strerror(errno));
+		}
+	}
+	report("cold", cnt, now() - start);
+
+	start = now();
+	for (r = 0; r < rounds; r++)
+	{
+		for (i = 0; i < cnt; i++)
+		{
+			stat(paths[i], &st);
+		}
+	}
+	report("warm", cnt * rounds, now() - start);
+
+	free(paths);
+	return 0;
+}
+
+void usage(char *prog)
+{
+	fprintf(stderr, "Usage: %s <mounted fs dir> meta [ <file count> ]\n", prog);
+	fprintf(stderr, "       %s <mounted fs dir> churn [ <file count> [ <rounds> ] ]\n", prog);
+	fprintf(stderr, "       %s <mounted fs dir> seq [ <file size in KiB> [ <file count> ] ]\n", prog);
+	fprintf(stderr, "       %s <dir> stat [ <warm rounds> [ <names file> ] ]\n", prog);
+	fprintf(stderr, "       %s <mounted fs dir> stress [ <max threads> [ <file count per thread> [ <file size in KiB> ] ] ]\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 3)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+	if ((strcmp(argv[2], "meta") == 0) && (argc <= 4))
+	{
+		return meta_bench(argv[1], (argc > 3) ? atoi(argv[3]) : DEF_FILE_CNT);
+	}
+	else if ((strcmp(argv[2], "churn") == 0) && (argc <= 5))
+	{
+		return churn_bench(argv[1], (argc > 3) ? atoi(argv[3]) : DEF_CHURN_FILE_CNT,
+			(argc > 4) ? atoi(argv[4]) : DEF_CHURN_ROUNDS);
+	}
+	else if ((strcmp(argv[2], "seq") == 0) && (argc <= 5))
+	{
+		return seq_bench(argv[1], (argc > 4) ? atoi(argv[4]) : DEF_SEQ_FILE_CNT,
+			1024LL * ((argc > 3) ? atoll(argv[3]) : DEF_SEQ_FILE_SIZE));
+	}
+	else if ((strcmp(argv[2], "stress") == 0) && (argc <= 6))
+	{
+		return stress_bench(argv[1], (argc > 3) ? atoi(argv[3]) : DEF_STRESS_THREADS,
+			(argc > 4) ? atoi(argv[4]) : DEF_STRESS_FILE_CNT,
+			1024 * ((argc > 5) ? atoi(argv[5]) : DEF_STRESS_FILE_SIZE));
+	}
+	else if ((strcmp(argv[2], "stat") == 0) && (argc <= 5))
+	{
+		return stat_bench(argv[1], (argc > 3) ? atoi(argv[3]) : DEF_STAT_ROUNDS,
+			(argc > 4) ? argv[4] : NULL);
+	}
+	usage(argv[0]);
+	return 1;
+}
@@ -0,0 +1,1035 @@
+/*
+ * Checker for the akp fs (akpfs.h) & the real sfs (real_sfs_ds.h) images. The
+ * image is mmap-ed, & checked in place in these passes, each split over the
+ * threads by ranges:
+ * 1. Inodes/entries: Validates them, & builds the used blocks bitmap (flagging
+ *    the blocks used twice) & the inode reference counts, in one sequential
+ *    pass over the inode/entry table
+ * 2. Cross references (akp fs): Dir entries to free inodes, & orphan inodes,
+ *    other than the ones on the super block's orphan list (freed on mount)
+ * 3. Bitmap: Compares the built bitmap against the on-disk free bits (akp fs),
+ *    or just counts it (real sfs, as its free map is built at mount)
+ * With -r, the fixable errors are fixed, including rebuilding the free bits.
+ * An akp fs journal, if any, is replayed first with -r. Otherwise, its pending
+ * transaction is just reported
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h> /* For BLKGETSIZE64 */
+#include <pthread.h>
+#include <time.h>
+
+#include "akpfs.h"
+#include "real_sfs_ds.h"
+
+#define MAX_THREADS 64
+#define MAX_REPORTS 50 /* Errors printed, unless verbose */
+#define BITS_PER_LONG (8 * sizeof(unsigned long))
+
+/* Exit codes, as those of e2fsck */
+#define FSCK_OK 0
+#define FSCK_FIXED 1
+#define FSCK_ERRORS 4
+#define FSCK_OP_ERROR 8
+#define FSCK_USAGE 16
+
+struct work
+{
+	unsigned int start, end; // Range of the inodes/entries/bitmap bytes for a thread
+};
+
+struct fsck
+{
+	unsigned char *img;
+	long long img_size;
+	int rebuild;
+	int verbose;
+	int thread_cnt;
+	unsigned int block_size;
+	unsigned int block_cnt;
+	unsigned long *used; // Built used blocks bitmap, updated atomically
+	unsigned int inode_cnt;
+	unsigned char *in_use; // Per inode: 1, if used; 2, if also on the orphan list (akp fs)
+	unsigned short *refs; // Per inode: Dir entries referring it (akp fs)
+	long errors; // Found
+	long fixed; // Of the errors found
+	long freed_inodes; // Orphans freed, with -r
+	long used_inodes, dirs, used_blocks, leaked_blocks;
+	long long bytes_scanned; // Metadata bytes read, for the throughput
+	pthread_mutex_t report_lock;
+	long reports;
+} fsck;
+
+static void report(int fixed, const char *fmt, ...)
+/* Counts an error, & prints it, within the MAX_REPORTS unless verbose */
+{
+	va_list ap;
+
+	pthread_mutex_lock(&fsck.report_lock);
+	fsck.errors++;
+	if (fixed)
+	{
+		fsck.fixed++;
+	}
+	if (fsck.verbose || (fsck.reports < MAX_REPORTS))
+	{
+		va_start(ap, fmt);
+		vprintf(fmt, ap);
+		va_end(ap);
+		printf("%s\n", fixed ? " - fixed" : "");
+	}
+	else if (fsck.reports == MAX_REPORTS)
+	{
+		printf("... (more errors not listed. Use -v for all)\n");
+	}
+	fsck.reports++;
+	pthread_mutex_unlock(&fsck.report_lock);
+}
+
+static void count(long *counter, long n)
+{
+	__atomic_add_fetch(counter, n, __ATOMIC_RELAXED);
+}
+
+static inline void *block_ptr(unsigned int block)
+{
+	return fsck.img + (size_t)(block) * fsck.block_size;
+}
+
+static int mark_block(unsigned int block)
+/* Marks the block used in the built bitmap. Returns 1, if already marked */
+{
+	unsigned long mask = 1UL << (block % BITS_PER_LONG);
+
+	return !!(__atomic_fetch_or(&fsck.used[block / BITS_PER_LONG], mask, __ATOMIC_RELAXED) & mask);
+}
+
+static void run_threads(void *(*fn)(void *), unsigned int cnt)
+/* Runs fn over [0, cnt), split in contiguous ranges over the threads */
+{
+	pthread_t tids[MAX_THREADS];
+	struct work w[MAX_THREADS];
+	int started[MAX_THREADS];
+	unsigned int i, per = (cnt + fsck.thread_cnt - 1) / fsck.thread_cnt;
+
+	for (i = 0; i < fsck.thread_cnt; i++)
+	{
+		w[i].start = (i * per < cnt) ? i * per : cnt;
+		w[i].end = (w[i].start + per < cnt) ? w[i].start + per : cnt;
+		if (!(started[i] = !pthread_create(&tids[i], NULL, fn, &w[i])))
+		{
+			fn(&w[i]); // Just do it here
+		}
+	}
+	for (i = 0; i < fsck.thread_cnt; i++)
+	{
+		if (started[i])
+		{
+			pthread_join(tids[i], NULL);
+		}
+	}
+}
+
+/* crc32_le, as in the kernel: Reflected 0xEDB88320, without the pre/post inversion */
+static unsigned int crc32_table[256];
+
+static void crc32_init(void)
+{
+	unsigned int i, j, c;
+
+	for (i = 0; i < 256; i++)
+	{
+		for (c = i, j = 0; j < 8; j++)
+		{
+			c = (c & 1) ? (c >> 1) ^ 0xEDB88320 : c >> 1;
+		}
+		crc32_table[i] = c;
+	}
+}
+
+static unsigned int crc32_le(unsigned int crc, const unsigned char *p, size_t len)
+{
+	while (len--)
+	{
+		crc = crc32_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+	}
+	return crc;
+}
+
+/* ---------------------------------- akp fs ---------------------------------- */
+
+static struct akpfs_sb *akp_sb;
+
+static inline struct akpfs_inode *akp_inode(unsigned int ino)
+{
+	return (struct akpfs_inode *)(block_ptr(akp_sb->inodes_block_start + ino / akp_sb->inodes_per_block)) +
+		(ino % akp_sb->inodes_per_block);
+}
+
+static unsigned int akp_itable_init_cnt(void)
+{
+	return (akp_sb->feature_flags & AKPFS_FEATURE_LAZY_ITABLE) ?
+		akp_sb->inodes_block_init_cnt : akp_sb->inodes_block_cnt;
+}
+
+static int akp_check_sb(void)
+{
+	struct akpfs_sb *sb = akp_sb;
+	unsigned int bs = sb->block_size;
+	unsigned int next;
+
+	if ((bs < SIMULA_FS_BLOCK_SIZE) || (bs > 4096) || (bs & (bs - 1)))
+	{
+		fprintf(stderr, "Invalid block size %u\n", bs);
+		return -1;
+	}
+	if ((long long)(sb->block_cnt) * bs > fsck.img_size)
+	{
+		fprintf(stderr, "%u blocks of %u bytes exceed the image (%lld bytes)\n",
+			sb->block_cnt, bs, fsck.img_size);
+		return -1;
+	}
+	if (sb->feature_flags & ~AKPFS_SUPPORTED_FEATURES)
+	{
+		fprintf(stderr, "Unsupported features 0x%X\n", sb->feature_flags & ~AKPFS_SUPPORTED_FEATURES);
+		return -1;
+	}
+	next = sb->inodes_block_start + sb->inodes_block_cnt;
+	if ((sb->inodes_per_block != bs / sizeof(struct akpfs_inode)) || (sb->inodes_block_start != 1) ||
+		(sb->free_bits_block_start != next) ||
+		((long long)(sb->free_bits_block_cnt) * bs * 8 < sb->block_cnt))
+	{
+		fprintf(stderr, "Inconsistent inode/free bits layout\n");
+		return -1;
+	}
+	next = sb->free_bits_block_start + sb->free_bits_block_cnt;
+	if (sb->feature_flags & AKPFS_FEATURE_JOURNAL)
+	{
+		if ((sb->journal_block_start != next) ||
+			(akpfs_journal_capacity(sb->journal_block_cnt, bs) <
+				akpfs_journal_handle_blocks(sb->free_bits_block_cnt)))
+		{
+			fprintf(stderr, "Invalid journal of %u blocks at %u\n",
+				sb->journal_block_cnt, sb->journal_block_start);
+			return -1;
+		}
+		next += sb->journal_block_cnt;
+	}
+	if ((sb->data_block_start != next) || (next > sb->block_cnt) ||
+		(sb->data_block_cnt != sb->block_cnt - next))
+	{
+		fprintf(stderr, "Inconsistent data block layout\n");
+		return -1;
+	}
+	if ((sb->feature_flags & AKPFS_FEATURE_LAZY_ITABLE) &&
+		(sb->inodes_block_init_cnt > sb->inodes_block_cnt))
+	{
+		fprintf(stderr, "Initialized inode blocks %u exceed the inode blocks %u\n",
+			sb->inodes_block_init_cnt, sb->inodes_block_cnt);
+		return -1;
+	}
+	fsck.block_cnt = sb->block_cnt;
+	fsck.inode_cnt = sb->inodes_block_cnt * sb->inodes_per_block;
+	if (!sb->root_inode || (sb->root_inode >= akp_itable_init_cnt() * sb->inodes_per_block))
+	{
+		fprintf(stderr, "Invalid root inode #%u\n", sb->root_inode);
+		return -1;
+	}
+	return 0;
+}
+
+static void akp_check_journal(void)
+/*
+ * Replays the pending transaction with -r, as the driver would on mount, so
+ * that the checks see the committed metadata. Otherwise, just reports it
+ */
+{
+	struct akpfs_sb *sb = akp_sb;
+	struct akpfs_journal_header *h;
+	unsigned int tpb = sb->block_size / sizeof(unsigned int);
+	unsigned int cnt, tag_cnt, i, home, crc, *tags;
+	unsigned char *copies;
+
+	if (!(sb->feature_flags & AKPFS_FEATURE_JOURNAL))
+	{
+		return;
+	}
+	h = (struct akpfs_journal_header *)(block_ptr(sb->journal_block_start));
+	fsck.bytes_scanned += sb->block_size;
+	if (h->magic != AKPFS_JOURNAL_MAGIC)
+	{
+		return;
+	}
+	cnt = h->block_cnt;
+	tag_cnt = (cnt + tpb - 1) / tpb;
+	tags = (unsigned int *)(block_ptr(sb->journal_block_start + 1));
+	copies = block_ptr(sb->journal_block_start + 1 + tag_cnt);
+	crc = ~0;
+	if (cnt && (cnt <= akpfs_journal_capacity(sb->journal_block_cnt, sb->block_size)))
+	{
+		crc = crc32_le(crc, (unsigned char *)(tags), (size_t)(tag_cnt + cnt) * sb->block_size);
+		crc = crc32_le(crc, (unsigned char *)(&h->seq), sizeof(h->seq));
+		crc = crc32_le(crc, (unsigned char *)(&h->block_cnt), sizeof(h->block_cnt));
+		fsck.bytes_scanned += (long long)(tag_cnt + cnt) * sb->block_size;
+	}
+	if (!cnt || (crc != h->checksum))
+	{
+		/* Crashed before the commit point. So, the home blocks are as they were */
+		report(fsck.rebuild, "Journal: Incomplete transaction %u of %u blocks", h->seq, cnt);
+		if (fsck.rebuild)
+		{
+			memset(h, 0, sb->block_size);
+		}
+		return;
+	}
+	for (i = 0; i < cnt; i++)
+	{
+		home = tags[i];
+		if ((home >= sb->block_cnt) ||
+			((home >= sb->journal_block_start) && (home < sb->journal_block_start + sb->journal_block_cnt)))
+		{
+			report(0, "Journal: Transaction %u has invalid block #%u. Not replayed", h->seq, home);
+			return;
+		}
+	}
+	if (!fsck.rebuild)
+	{
+		report(0, "Journal: Transaction %u of %u blocks to be replayed. Results may be stale",
+			h->seq, cnt);
+		return;
+	}
+	for (i = 0; i < cnt; i++)
+	{
+		memcpy(block_ptr(tags[i]), copies + (size_t)(i) * sb->block_size, sb->block_size);
+	}
+	report(1, "Journal: Transaction %u of %u blocks replayed", h->seq, cnt);
+	memset(h, 0, sb->block_size);
+}
+
+static int akp_mark_range(unsigned int ino, unsigned int block, unsigned int cnt, int recount)
+/*
+ * Marks the blocks, reporting the out of range & the already used ones, unless
+ * a recount, as those are already reported
+ */
+{
+	unsigned int i;
+
+	if ((block < akp_sb->data_block_start) || (block >= akp_sb->block_cnt) ||
+		(cnt > akp_sb->block_cnt - block))
+	{
+		if (!recount)
+		{
+			report(0, "Inode %u: Blocks %u+%u out of the data blocks", ino, block, cnt);
+		}
+		return -1;
+	}
+	for (i = 0; i < cnt; i++)
+	{
+		if (mark_block(block + i) && !recount)
+		{
+			report(0, "Inode %u: Block %u already in use", ino, block + i);
+		}
+	}
+	count(&fsck.used_blocks, cnt);
+	return 0;
+}
+
+static void akp_mark_file(unsigned int ino, struct akpfs_inode *inode, int recount)
+/* Marks the blocks of the file, including its extent block */
+{
+	struct akpfs_extent *e;
+	unsigned int i, ext_block, epb = akp_sb->block_size / sizeof(struct akpfs_extent);
+
+	if (!(akp_sb->feature_flags & AKPFS_FEATURE_EXTENTS))
+	{
+		for (i = 0; i < AKPFS_MAX_BLOCKS_PER_FILE; i++)
+		{
+			if (inode->u.file_blocks[i])
+			{
+				akp_mark_range(ino, inode->u.file_blocks[i], 1, recount);
+			}
+		}
+		return;
+	}
+	for (i = 0; i < AKPFS_DIRECT_EXTENTS; i++)
+	{
+		e = &inode->u.extents[i];
+		if (e->block_cnt)
+		{
+			akp_mark_range(ino, e->block, e->block_cnt, recount);
+		}
+	}
+	if (!(ext_block = inode->u.extents[AKPFS_EXTENT_BLOCK].block) ||
+		(akp_mark_range(ino, ext_block, 1, recount) < 0))
+	{
+		return;
+	}
+	e = (struct akpfs_extent *)(block_ptr(ext_block));
+	if (!recount)
+	{
+		__atomic_add_fetch(&fsck.bytes_scanned, akp_sb->block_size, __ATOMIC_RELAXED);
+	}
+	for (i = 0; i < epb; i++)
+	{
+		if (e[i].block_cnt)
+		{
+			akp_mark_range(ino, e[i].block, e[i].block_cnt, recount);
+		}
+	}
+}
+
+static void *akp_scan_inodes(void *arg)
+/* Pass 1: Validates the inodes, & marks their blocks & the inodes referred by the dirs */
+{
+	struct work *w = (struct work *)(arg);
+	struct akpfs_inode *inode;
+	unsigned int ino, i, e;
+	long used = 0, dirs = 0;
+
+	for (ino = w->start; ino < w->end; ino++)
+	{
+		inode = akp_inode(ino);
+		if (!inode->file_name[0])
+		{
+			continue;
+		}
+		if (!ino)
+		{
+			report(0, "Inode 0 in use, as %.16s", inode->file_name);
+			continue;
+		}
+		fsck.in_use[ino] = 1;
+		used++;
+		if (inode->file_size == akpfs_dir)
+		{
+			dirs++;
+			for (i = 0; i < AKPFS_MAX_ENTRIES_PER_DIR; i++)
+			{
+				if ((e = inode->u.dir_entries[i]) && (e < fsck.inode_cnt))
+				{
+					__atomic_add_fetch(&fsck.refs[e], 1, __ATOMIC_RELAXED);
+				}
+			}
+		}
+		else if (inode->file_size >= 0)
+		{
+			akp_mark_file(ino, inode, 0);
+		}
+		else if (inode->file_size != akpfs_link)
+		{
+			report(0, "Inode %u (%.16s): Invalid file size %d", ino, inode->file_name, inode->file_size);
+		}
+	}
+	count(&fsck.used_inodes, used);
+	count(&fsck.dirs, dirs);
+	return NULL;
+}
+
+static void akp_check_orphans(void)
+/*
+ * Flags the inodes on the orphan list, being unlinked but still open at the
+ * crash, as they are freed by the driver on mount. Invalid entries are dropped
+ */
+{
+	struct akpfs_orphans *o = akpfs_orphans(akp_sb);
+	unsigned int i, ino, max = akpfs_max_orphans(akp_sb->block_size);
+
+	if (o->cnt > max)
+	{
+		report(fsck.rebuild, "Orphan list: Invalid count %u", o->cnt);
+		if (fsck.rebuild)
+		{
+			memset(o, 0, sizeof(struct akpfs_orphans) + max * sizeof(unsigned int));
+		}
+		return;
+	}
+	for (i = 0; i < o->cnt; )
+	{
+		ino = o->ino[i];
+		if ((ino >= fsck.inode_cnt) || !fsck.in_use[ino] || (ino == akp_sb->root_inode) ||
+			(fsck.in_use[ino] == 2) || fsck.refs[ino])
+		{
+			report(fsck.rebuild, "Orphan list: Entry %u to invalid/free/listed/linked inode %u", i, ino);
+			if (fsck.rebuild)
+			{
+				o->ino[i] = o->ino[--o->cnt];
+				o->ino[o->cnt] = 0;
+				continue;
+			}
+		}
+		else
+		{
+			fsck.in_use[ino] = 2;
+			if (fsck.verbose)
+			{
+				printf("Inode %u (%.16s): Orphan, to be freed on mount\n", ino, akp_inode(ino)->file_name);
+			}
+		}
+		i++;
+	}
+}
+
+static void akp_free_inode(unsigned int ino, struct akpfs_inode *inode)
+/*
+ * Frees an orphan. Its blocks are left marked, as another inode may share
+ * them, & so freed by the recount (akp_recount_blocks)
+ */
+{
+	if (inode->file_size == akpfs_dir)
+	{
+		count(&fsck.dirs, -1);
+	}
+	memset(inode, 0, sizeof(struct akpfs_inode));
+	fsck.in_use[ino] = 0;
+	count(&fsck.used_inodes, -1);
+	count(&fsck.freed_inodes, 1);
+}
+
+static void *akp_check_refs(void *arg)
+/*
+ * Pass 2: Dir entries to the free (or out of range) inodes are dropped, & the
+ * inodes not in any dir (orphans) are freed, with -r
+ */
+{
+	struct work *w = (struct work *)(arg);
+	struct akpfs_inode *inode;
+	unsigned int ino, i, e;
+
+	for (ino = w->start; ino < w->end; ino++)
+	{
+		if (!fsck.in_use[ino])
+		{
+			continue;
+		}
+		inode = akp_inode(ino);
+		if (inode->file_size == akpfs_dir)
+		{
+			if ((ino == akp_sb->root_inode) && strncmp(inode->file_name, "/", AKPFS_MAX_FILE_NAME_SIZE))
+			{
+				report(0, "Root inode %u named %.16s", ino, inode->file_name);
+			}
+			for (i = 0; i < AKPFS_MAX_ENTRIES_PER_DIR; i++)
+			{
+				if (!(e = inode->u.dir_entries[i]))
+				{
+					continue;
+				}
+				if ((e >= fsck.inode_cnt) || !fsck.in_use[e] || (e == akp_sb->root_inode))
+				{
+					report(fsck.rebuild, "Dir inode %u (%.16s): Entry %d to invalid/free inode %u",
+						ino, inode->file_name, i, e);
+					if (fsck.rebuild)
+					{
+						inode->u.dir_entries[i] = 0;
+					}
+				}
+			}
+		}
+		else if (ino == akp_sb->root_inode)
+		{
+			report(0, "Root inode %u is not a dir", ino);
+		}
+		if (ino == akp_sb->root_inode)
+		{
+			continue;
+		}
+		if (!fsck.refs[ino] && (fsck.in_use[ino] == 2))
+		{
+			continue; // On the orphan list
+		}
+		if (!fsck.refs[ino])
+		{
+			report(fsck.rebuild, "Inode %u (%.16s): Not in any dir", ino, inode->file_name);
+			if (fsck.rebuild)
+			{
+				akp_free_inode(ino, inode);
+			}
+		}
+		else if (fsck.refs[ino] > 1)
+		{
+			report(0, "Inode %u (%.16s): In %u dir entries", ino, inode->file_name, fsck.refs[ino]);
+		}
+	}
+	return NULL;
+}
+
+static void akp_free_orphan_children(void)
+/*
+ * The entries of the orphan dirs freed by pass 2 were counted as references.
+ * So, recounts them, & frees the inodes left in no dir, till none is left
+ */
+{
+	struct akpfs_inode *inode;
+	unsigned int ino, i, e, cnt = akp_itable_init_cnt() * akp_sb->inodes_per_block;
+	int freed;
+
+	do
+	{
+		memset(fsck.refs, 0, fsck.inode_cnt * sizeof(unsigned short));
+		for (ino = 0; ino < cnt; ino++)
+		{
+			inode = akp_inode(ino);
+			if (!fsck.in_use[ino] || (inode->file_size != akpfs_dir))
+			{
+				continue;
+			}
+			for (i = 0; i < AKPFS_MAX_ENTRIES_PER_DIR; i++)
+			{
+				if ((e = inode->u.dir_entries[i]) && (e < fsck.inode_cnt))
+				{
+					fsck.refs[e]++;
+				}
+			}
+		}
+		freed = 0;
+		for (ino = 0; ino < cnt; ino++)
+		{
+			if ((fsck.in_use[ino] != 1) || fsck.refs[ino] || (ino == akp_sb->root_inode))
+			{
+				continue;
+			}
+			inode = akp_inode(ino);
+			report(1, "Inode %u (%.16s): In a freed orphan dir", ino, inode->file_name);
+			akp_free_inode(ino, inode);
+			freed = 1;
+		}
+	}
+	while (freed);
+}
+
+static void *akp_recount_blocks(void *arg)
+/* Re-marks the blocks of the inodes left, after the orphans are freed */
+{
+	struct work *w = (struct work *)(arg);
+	struct akpfs_inode *inode;
+	unsigned int ino;
+
+	for (ino = w->start; ino < w->end; ino++)
+	{
+		inode = akp_inode(ino);
+		if (fsck.in_use[ino] && (inode->file_size >= 0))
+		{
+			akp_mark_file(ino, inode, 1);
+		}
+	}
+	return NULL;
+}
+
+static void *akp_check_bitmap(void *arg)
+/* Pass 3: Compares (& with -r, rewrites) the on-disk free bits bytes against the built ones */
+{
+	struct work *w = (struct work *)(arg);
+	unsigned char *disk = block_ptr(akp_sb->free_bits_block_start);
+	unsigned char *built = (unsigned char *)(fsck.used); // Little endian, as the on-disk ones
+	unsigned int i, b, last = akp_sb->block_cnt / 8;
+	unsigned char mask, diff;
+	long leaked = 0;
+
+	for (i = w->start; i < w->end; i++)
+	{
+		/* Bits beyond the block_cnt, in the last byte, are don't care */
+		mask = (i < last) ? 0xFF : (0xFF >> (8 - akp_sb->block_cnt % 8));
+		if (!(diff = (disk[i] ^ built[i]) & mask))
+		{
+			continue;
+		}
+		for (b = 0; b < 8; b++)
+		{
+			if (!(diff & (1 << b)))
+			{
+				continue;
+			}
+			if (built[i] & (1 << b))
+			{
+				report(fsck.rebuild, "Block %u: In use, but marked free", i * 8 + b);
+			}
+			else
+			{
+				/* Harmless, but lost till fixed */
+				leaked++;
+				if (fsck.verbose)
+				{
+					printf("Block %u: Marked used, but not in use\n", i * 8 + b);
+				}
+			}
+		}
+		if (fsck.rebuild)
+		{
+			disk[i] = (disk[i] & ~mask) | (built[i] & mask);
+		}
+	}
+	count(&fsck.leaked_blocks, leaked);
+	return NULL;
+}
+
+static int akp_fsck(void)
+{
+	unsigned int i, bitmap_bytes;
+
+	akp_sb = (struct akpfs_sb *)(fsck.img);
+	fsck.block_size = akp_sb->block_size;
+	if (akp_check_sb() < 0)
+	{
+		return -1;
+	}
+	printf("akp fs: %u blocks of %u bytes; %u inodes (%u blocks initialized); Features: 0x%X\n",
+		akp_sb->block_cnt, akp_sb->block_size, fsck.inode_cnt, akp_itable_init_cnt(),
+		akp_sb->feature_flags);
+	if (!(fsck.used = calloc((fsck.block_cnt + BITS_PER_LONG - 1) / BITS_PER_LONG, sizeof(unsigned long))) ||
+		!(fsck.in_use = calloc(fsck.inode_cnt, sizeof(unsigned char))) ||
+		!(fsck.refs = calloc(fsck.inode_cnt, sizeof(unsigned short))))
+	{
+		fprintf(stderr, "Out of memory\n");
+		return -1;
+	}
+	/* Metadata blocks (super, inode, free bits & journal) are always used */
+	for (i = 0; i < akp_sb->data_block_start; i++)
+	{
+		mark_block(i);
+	}
+
+	akp_check_journal();
+	/* Inodes in the uninitialized inode blocks are all free, & so not scanned */
+	run_threads(akp_scan_inodes, akp_itable_init_cnt() * akp_sb->inodes_per_block);
+	fsck.bytes_scanned += (long long)(akp_itable_init_cnt()) * akp_sb->block_size;
+	akp_check_orphans();
+	run_threads(akp_check_refs, akp_itable_init_cnt() * akp_sb->inodes_per_block);
+	if (fsck.freed_inodes)
+	{
+		akp_free_orphan_children();
+		/* Rebuilds the used blocks bitmap, for only the blocks of no inode left to be free */
+		memset(fsck.used, 0, (fsck.block_cnt + BITS_PER_LONG - 1) / BITS_PER_LONG * sizeof(unsigned long));
+		for (i = 0; i < akp_sb->data_block_start; i++)
+		{
+			mark_block(i);
+		}
+		fsck.used_blocks = 0;
+		run_threads(akp_recount_blocks, akp_itable_init_cnt() * akp_sb->inodes_per_block);
+	}
+	bitmap_bytes = (akp_sb->block_cnt + 7) / 8;
+	run_threads(akp_check_bitmap, bitmap_bytes);
+	fsck.bytes_scanned += bitmap_bytes;
+	if (fsck.leaked_blocks)
+	{
+		report(fsck.rebuild, "%ld blocks marked used, but not in use", fsck.leaked_blocks);
+	}
+
+	printf("%ld inodes (%ld dirs) used; %ld data blocks used of %u\n",
+		fsck.used_inodes, fsck.dirs, fsck.used_blocks, akp_sb->data_block_cnt);
+	free(fsck.refs);
+	free(fsck.in_use);
+	free(fsck.used);
+	return 0;
+}
+
+/* --------------------------------- real sfs --------------------------------- */
+
+static sfs_super_block_t *sfs_sb;
+
+static int sfs_check_sb(void)
+{
+	sfs_super_block_t *sb = sfs_sb;
+	unsigned int bs = sb->block_size;
+
+	if ((bs < SIMULA_FS_BLOCK_SIZE) || (bs > SIMULA_FS_MAX_BLOCK_SIZE) || (bs & (bs - 1)))
+	{
+		fprintf(stderr, "Invalid block size %u\n", bs);
+		return -1;
+	}
+	if (sb->version > SIMULA_FS_VERSION)
+	{
+		fprintf(stderr, "Unsupported version %u\n", sb->version);
+		return -1;
+	}
+	if ((long long)(sb->partition_size) * bs > fsck.img_size)
+	{
+		fprintf(stderr, "%u blocks of %u bytes exceed the image (%lld bytes)\n",
+			sb->partition_size, bs, fsck.img_size);
+		return -1;
+	}
+	if ((sb->entry_size != sizeof(sfs_file_entry_t)) || !sb->entry_table_block_start ||
+		(sb->data_block_start != sb->entry_table_block_start + sb->entry_table_size) ||
+		(sb->data_block_start > sb->partition_size) ||
+		((long long)(sb->entry_count) * sb->entry_size > (long long)(sb->entry_table_size) * bs))
+	{
+		fprintf(stderr, "Inconsistent entry table layout\n");
+		return -1;
+	}
+	fsck.block_cnt = sb->partition_size;
+	fsck.inode_cnt = sb->entry_count;
+	return 0;
+}
+
+static int sfs_mark(unsigned int entry, byte4_t *ptr)
+/* Marks the block *ptr, dropping it with -r, if out of range. Returns -1, if not to be followed */
+{
+	if ((*ptr < sfs_sb->data_block_start) || (*ptr >= sfs_sb->partition_size))
+	{
+		report(fsck.rebuild, "Entry %u: Block %u out of the data blocks", entry, *ptr);
+		if (fsck.rebuild)
+		{
+			*ptr = 0;
+		}
+		return -1;
+	}
+	if (mark_block(*ptr))
+	{
+		report(0, "Entry %u: Block %u already in use", entry, *ptr);
+		return -1; // Its pointers, if any, are already marked
+	}
+	count(&fsck.used_blocks, 1);
+	return 0;
+}
+
+static void sfs_mark_ptr_block(unsigned int entry, byte4_t *ptr, int depth)
+{
+	byte4_t *ptrs;
+	unsigned int i;
+
+	if (sfs_mark(entry, ptr) < 0)
+	{
+		return;
+	}
+	ptrs = (byte4_t *)(block_ptr(*ptr));
+	__atomic_add_fetch(&fsck.bytes_scanned, sfs_sb->block_size, __ATOMIC_RELAXED);
+	for (i = 0; i < sfs_sb->block_size / sizeof(byte4_t); i++)
+	{
+		if (!ptrs[i])
+		{
+			continue;
+		}
+		if (depth == 1)
+		{
+			sfs_mark(entry, &ptrs[i]);
+		}
+		else
+		{
+			sfs_mark_ptr_block(entry, &ptrs[i], depth - 1);
+		}
+	}
+}
+
+static void *sfs_scan_entries(void *arg)
+/* Pass 1: Validates the entries, & marks their blocks, including the indirect ones */
+{
+	struct work *w = (struct work *)(arg);
+	sfs_file_entry_t *entries = (sfs_file_entry_t *)(block_ptr(sfs_sb->entry_table_block_start));
+	sfs_file_entry_t *fe;
+	unsigned int i, j, direct_cnt;
+	long used = 0;
+
+	direct_cnt = (sfs_sb->version == SIMULA_FS_VERSION_DIRECT) ?
+		SIMULA_FS_DATA_BLOCK_CNT : SIMULA_FS_IND_BLOCK;
+	for (i = w->start; i < w->end; i++)
+	{
+		fe = &entries[i];
+		if (!fe->name[0])
+		{
+			continue;
+		}
+		used++;
+		if (fe->name[SIMULA_FS_FILENAME_LEN])
+		{
+			report(fsck.rebuild, "Entry %u: Unterminated name %.15s", i, fe->name);
+			if (fsck.rebuild)
+			{
+				fe->name[SIMULA_FS_FILENAME_LEN] = 0;
+			}
+		}
+		if (fe->perms > 07)
+		{
+			report(fsck.rebuild, "Entry %u (%s): Invalid permissions 0%o", i, fe->name, fe->perms);
+			if (fsck.rebuild)
+			{
+				fe->perms &= 07;
+			}
+		}
+		for (j = 0; j < direct_cnt; j++)
+		{
+			if (fe->blocks[j])
+			{
+				sfs_mark(i, &fe->blocks[j]);
+			}
+		}
+		if (sfs_sb->version == SIMULA_FS_VERSION_DIRECT)
+		{
+			continue;
+		}
+		if (fe->blocks[SIMULA_FS_IND_BLOCK])
+		{
+			sfs_mark_ptr_block(i, &fe->blocks[SIMULA_FS_IND_BLOCK], 1);
+		}
+		if (fe->blocks[SIMULA_FS_DIND_BLOCK])
+		{
+			sfs_mark_ptr_block(i, &fe->blocks[SIMULA_FS_DIND_BLOCK], 2);
+		}
+	}
+	count(&fsck.used_inodes, used);
+	return NULL;
+}
+
+static int sfs_fsck(void)
+{
+	unsigned int i;
+
+	sfs_sb = (sfs_super_block_t *)(fsck.img);
+	fsck.block_size = sfs_sb->block_size;
+	if (sfs_check_sb() < 0)
+	{
+		return -1;
+	}
+	printf("real sfs: %u blocks of %u bytes; %u entries; Version: %u\n",
+		sfs_sb->partition_size, sfs_sb->block_size, sfs_sb->entry_count, sfs_sb->version);
+	if (!(fsck.used = calloc((fsck.block_cnt + BITS_PER_LONG - 1) / BITS_PER_LONG, sizeof(unsigned long))))
+	{
+		fprintf(stderr, "Out of memory\n");
+		return -1;
+	}
+	for (i = 0; i < sfs_sb->data_block_start; i++)
+	{
+		mark_block(i);
+	}
+	/* No on-disk free map to check: The driver builds it from the entries, on mount */
+	run_threads(sfs_scan_entries, sfs_sb->entry_count);
+	fsck.bytes_scanned += (long long)(sfs_sb->entry_table_size) * sfs_sb->block_size;
+
+	printf("%ld entries used; %ld data blocks used of %u\n",
+		fsck.used_inodes, fsck.used_blocks, sfs_sb->partition_size - sfs_sb->data_block_start);
+	free(fsck.used);
+	return 0;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+	char *dev;
+	int fd, opt, retval;
+	struct stat st;
+	unsigned long long size;
+	double start, secs;
+
+	fsck.thread_cnt = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((opt = getopt(argc, argv, "rt:v")) != -1)
+	{
+		switch (opt)
+		{
+			case 'r': // Repair, including rebuilding the free bits
+				fsck.rebuild = 1;
+				break;
+			case 't':
+				fsck.thread_cnt = atoi(optarg);
+				break;
+			case 'v':
+				fsck.verbose = 1;
+				break;
+			default:
+				optind = argc; // Force the usage
+				break;
+		}
+	}
+	if (optind != argc - 1)
+	{
+		fprintf(stderr, "Usage: %s [ -r ] [ -t <threads> ] [ -v ] <akp fs / real sfs image or device>\n",
+			argv[0]);
+		return FSCK_USAGE;
+	}
+	if (fsck.thread_cnt < 1)
+	{
+		fsck.thread_cnt = 1;
+	}
+	else if (fsck.thread_cnt > MAX_THREADS)
+	{
+		fsck.thread_cnt = MAX_THREADS;
+	}
+	dev = argv[optind];
+	if ((fd = open(dev, fsck.rebuild ? O_RDWR : O_RDONLY)) == -1)
+	{
+		fprintf(stderr, "Unable to open %s: %s\n", dev, strerror(errno));
+		return FSCK_OP_ERROR;
+	}
+	if (ioctl(fd, BLKGETSIZE64, &size) == -1)
+	{
+		/* Not a block device. May be an image file */
+		if ((fstat(fd, &st) == -1) || !S_ISREG(st.st_mode))
+		{
+			fprintf(stderr, "Unable to get the size of %s: %s\n", dev, strerror(errno));
+			close(fd);
+			return FSCK_OP_ERROR;
+		}
+		size = st.st_size;
+	}
+	if (size < SIMULA_FS_BLOCK_SIZE)
+	{
+		fprintf(stderr, "%s too small for a file system\n", dev);
+		close(fd);
+		return FSCK_OP_ERROR;
+	}
+	fsck.img_size = size;
+	fsck.img = mmap(NULL, size, PROT_READ | (fsck.rebuild ? PROT_WRITE : 0), MAP_SHARED, fd, 0);
+	if (fsck.img == MAP_FAILED)
+	{
+		fprintf(stderr, "Unable to mmap %s: %s\n", dev, strerror(errno));
+		close(fd);
+		return FSCK_OP_ERROR;
+	}
+	madvise(fsck.img, size, MADV_WILLNEED);
+	pthread_mutex_init(&fsck.report_lock, NULL);
+	crc32_init();
+
+	start = now();
+	if (((struct akpfs_sb *)(fsck.img))->fs_type == AKPFS_SUPER_MAGIC)
+	{
+		retval = akp_fsck();
+	}
+	else if (((sfs_super_block_t *)(fsck.img))->type == SIMULA_FS_TYPE)
+	{
+		retval = sfs_fsck();
+	}
+	else
+	{
+		fprintf(stderr, "Neither akp fs nor real sfs on %s\n", dev);
+		retval = -1;
+	}
+	secs = now() - start;
+	if (fsck.rebuild && fsck.fixed && (msync(fsck.img, size, MS_SYNC) == -1))
+	{
+		fprintf(stderr, "Unable to write back the fixes: %s\n", strerror(errno));
+		retval = -1;
+	}
+	munmap(fsck.img, size);
+	if (fsck.rebuild && fsck.fixed)
+	{
+		fsync(fd);
+	}
+	close(fd);
+	if (retval < 0)
+	{
+		return FSCK_OP_ERROR;
+	}
+
+	printf("Checked %.1f MB of metadata in %.3f secs (%.1f MB/s) with %d threads: %ld errors, %ld fixed\n",
+		fsck.bytes_scanned / 1e6, secs, secs ? fsck.bytes_scanned / 1e6 / secs : 0.0,
+		fsck.thread_cnt, fsck.errors, fsck.fixed);
+	if (fsck.errors > fsck.fixed)
+	{
+		return FSCK_ERRORS;
+	}
+	return fsck.fixed ? FSCK_FIXED : FSCK_OK;
+}
@@ -1,9 +1,14 @@
+#define _GNU_SOURCE /* For O_DIRECT */
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h> /* For BLKSSZGET, BLKDISCARD, BLKZEROOUT */
 
 #include "akpfs.h"
 
@@ -11,7 +16,13 @@
 
 #define SECTOR_SIZE 512
 #define PAGE_SIZE 4096
-#define AVG_FILE_SIZE PAGE_SIZE
+#define AVG_FILE_SIZE PAGE_SIZE /* Default */
+#define OVERHEAD_TOLERANCE 0.001 /* Of the device size, for preferring a larger block size */
+#define MIN_INODE_CNT (2 + AKPFS_MAX_ENTRIES_PER_DIR) /* Unused 0, root & a full root directory */
+#define IO_ALIGN PAGE_SIZE /* Buffer alignment, as needed for O_DIRECT */
+#define MKFS_IO_SIZE (1024 * 1024) /* Bytes per write, for the large regions */
+#define JOURNAL_HANDLES 4 /* Default journal size, in handles per transaction */
+#define JOURNAL_DEFAULT -1 /* For the journal_block_cnt, to be computed */
 
 void print_stat(struct stat *stat)
 {
@@ -30,87 +41,172 @@ void print_stat(struct stat *stat)
 	printf("time of last status change: %d\n", stat->st_ctime); /* time_t */
 }
 
-int get_dev_size(int fd)
+long long get_dev_size(int fd)
 {
-	int dev_size;
+	long long dev_size;
 
 	dev_size = lseek(fd, 0, SEEK_END);
 	//printf("Device Size: %d bytes\n", dev_size);
 	return dev_size;
 }
 
-int compute_blk_size(int dev_size)
+unsigned int compute_journal_block_cnt(unsigned int free_bits_block_cnt, int block_size)
+/*
+ * Least blocks for a transaction to hold JOURNAL_HANDLES handles, or
+ * AKPFS_JOURNAL_DEF_BLOCKS, whichever is more
+ */
 {
-#if 0
-	int block_size, block_cnt, inodes_per_block;
-	int avg_file_cnt, avg_meta_block_cnt;
-	float prev_ratio;
+	unsigned int cnt, need = akpfs_journal_handle_blocks(free_bits_block_cnt);
 
-	if (dev_size % SECTOR_SIZE)
-	{
-		fprintf(stderr,
-			"Device is not sector-based. Extra bytes would be unused.\n");
-	}
-	block_size = SECTOR_SIZE;
-	block_cnt = dev_size / block_size;
-	prev_ratio = 1;
-	while (1)
-	{
-		inodes_per_block = block_size / sizeof(struct akpfs_inode);
-		avg_file_cnt = block_cnt / ((AVG_FILE_SIZE + block_size - 1) / block_size);
-		avg_meta_block_cnt = (avg_file_cnt + inodes_per_block - 1) / inodes_per_block;
-		if (1.0 * avg_meta_block_cnt / block_cnt > prev_ratio)
-		{
-			block_size /= 2;
-			block_cnt *= 2;
-			break;
-		}
-		prev_ratio = 1.0 * avg_meta_block_cnt / block_cnt;
-		/*
-		printf("BS: %d; BC: %d; FC: %d; MBC: %d; Ratio: %.2f%\n",
-			block_size, block_cnt, avg_file_cnt, avg_meta_block_cnt,
-			100.0 * prev_ratio);
-		 */
-		if (block_cnt % 2 != 0)
-		{
-			break;
-		}
-		block_size *= 2;
-		block_cnt /= 2;
-	}
-	return block_size;
-#else // Currently, driver logic is hard coded, assuming block device blk size <= file system blk size (PAGE_SIZE)
-	return PAGE_SIZE;
-#endif
+	for (cnt = 3; akpfs_journal_capacity(cnt, block_size) < need; cnt++)
+		;
+	cnt *= JOURNAL_HANDLES;
+	return (cnt < AKPFS_JOURNAL_DEF_BLOCKS) ? AKPFS_JOURNAL_DEF_BLOCKS : cnt;
 }
 
-void compute_akpfs_sb(int dev_size, int block_size, struct akpfs_sb *sb)
+void compute_akpfs_sb(long long dev_size, int block_size, int feature_flags, long long avg_file_size,
+	int journal_block_cnt, struct akpfs_sb *sb)
+/*
+ * The inode count is for the device filled up with files of avg_file_size. The
+ * journal, if any, is of journal_block_cnt blocks, or the default for
+ * JOURNAL_DEFAULT
+ */
 {
-	int block_cnt;
-	int avg_file_cnt, avg_meta_block_cnt;
+	unsigned int block_cnt, blocks_per_file, inode_cnt;
 
 	block_cnt = dev_size / block_size;
+	blocks_per_file = (avg_file_size + block_size - 1) / block_size;
+	if (!blocks_per_file)
+	{
+		blocks_per_file = 1;
+	}
 
 	sb->fs_type = AKPFS_SUPER_MAGIC;
 	sb->block_size = block_size;
 	sb->block_cnt = block_cnt;
 	sb->inodes_per_block = block_size / sizeof(struct akpfs_inode);
 	sb->inodes_block_start = 1;
-	avg_file_cnt = block_cnt / ((AVG_FILE_SIZE + block_size - 1) / block_size);
+	inode_cnt = block_cnt / blocks_per_file;
+	if (inode_cnt < MIN_INODE_CNT)
+	{
+		inode_cnt = MIN_INODE_CNT;
+	}
 	sb->inodes_block_cnt =
-		(avg_file_cnt + sb->inodes_per_block - 1) / sb->inodes_per_block;
+		(inode_cnt + sb->inodes_per_block - 1) / sb->inodes_per_block;
 	sb->free_bits_per_block = block_size * 8;
 	sb->free_bits_block_start = sb->inodes_block_start + sb->inodes_block_cnt;
 	sb->free_bits_block_cnt =
 		(block_cnt + sb->free_bits_per_block - 1) / sb->free_bits_per_block;
-	sb->data_block_start = sb->free_bits_block_start + sb->free_bits_block_cnt;
-	sb->data_block_cnt = block_cnt - sb->data_block_start;
+	sb->journal_block_start = sb->free_bits_block_start + sb->free_bits_block_cnt;
+	if (!(feature_flags & AKPFS_FEATURE_JOURNAL))
+	{
+		sb->journal_block_cnt = 0;
+	}
+	else if (journal_block_cnt == JOURNAL_DEFAULT)
+	{
+		sb->journal_block_cnt = compute_journal_block_cnt(sb->free_bits_block_cnt, block_size);
+	}
+	else
+	{
+		sb->journal_block_cnt = journal_block_cnt;
+	}
+	sb->data_block_start = sb->journal_block_start + sb->journal_block_cnt;
+	sb->data_block_cnt = (sb->data_block_start < block_cnt) ? block_cnt - sb->data_block_start : 0;
 	sb->root_inode = 1;
+	sb->feature_flags = feature_flags;
+	sb->inodes_block_init_cnt = 0;
 }
 
-void compute_akpfs_empty_inode(struct akpfs_inode *inode)
+long long compute_overhead(struct akpfs_sb *sb, long long avg_file_size)
+/*
+ * Bytes lost on the device filled up with files of avg_file_size: The metadata
+ * blocks, plus the unused tail of each file's last block
+ */
 {
-	inode->file_name[0] = 0;
+	long long file_cnt, slack;
+
+	file_cnt = (long long)(sb->inodes_block_cnt) * sb->inodes_per_block;
+	if (file_cnt > sb->data_block_cnt)
+	{
+		file_cnt = sb->data_block_cnt;
+	}
+	slack = (avg_file_size % sb->block_size) ? sb->block_size - avg_file_size % sb->block_size : 0;
+	return (long long)(sb->data_block_start) * sb->block_size + file_cnt * slack;
+}
+
+/*
+ * Tunes the block size, from min_block_size (that of the device) up to
+ * PAGE_SIZE (the largest the driver can set on the block device), for the
+ * least overhead, as per compute_overhead. That decides the inodes_per_block,
+ * & along with the avg_file_size, the inode/data ratio. The larger block size,
+ * for fewer mapping lookups, is preferred as long as its overhead is within
+ * OVERHEAD_TOLERANCE of the least. Returns 0, if no block size fits
+ */
+int compute_blk_size(long long dev_size, int min_block_size, long long avg_file_size, int feature_flags,
+	int journal_block_cnt)
+{
+	struct akpfs_sb sb;
+	int block_size, best_block_size = 0, i, cnt = 0;
+	int block_sizes[32];
+	long long overheads[32], min_overhead = 0;
+
+	if (dev_size % SECTOR_SIZE)
+	{
+		fprintf(stderr,
+			"Device is not sector-based. Extra bytes would be unused.\n");
+	}
+	for (block_size = min_block_size; block_size <= PAGE_SIZE; block_size *= 2)
+	{
+		if (!(feature_flags & AKPFS_FEATURE_EXTENTS) &&
+			(avg_file_size > (long long)(AKPFS_MAX_BLOCKS_PER_FILE) * block_size))
+		{
+			continue; // Average file wouldn't fit in the direct file_blocks
+		}
+		compute_akpfs_sb(dev_size, block_size, feature_flags, avg_file_size, journal_block_cnt, &sb);
+		if (sb.data_block_cnt < 2) // moksha.txt & at least one more
+		{
+			continue;
+		}
+		if ((feature_flags & AKPFS_FEATURE_JOURNAL) &&
+			(akpfs_journal_capacity(sb.journal_block_cnt, block_size) <
+				akpfs_journal_handle_blocks(sb.free_bits_block_cnt)))
+		{
+			continue; // Journal too small for even one handle
+		}
+		block_sizes[cnt] = block_size;
+		/* Journal is sized in blocks, irrespective of the block size. So, not compared */
+		overheads[cnt] = compute_overhead(&sb, avg_file_size) -
+			(long long)(sb.journal_block_cnt) * block_size;
+		/*
+		printf("BS: %d; IPB: %d; IBC: %d; FBBC: %d; Overhead: %lld bytes\n",
+			block_size, sb.inodes_per_block, sb.inodes_block_cnt,
+			sb.free_bits_block_cnt, overheads[cnt]);
+		 */
+		if (!cnt || (overheads[cnt] < min_overhead))
+		{
+			min_overhead = overheads[cnt];
+		}
+		cnt++;
+	}
+	for (i = 0; i < cnt; i++)
+	{
+		if (overheads[i] <= min_overhead + dev_size * OVERHEAD_TOLERANCE)
+		{
+			best_block_size = block_sizes[i];
+		}
+	}
+	return best_block_size;
+}
+
+void print_overhead(struct akpfs_sb *sb, long long dev_size, long long avg_file_size)
+{
+	printf("Inodes: %u (%u per block) for %lld byte files on average\n",
+		sb->inodes_block_cnt * sb->inodes_per_block, sb->inodes_per_block, avg_file_size);
+	printf("Metadata: %u blocks (1 super + %u inode + %u free bits + %u journal) = %.2f%% of the device\n",
+		sb->data_block_start, sb->inodes_block_cnt, sb->free_bits_block_cnt, sb->journal_block_cnt,
+		100.0 * sb->data_block_start * sb->block_size / dev_size);
+	printf("Overhead with the last block slack: %.2f%% of the device\n",
+		100.0 * compute_overhead(sb, avg_file_size) / dev_size);
 }
 
 void compute_akpfs_empty_dir_inode(char *dir_name, struct akpfs_inode *inode)
@@ -137,115 +233,318 @@ void compute_akpfs_empty_file_inode(char *file_name, struct akpfs_inode *inode)
 	}
 }
 
-int make_akpfs(int fd, int dev_size, int block_size)
+void place_akpfs_inode(char *itable, struct akpfs_sb *sb, int ino, struct akpfs_inode *inode)
+/* Copies the inode into its place in the in-memory inode table (from its first block) */
 {
-	struct akpfs_sb sb;
-	struct akpfs_inode empty_inode, root_inode;
+	memcpy(itable + (ino / sb->inodes_per_block) * sb->block_size +
+		(ino % sb->inodes_per_block) * sizeof(struct akpfs_inode),
+		inode, sizeof(struct akpfs_inode));
+}
+
+void *alloc_io_buf(size_t size)
+/* Zeroed, & aligned as needed for O_DIRECT */
+{
+	void *buf;
+
+	if (posix_memalign(&buf, IO_ALIGN, size))
+	{
+		return NULL;
+	}
+	memset(buf, 0, size);
+	return buf;
+}
+
+int write_blocks(int fd, void *buf, unsigned int block, unsigned int cnt, int block_size)
+/* Writes cnt blocks from buf, starting at block #block, in as few syscalls as possible */
+{
+	off_t off = (off_t)(block) * block_size;
+	size_t len = (size_t)(cnt) * block_size;
+	ssize_t done;
+
+	while (len)
+	{
+		if ((done = pwrite(fd, buf, len, off)) <= 0)
+		{
+			return -1;
+		}
+		buf = (char *)(buf) + done;
+		off += done;
+		len -= done;
+	}
+	return 0;
+}
+
+int zero_blocks(int fd, unsigned int block, unsigned int cnt, int block_size)
+/*
+ * Zeroes cnt blocks, starting at block #block: By the device itself, if a block
+ * device, say by its write zeroes with no data to transfer. Else, by writing
+ * zeroed blocks, MKFS_IO_SIZE bytes per syscall
+ */
+{
+	unsigned int chunk = MKFS_IO_SIZE / block_size, n;
+	unsigned long long range[2] = { (unsigned long long)(block) * block_size, (unsigned long long)(cnt) * block_size };
+	void *zbuf;
+
+	if (ioctl(fd, BLKZEROOUT, range) == 0)
+	{
+		return 0;
+	}
+	if (!(zbuf = alloc_io_buf((size_t)(chunk) * block_size)))
+	{
+		return -1;
+	}
+	for ( ; cnt; block += n, cnt -= n)
+	{
+		n = (cnt < chunk) ? cnt : chunk;
+		if (write_blocks(fd, zbuf, block, n, block_size) == -1)
+		{
+			free(zbuf);
+			return -1;
+		}
+	}
+	free(zbuf);
+	return 0;
+}
+
+/*
+ * Creates the akp fs, with file_cnt empty files f0, f1, ... in the root dir,
+ * e.g. for filling it up for benchmarking the lookups. Each metadata region is
+ * built in memory & written in large block aligned writes. With the
+ * AKPFS_FEATURE_LAZY_ITABLE, only the inode blocks holding the created inodes
+ * are written. With the AKPFS_FEATURE_JOURNAL, only the journal header block is
+ * zeroed, as that marks the journal empty
+ */
+int make_akpfs(int fd, struct akpfs_sb *sbp, int file_cnt)
+{
+	struct akpfs_sb sb = *sbp;
+	int block_size = sb.block_size;
+	struct akpfs_inode root_inode;
 #ifdef ADD_ONE_FILE
 	struct akpfs_inode file_inode;
  	// file_data length (excluding '\0') is assumed to be less than block size
 	char file_data[] = "Good Morning Universe";
 #endif
-	unsigned int i, bc /* block count */, ec /* entry count */;
-	unsigned int free_blocks_start;
-	unsigned char bitmask;
+	struct akpfs_inode extra_inode;
+	char extra_name[AKPFS_MAX_FILE_NAME_SIZE];
+	char *buf, *itable, *free_bits;
+	unsigned int i, itable_init_cnt, last_ino;
+	unsigned int free_blocks_start, first_extra_entry;
+	int retval = 0;
+
+#ifdef ADD_ONE_FILE
+	first_extra_entry = 1;
+#else
+	first_extra_entry = 0;
+#endif
+	last_ino = sb.root_inode + first_extra_entry + file_cnt;
+	if ((file_cnt > AKPFS_MAX_ENTRIES_PER_DIR - first_extra_entry) ||
+		(last_ino + 1 > sb.inodes_block_cnt * sb.inodes_per_block))
+	{
+		fprintf(stderr, "Too many files (%d) for the root directory\n", file_cnt);
+		return -8;
+	}
+	itable_init_cnt = last_ino / sb.inodes_per_block + 1;
+	if (sb.feature_flags & AKPFS_FEATURE_LAZY_ITABLE)
+	{
+		sb.inodes_block_init_cnt = itable_init_cnt;
+	}
+	if (!(buf = alloc_io_buf(block_size)) ||
+		!(itable = alloc_io_buf((size_t)(itable_init_cnt) * block_size)) ||
+		!(free_bits = alloc_io_buf((size_t)(sb.free_bits_block_cnt) * block_size)))
+	{
+		fprintf(stderr, "Out of memory\n");
+		return -9; // Exiting anyways. So, not bothering to free
+	}
 
-	compute_akpfs_sb(dev_size, block_size, &sb);
-	compute_akpfs_empty_inode(&empty_inode);
 	compute_akpfs_empty_dir_inode("/", &root_inode);
 #ifdef ADD_ONE_FILE
 	root_inode.u.dir_entries[0] = sb.root_inode + 1;
 	compute_akpfs_empty_file_inode("moksha.txt", &file_inode);
 	file_inode.file_size = strlen(file_data);
-	file_inode.u.file_blocks[0] = sb.data_block_start;
+	if (sb.feature_flags & AKPFS_FEATURE_EXTENTS)
+	{
+		file_inode.u.extents[0].file_block = 0;
+		file_inode.u.extents[0].block = sb.data_block_start;
+		file_inode.u.extents[0].block_cnt = 1;
+	}
+	else
+	{
+		file_inode.u.file_blocks[0] = sb.data_block_start;
+	}
+	place_akpfs_inode(itable, &sb, sb.root_inode + 1, &file_inode);
 #endif
-	/* Write the Super Block */
-	lseek(fd, 0 * block_size, SEEK_SET);
-	if (write(fd, &sb, sizeof(sb)) == -1) return -1;
-	/* Clear the Inode Blocks */
-	for (i = 0, bc = sb.inodes_block_start; i < sb.inodes_block_cnt; i++, bc++)
-	{
-		lseek(fd, bc * block_size, SEEK_SET);
-		for (ec = 0; ec < sb.inodes_per_block; ec++)
-		{
-			if (write(fd, &empty_inode, sizeof(empty_inode)) == -1) return -2;
-		}
+	/* Build the Inodes for the extra empty files, & link them into the Root Inode */
+	for (i = 0; i < file_cnt; i++)
+	{
+		snprintf(extra_name, sizeof(extra_name), "f%d", i);
+		compute_akpfs_empty_file_inode(extra_name, &extra_inode);
+		place_akpfs_inode(itable, &sb, sb.root_inode + 1 + first_extra_entry + i, &extra_inode);
+		root_inode.u.dir_entries[first_extra_entry + i] = sb.root_inode + 1 + first_extra_entry + i;
+	}
+	place_akpfs_inode(itable, &sb, sb.root_inode, &root_inode);
+
+	/* Write the Super Block, padded to a block */
+	memcpy(buf, &sb, sizeof(sb));
+	if (write_blocks(fd, buf, 0, 1, block_size) == -1) { retval = -1; goto out; }
+	/* Write the initialized Inode Blocks, & zero the rest, unless lazy */
+	if (write_blocks(fd, itable, sb.inodes_block_start, itable_init_cnt, block_size) == -1)
+	{
+		retval = -2; goto out;
+	}
+	if (!(sb.feature_flags & AKPFS_FEATURE_LAZY_ITABLE) &&
+		(zero_blocks(fd, sb.inodes_block_start + itable_init_cnt,
+			sb.inodes_block_cnt - itable_init_cnt, block_size) == -1))
+	{
+		retval = -2; goto out;
 	}
-	/* Write the Root Inode */
-	lseek(fd,
-		(sb.inodes_block_start + (sb.root_inode / sb.inodes_per_block)) *
-			block_size +
-		(sb.root_inode % sb.inodes_per_block) * sizeof(struct akpfs_inode),
-		SEEK_SET);
-	if (write(fd, &root_inode, sizeof(root_inode)) == -1) return -3;
 #ifdef ADD_ONE_FILE
-	/* Write the Inode for "moksha.txt" */
-	if (write(fd, &file_inode, sizeof(file_inode)) == -1) return -3;
 	/* Write the Data Block for "moksha.txt" */
-	lseek(fd, sb.data_block_start * block_size, SEEK_SET);
-	if (write(fd, &file_data, file_inode.file_size) == -1) return -3;
+	memset(buf, 0, block_size);
+	memcpy(buf, file_data, file_inode.file_size);
+	if (write_blocks(fd, buf, sb.data_block_start, 1, block_size) == -1) { retval = -3; goto out; }
 	free_blocks_start = sb.data_block_start + 1;
 #else
 	free_blocks_start = sb.data_block_start;
 #endif
-	/* Initialize the Free Bits for Blocks */
-	lseek(fd, sb.free_bits_block_start * block_size, SEEK_SET);
-	bitmask = 0xFF;
-	for (i = 0; i < (free_blocks_start / 8); i++)
-	{
-		if (write(fd, &bitmask, sizeof(bitmask)) == -1) return -4;
-	}
+	/* Write the Free Bits for Blocks: Set for the used ones, till free_blocks_start */
+	memset(free_bits, 0xFF, free_blocks_start / 8);
 	if (free_blocks_start % 8)
 	{
-		bitmask >>= (8 - (free_blocks_start % 8));
-		if (write(fd, &bitmask, sizeof(bitmask)) == -1) return -5;
-		i++;
+		free_bits[free_blocks_start / 8] = 0xFF >> (8 - (free_blocks_start % 8));
 	}
-	bitmask = 0x00;
-	for ( ; i < (sb.block_cnt / 8); i++)
+	if (write_blocks(fd, free_bits, sb.free_bits_block_start, sb.free_bits_block_cnt, block_size) == -1)
 	{
-		if (write(fd, &bitmask, sizeof(bitmask)) == -1) return -6;
+		retval = -4; goto out;
 	}
-	if (sb.block_cnt % 8)
+	if ((sb.feature_flags & AKPFS_FEATURE_JOURNAL) &&
+		(zero_blocks(fd, sb.journal_block_start, 1, block_size) == -1))
 	{
-		bitmask >>= (8 - (sb.block_cnt % 8));
-		if (write(fd, &bitmask, sizeof(bitmask)) == -1) return -7;
-		i++;
+		retval = -5; goto out;
 	}
-	return 0;
+out:
+	free(free_bits);
+	free(itable);
+	free(buf);
+	return retval;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
 int main(int argc, char *argv[])
 {
 	struct stat dev_stat;
+	char *dev;
 	int fd;
-	int dev_size, block_size;
+	long long dev_size, avg_file_size = AVG_FILE_SIZE;
+	int block_size, min_block_size = SECTOR_SIZE;
+	struct akpfs_sb sb;
+	int file_cnt = 0;
+	int feature_flags = AKPFS_FEATURE_EXTENTS | AKPFS_FEATURE_JOURNAL;
+	int journal_block_cnt = JOURNAL_DEFAULT;
+	int open_flags = O_RDWR;
+	int discard = 1;
+	int opt;
+	double start;
 
-	if (argc != 2)
+	while ((opt = getopt(argc, argv, "a:df:j:Klz")) != -1)
+	{
+		switch (opt)
+		{
+			case 'a': // Expected average file size, in bytes, for tuning the layout
+				if ((avg_file_size = atoll(optarg)) <= 0)
+				{
+					optind = argc; // Force the usage
+				}
+				break;
+			case 'd': // Direct I/O, bypassing the page cache
+				open_flags |= O_DIRECT;
+				break;
+			case 'f':
+				file_cnt = atoi(optarg);
+				break;
+			case 'j': // Journal blocks, with 0 for no journal
+				if ((journal_block_cnt = atoi(optarg)) < 0)
+				{
+					optind = argc; // Force the usage
+				}
+				else if (!journal_block_cnt)
+				{
+					feature_flags &= ~AKPFS_FEATURE_JOURNAL;
+				}
+				break;
+			case 'K': // Keep: No discarding of the whole device, before formatting
+				discard = 0;
+				break;
+			case 'l': // Legacy: Direct file blocks, limiting the file size
+				feature_flags &= ~AKPFS_FEATURE_EXTENTS;
+				break;
+			case 'z': // Lazy: Inode blocks zeroed by the driver, on their first use
+				feature_flags |= AKPFS_FEATURE_LAZY_ITABLE;
+				break;
+			default:
+				optind = argc; // Force the usage
+				break;
+		}
+	}
+	if (optind != argc - 1)
 	{
-		fprintf(stderr, "Usage: %s <block device>\n", argv[0]);
+		fprintf(stderr, "Usage: %s [ -a <average file size> ] [ -d ] [ -f <empty files in root dir> ] [ -j <journal blocks> ] [ -K ] [ -l ] [ -z ] <block device>\n", argv[0]);
 		return 1;
 	}
-	if (stat(argv[1], &dev_stat) == -1)
+	dev = argv[optind];
+	if (stat(dev, &dev_stat) == -1)
 	{
 		perror(argv[0]);
 		return 2;
 	}
 	//print_stat(&dev_stat);
-	if ((fd = open(argv[1], O_RDWR)) == -1)
+	if ((fd = open(dev, open_flags)) == -1)
 	{
 		perror(argv[0]);
 		return 3;
 	}
 	dev_size = get_dev_size(fd);
-	block_size = compute_blk_size(dev_size);
-	if (make_akpfs(fd, dev_size, block_size) < 0)
+	if (S_ISBLK(dev_stat.st_mode) && (ioctl(fd, BLKSSZGET, &min_block_size) == -1))
+	{
+		perror(argv[0]);
+		close(fd);
+		return 3;
+	}
+	if (min_block_size < SECTOR_SIZE)
+	{
+		min_block_size = SECTOR_SIZE;
+	}
+	if (!(block_size = compute_blk_size(dev_size, min_block_size, avg_file_size, feature_flags,
+		journal_block_cnt)))
+	{
+		fprintf(stderr, "No block size fits the device (%lld bytes), the average file size & the journal\n",
+			dev_size);
+		close(fd);
+		return 4;
+	}
+	compute_akpfs_sb(dev_size, block_size, feature_flags, avg_file_size, journal_block_cnt, &sb);
+	start = now();
+	if (S_ISBLK(dev_stat.st_mode) && discard)
+	{
+		unsigned long long range[2] = { 0, dev_size };
+
+		/* Best effort, as a trim of the old contents, not relied upon for zeroes */
+		ioctl(fd, BLKDISCARD, range);
+	}
+	if ((make_akpfs(fd, &sb, file_cnt) < 0) || (fsync(fd) == -1))
 	{
 		close(fd);
 		return 4;
 	}
-	printf("akp fs created on device %s [%d bytes = %d blocks] (1 block = %d bytes)\n",
-		argv[1], dev_size, dev_size / block_size, block_size);
+	printf("akp fs created on device %s [%lld bytes = %lld blocks] (1 block = %d bytes) in %.3f secs\n",
+		dev, dev_size, dev_size / block_size, block_size, now() - start);
+	print_overhead(&sb, dev_size, avg_file_size);
 	close(fd);
 	return 0;
 }
@@ -4,15 +4,29 @@
 #ifdef __KERNEL__
 #include <linux/fs.h>
 #include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include <linux/percpu.h>
 #endif
 
 #define SIMULA_FS_TYPE 0x13090D15 /* Magic Number for our file system */
-#define SIMULA_FS_BLOCK_SIZE 512 /* in bytes */
+#define SIMULA_FS_BLOCK_SIZE 512 /* in bytes; Also the minimum block size */
 #define SIMULA_FS_BLOCK_SIZE_BITS 9 /* log(SIMULA_FS_BLOCK_SIZE) w/ base 2 */
+#define SIMULA_FS_MAX_BLOCK_SIZE 4096 /* in bytes; Block size is a power of 2 upto this */
 #define SIMULA_FS_ENTRY_SIZE 64 /* in bytes */
 #define SIMULA_FS_FILENAME_LEN 15
 #define SIMULA_FS_DATA_BLOCK_CNT ((SIMULA_FS_ENTRY_SIZE - ((SIMULA_FS_FILENAME_LEN + 1) + 3 * 4)) / 4)
 
+/*
+ * On-disk format versions. Images created before versioning have 0 in the
+ * version field (earlier reserved), & are still supported as is
+ */
+#define SIMULA_FS_VERSION_DIRECT 0 /* All of blocks[] are data blocks */
+#define SIMULA_FS_VERSION_INDIRECT 1 /* Last 2 of blocks[] are single & double indirect blocks */
+#define SIMULA_FS_VERSION SIMULA_FS_VERSION_INDIRECT /* Latest version */
+#define SIMULA_FS_IND_BLOCK (SIMULA_FS_DATA_BLOCK_CNT - 2) /* Index into blocks[] */
+#define SIMULA_FS_DIND_BLOCK (SIMULA_FS_DATA_BLOCK_CNT - 1) /* Index into blocks[] */
+
 typedef unsigned char byte1_t;
 typedef unsigned int byte4_t;
 typedef unsigned long long byte8_t;
@@ -27,7 +41,8 @@ typedef struct sfs_super_block
 	byte4_t entry_table_block_start; /* in blocks */
 	byte4_t entry_count; /* Total entries in the file system */
 	byte4_t data_block_start; /* in blocks */
-	byte4_t reserved[SIMULA_FS_BLOCK_SIZE / 4 - 8];
+	byte4_t version; /* On-disk format version */
+	byte4_t reserved[SIMULA_FS_BLOCK_SIZE / 4 - 9];
 } sfs_super_block_t; /* Making it of SIMULA_FS_BLOCK_SIZE */
 
 typedef struct sfs_file_entry
@@ -36,16 +51,39 @@ typedef struct sfs_file_entry
 	byte4_t size; /* in bytes */
 	byte4_t timestamp; /* Seconds since Epoch */
 	byte4_t perms; /* Permissions only for user; Replicated for group & others */
-	byte4_t blocks[SIMULA_FS_DATA_BLOCK_CNT];
+	byte4_t blocks[SIMULA_FS_DATA_BLOCK_CNT]; /* Block #s; Indirect ones hold block #s */
 } sfs_file_entry_t;
 
 #ifdef __KERNEL__
+typedef struct sfs_block_pool
+{
+	spinlock_t lock; /* Uncontended, but for the other CPUs stealing, when all else is full */
+	byte4_t next; /* Next reserved block to be given out */
+	byte4_t end; /* Block # just after the reserved run. Pool is empty, if next == end */
+} sfs_block_pool_t;
+
 typedef struct sfs_info
 {
 	struct super_block *vfs_sb; /* Super block structure from VFS for this fs */
 	sfs_super_block_t sb; /* Our fs super block */
-	byte1_t *used_blocks; /* Used blocks tracker */
-	spinlock_t lock; /* Used for protecting used_blocks access */
+	sfs_file_entry_t *entries; /* In-memory copy of the entry table */
+	struct mutex *entry_block_lock; /* Per entry table block: Protects its entries' update & write back */
+	unsigned long *dirty_entry_blocks; /* Entry table blocks having entries not yet written back */
+	struct delayed_work flush_work; /* Deferred write back of the dirty entry table blocks */
+	atomic_long_t entry_updates; /* Stats: Entry updates */
+	atomic_long_t entry_block_writes; /* Stats: Entry table block writes for them */
+	struct mutex ns_lock; /* Used for protecting name_hash, next_entry, free_entry & free_entry_cnt */
+	int *name_hash; /* Hash buckets, each holding the first entry # of its chain */
+	int *next_entry; /* Next entry # in its hash chain (if used) or free list (if free) */
+	unsigned int name_hash_mask; /* Bucket count - 1 */
+	int free_entry; /* First entry # in the free list */
+	int free_entry_cnt; /* Count of entries in the free list */
+	unsigned long *used_blocks; /* Used blocks bitmap */
+	byte4_t alloc_cursor; /* Block # from where the next free block search starts */
+	byte4_t free_block_cnt; /* Count of the clear bits in used_blocks */
+	int extent_alloc; /* Allocate file blocks contiguously, if set */
+	spinlock_t lock; /* Used for protecting used_blocks, alloc_cursor & free_block_cnt access */
+	sfs_block_pool_t __percpu *pools; /* Per CPU runs of blocks reserved from used_blocks */
 } sfs_info_t;
 #endif
 
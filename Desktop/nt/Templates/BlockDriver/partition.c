@@ -156,21 +156,30 @@ static void copy_mbr(u8 *disk)
 	memcpy(disk + PARTITION_TABLE_OFFSET, &def_part_table, PARTITION_TABLE_SIZE);
 	*(unsigned short *)(disk + MBR_SIGNATURE_OFFSET) = MBR_SIGNATURE;
 }
-static void copy_br(u8 *disk, int start_cylinder, const PartTable *part_table)
+static void copy_br(u8 *disk, const PartTable *part_table)
 {
-	disk += (start_cylinder * 32 /* sectors / cyl */ * SECTOR_SIZE);
 	memset(disk, 0x0, BR_SIZE);
 	memcpy(disk + PARTITION_TABLE_OFFSET, part_table,
 		PARTITION_TABLE_SIZE);
 	*(unsigned short *)(disk + BR_SIGNATURE_OFFSET) = BR_SIGNATURE;
 }
-void copy_mbr_n_br(u8 *disk)
+/*
+ * Writes the MBR & the BRs through write, a sector at a time, as the disk
+ * need not be contiguous in memory
+ */
+int copy_mbr_n_br(int (*write)(sector_t sector_off, u8 *buffer, unsigned int sectors))
 {
-	int i;
+	static u8 sector[SECTOR_SIZE];
+	int i, ret;
 
-	copy_mbr(disk);
+	copy_mbr(sector);
+	if ((ret = write(0, sector, 1)) < 0)
+		return ret;
 	for (i = 0; i < ARRAY_SIZE(def_log_part_table); i++)
 	{
-		copy_br(disk, def_log_part_br_cyl[i], &def_log_part_table[i]);
+		copy_br(sector, &def_log_part_table[i]);
+		if ((ret = write(def_log_part_br_cyl[i] * 32 /* sectors / cyl */, sector, 1)) < 0)
+			return ret;
 	}
+	return 0;
 }
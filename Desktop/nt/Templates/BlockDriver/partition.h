@@ -3,5 +3,5 @@
 
 #include <linux/types.h>
 
-extern void copy_mbr_n_br(u8 *disk);
+extern int copy_mbr_n_br(int (*write)(sector_t sector_off, u8 *buffer, unsigned int sectors));
 #endif
@@ -8,15 +8,48 @@
 #include <linux/genhd.h> // For basic block driver framework
 #include <linux/blkdev.h> // For at least, struct block_device_operations
 #include <linux/hdreg.h> // For struct hd_geometry
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+#include <linux/bitops.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,13,0))
+#include <linux/blk-mq.h>
+#include <linux/cpumask.h>
+#endif
 #include <linux/errno.h>
 
 #include "ram_device.h"
+#define CREATE_TRACE_POINTS
+#include "rb_trace.h"
 
 #define RB_FIRST_MINOR 0
 #define RB_MINOR_CNT 16
 
 static u_int rb_major = 0;
 
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,13,0))
+/*
+ * blk-mq: Each hardware queue is just a context for queue_rq, as the RAM needs
+ * no serialization across them. So, more of them let more CPUs submit & copy
+ * in parallel, without contending on a queue lock
+ */
+static int hw_queues = 0; /* 0 for one per possible CPU */
+module_param(hw_queues, int, 0444);
+MODULE_PARM_DESC(hw_queues, "Number of hardware queues (default: 1 per CPU)");
+static int queue_depth = 128;
+module_param(queue_depth, int, 0444);
+MODULE_PARM_DESC(queue_depth, "Tags (in flight requests) per hardware queue");
+/*
+ * bio based: Each bio is copied right in the submitter's context, bypassing
+ * the request layer, i.e. no request allocation, tags, merging or scheduling,
+ * none of which a RAM device gains from
+ */
+static int use_bio = 0;
+module_param(use_bio, int, 0444);
+MODULE_PARM_DESC(use_bio, "Take the bios directly, bypassing the request layer (default: 0, for blk-mq)");
+#endif
+
 /* 
  * The internal structure representation of our Device
  */
@@ -24,8 +57,13 @@ static struct rb_device
 {
 	/* Size is the size of the device (in sectors) */
 	unsigned int size;
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(4,13,0))
 	/* For exclusive access to our request queue */
 	spinlock_t lock;
+#else
+	/* Tags & the hardware queues' setup, shared by its request queue */
+	struct blk_mq_tag_set tag_set;
+#endif
 	/* Our request queue */
 	struct request_queue *rb_queue;
 	/* This is kernel's representation of an individual disk device */
@@ -60,12 +98,132 @@ static void rb_close(struct gendisk *disk, fmode_t mode)
 static int rb_getgeo(struct block_device *bdev, struct hd_geometry *geo)
 {
 	geo->heads = 1;
-	geo->cylinders = 32;
 	geo->sectors = 32;
+	/* As per the device size, capped for the larger ones */
+	geo->cylinders = min_t(unsigned int, rb_dev.size / 32, 0xFFFF);
 	geo->start = 0;
 	return 0;
 }
 
+/*
+ * I/O stats, per direction: Counted per CPU, for the hot path to never share
+ * a cache line, & summed up only on reading /sys/kernel/debug/rb/stats. The
+ * latency is the in driver service time, in log2 buckets of usecs
+ */
+#define RB_LAT_BUCKETS 16 /* < 1us, < 2us, < 4us, ..., >= 16ms */
+
+struct rb_stats
+{
+	u64 ops[2];
+	u64 bytes[2];
+	u64 errs[2];
+	u64 lat[2][RB_LAT_BUCKETS];
+};
+
+static DEFINE_PER_CPU(struct rb_stats, rb_stats);
+static struct dentry *rb_debugfs;
+
+static inline u64 rb_now(void)
+{
+	return ktime_to_ns(ktime_get());
+}
+
+static void rb_account(int dir, sector_t sector, unsigned int sectors, u64 start, int err)
+{
+	u64 ns = rb_now() - start;
+
+	dir = (dir == WRITE);
+	this_cpu_inc(rb_stats.ops[dir]);
+	this_cpu_add(rb_stats.bytes[dir], (u64)sectors * RB_SECTOR_SIZE);
+	if (err)
+	{
+		this_cpu_inc(rb_stats.errs[dir]);
+	}
+	this_cpu_inc(rb_stats.lat[dir][min_t(unsigned int, fls64(ns >> 10), RB_LAT_BUCKETS - 1)]);
+	trace_rb_transfer(dir ? WRITE : READ, sector, sectors, ns, err);
+}
+
+static int rb_stats_read(struct seq_file *m, void *v)
+{
+	struct rb_stats sum, *s;
+	int cpu, d, i;
+
+	memset(&sum, 0, sizeof(sum));
+	for_each_possible_cpu(cpu)
+	{
+		s = per_cpu_ptr(&rb_stats, cpu);
+		for (d = 0; d < 2; d++)
+		{
+			sum.ops[d] += s->ops[d];
+			sum.bytes[d] += s->bytes[d];
+			sum.errs[d] += s->errs[d];
+			for (i = 0; i < RB_LAT_BUCKETS; i++)
+			{
+				sum.lat[d][i] += s->lat[d][i];
+			}
+		}
+	}
+	seq_printf(m, "%-16s %16s %16s\n", "", "Read", "Write");
+	seq_printf(m, "%-16s %16llu %16llu\n", "ops", sum.ops[0], sum.ops[1]);
+	seq_printf(m, "%-16s %16llu %16llu\n", "bytes", sum.bytes[0], sum.bytes[1]);
+	seq_printf(m, "%-16s %16llu %16llu\n", "errors", sum.errs[0], sum.errs[1]);
+	seq_printf(m, "latency (usecs):\n");
+	for (i = 0; i < RB_LAT_BUCKETS - 1; i++)
+	{
+		seq_printf(m, "< %-14u %16llu %16llu\n", 1 << i, sum.lat[0][i], sum.lat[1][i]);
+	}
+	seq_printf(m, ">= %-13u %16llu %16llu\n", 1 << (i - 1), sum.lat[0][i], sum.lat[1][i]);
+	return 0;
+}
+static ssize_t rb_stats_write(struct file *file, const char __user *buffer, size_t count, loff_t *off)
+/* Any write resets the stats, say before a benchmark run */
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+	{
+		memset(per_cpu_ptr(&rb_stats, cpu), 0, sizeof(struct rb_stats));
+	}
+	return count;
+}
+static int rb_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, rb_stats_read, NULL);
+}
+
+static struct file_operations rb_stats_fops =
+{
+	.owner = THIS_MODULE,
+	.open = rb_stats_open,
+	.read = seq_read,
+	.write = rb_stats_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,13,0))
+static bool rb_transfer_no_data(unsigned int op, sector_t sector, unsigned int sectors)
+/*
+ * Executes the ops without any data: Discard & write zeroes both just free
+ * the range's pages (zeroing the partial ones), as the holes read as zeroes.
+ * And, flush has nothing to do, as the writes are in the RAM as they
+ * complete. Returns whether op was one of these
+ */
+{
+	switch (op)
+	{
+		case REQ_OP_DISCARD:
+		case REQ_OP_WRITE_ZEROES:
+			ramdevice_discard(sector, sectors);
+			return true;
+		case REQ_OP_FLUSH:
+			return true;
+		default:
+			return false;
+	}
+}
+#endif
+
 /* 
  * Actual Data transfer
  */
@@ -95,9 +253,14 @@ static int rb_transfer(struct request *req)
 	u8 *buffer;
 
 	int ret = 0;
+	u64 start = rb_now();
 
-	//printk(KERN_DEBUG "rb: Dir:%d; Sec:%lld; Cnt:%d\n", dir, start_sector, sector_cnt);
-
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,13,0))
+	if (rb_transfer_no_data(req_op(req), start_sector, sector_cnt))
+	{
+		return 0;
+	}
+#endif
 	sector_offset = 0;
 	rq_for_each_segment(bv, req, iter)
 	{
@@ -111,11 +274,13 @@ static int rb_transfer(struct request *req)
 			ret = -EIO;
 		}
 		sectors = BV_LEN(bv) / RB_SECTOR_SIZE;
-		printk(KERN_DEBUG "rb: Start Sector: %llu, Sector Offset: %llu; Buffer: %p; Length: %u sectors\n",
-			(unsigned long long)(start_sector), (unsigned long long)(sector_offset), buffer, sectors);
 		if (dir == WRITE) /* Write to the device */
 		{
-			ramdevice_write(start_sector + sector_offset, buffer, sectors);
+			if (ramdevice_write(start_sector + sector_offset, buffer, sectors) < 0)
+			{
+				printk(KERN_ERR "rb: Out of memory for the write\n");
+				ret = -EIO;
+			}
 		}
 		else /* Read from the device */
 		{
@@ -128,10 +293,12 @@ static int rb_transfer(struct request *req)
 		printk(KERN_ERR "rb: bio info doesn't match with the request info");
 		ret = -EIO;
 	}
+	rb_account(dir, start_sector, sector_cnt, start, ret);
 
 	return ret;
 }
 	
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(4,13,0))
 /*
  * Represents a block I/O request for us to execute
  */
@@ -162,6 +329,198 @@ static void rb_request(struct request_queue *q)
 		//__blk_end_request(req, ret, blk_rq_bytes(req));
 	}
 }
+#else
+/*
+ * Executes a block I/O request, on the submitting CPU's hardware queue, &
+ * completes it right away, as there is nothing to wait for
+ */
+static blk_status_t rb_queue_rq(struct blk_mq_hw_ctx *hctx, const struct blk_mq_queue_data *bd)
+{
+	struct request *req = bd->rq;
+
+	blk_mq_start_request(req);
+	blk_mq_end_request(req, (rb_transfer(req) < 0) ? BLK_STS_IOERR : BLK_STS_OK);
+	return BLK_STS_OK;
+}
+
+static struct blk_mq_ops rb_mq_ops =
+{
+	.queue_rq = rb_queue_rq,
+};
+
+/*
+ * Copies the bio's segments against the device, & completes it
+ */
+static void rb_bio_transfer(struct bio *bio)
+{
+	int dir = bio_data_dir(bio);
+	sector_t sector = bio->bi_iter.bi_sector;
+	struct bio_vec bv;
+	struct bvec_iter iter;
+	u8 *buffer;
+	u64 start = rb_now();
+
+	if (sector + bio_sectors(bio) > rb_dev.size)
+	{
+		bio->bi_status = BLK_STS_IOERR;
+		bio_endio(bio);
+		return;
+	}
+	if (rb_transfer_no_data(bio_op(bio), sector, bio_sectors(bio)))
+	{
+		bio_endio(bio);
+		return;
+	}
+	bio_for_each_segment(bv, bio, iter)
+	{
+		if (bv.bv_len % RB_SECTOR_SIZE != 0)
+		{
+			printk(KERN_ERR "rb: bio segment size (%d) is not a multiple of RB_SECTOR_SIZE (%d)\n",
+				bv.bv_len, RB_SECTOR_SIZE);
+			bio->bi_status = BLK_STS_IOERR;
+			break;
+		}
+		buffer = page_address(bv.bv_page) + bv.bv_offset;
+		if (dir == WRITE) /* Write to the device */
+		{
+			if (ramdevice_write(sector, buffer, bv.bv_len / RB_SECTOR_SIZE) < 0)
+			{
+				bio->bi_status = BLK_STS_IOERR;
+				break;
+			}
+		}
+		else /* Read from the device */
+		{
+			ramdevice_read(sector, buffer, bv.bv_len / RB_SECTOR_SIZE);
+		}
+		sector += bv.bv_len / RB_SECTOR_SIZE;
+	}
+	rb_account(dir, bio->bi_iter.bi_sector, bio_sectors(bio), start, bio->bi_status ? -EIO : 0);
+	bio_endio(bio);
+}
+
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(5,9,0))
+static blk_qc_t rb_submit_bio(struct request_queue *q, struct bio *bio)
+#elif (LINUX_VERSION_CODE < KERNEL_VERSION(5,16,0))
+static blk_qc_t rb_submit_bio(struct bio *bio)
+#else
+static void rb_submit_bio(struct bio *bio)
+#endif
+{
+	rb_bio_transfer(bio);
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(5,16,0))
+	return BLK_QC_T_NONE;
+#endif
+}
+
+static int rb_init_bio_queue(void)
+/* Sets up the bio based request queue (along with the disk, from 5.15) */
+{
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(5,7,0))
+	if (!(rb_dev.rb_queue = blk_alloc_queue(GFP_KERNEL)))
+	{
+		return -ENOMEM;
+	}
+	blk_queue_make_request(rb_dev.rb_queue, rb_submit_bio);
+#elif (LINUX_VERSION_CODE < KERNEL_VERSION(5,9,0))
+	if (!(rb_dev.rb_queue = blk_alloc_queue(rb_submit_bio, NUMA_NO_NODE)))
+	{
+		return -ENOMEM;
+	}
+#elif (LINUX_VERSION_CODE < KERNEL_VERSION(5,15,0))
+	/* rb_submit_bio comes through rb_bio_fops */
+	if (!(rb_dev.rb_queue = blk_alloc_queue(NUMA_NO_NODE)))
+	{
+		return -ENOMEM;
+	}
+#else
+	if (!(rb_dev.rb_disk = blk_alloc_disk(NUMA_NO_NODE)))
+	{
+		return -ENOMEM;
+	}
+	rb_dev.rb_queue = rb_dev.rb_disk->queue;
+#endif
+	printk(KERN_INFO "rb: bio based, bypassing the request layer\n");
+	return 0;
+}
+
+static int rb_init_mq_queue(void)
+/* Sets up the tag set & its request queue (along with the disk, from 5.15) */
+{
+	struct blk_mq_tag_set *set = &rb_dev.tag_set;
+	int ret;
+
+	memset(set, 0, sizeof(*set));
+	set->ops = &rb_mq_ops;
+	set->nr_hw_queues = (hw_queues > 0) ? hw_queues : num_possible_cpus();
+	set->queue_depth = (queue_depth > 0) ? queue_depth : 128;
+	set->numa_node = NUMA_NO_NODE;
+	/* As the device's pages get allocated on their first write */
+	set->flags = BLK_MQ_F_SHOULD_MERGE | BLK_MQ_F_BLOCKING;
+	if ((ret = blk_mq_alloc_tag_set(set)) < 0)
+	{
+		return ret;
+	}
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(5,15,0))
+	rb_dev.rb_queue = blk_mq_init_queue(set);
+	if (IS_ERR(rb_dev.rb_queue))
+	{
+		blk_mq_free_tag_set(set);
+		return PTR_ERR(rb_dev.rb_queue);
+	}
+#else
+	rb_dev.rb_disk = blk_mq_alloc_disk(set, &rb_dev);
+	if (IS_ERR(rb_dev.rb_disk))
+	{
+		blk_mq_free_tag_set(set);
+		return PTR_ERR(rb_dev.rb_disk);
+	}
+	rb_dev.rb_queue = rb_dev.rb_disk->queue;
+#endif
+	printk(KERN_INFO "rb: %d hardware queues of %d tags\n", set->nr_hw_queues, set->queue_depth);
+	return 0;
+}
+
+static void rb_set_queue_limits(struct request_queue *q)
+/*
+ * Advertises the discard & write zeroes, any size of them, in page units as
+ * the backing pages. But not a volatile write cache, as there is none, & so
+ * no flushes get sent down
+ */
+{
+	blk_queue_max_discard_sectors(q, UINT_MAX >> 9);
+	q->limits.discard_granularity = PAGE_SIZE;
+	blk_queue_max_write_zeroes_sectors(q, UINT_MAX >> 9);
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(4,17,0))
+	queue_flag_set_unlocked(QUEUE_FLAG_DISCARD, q);
+#elif (LINUX_VERSION_CODE < KERNEL_VERSION(5,19,0))
+	blk_queue_flag_set(QUEUE_FLAG_DISCARD, q);
+#endif
+}
+
+static int rb_init_queue(void)
+{
+	int ret;
+
+	if ((ret = use_bio ? rb_init_bio_queue() : rb_init_mq_queue()) < 0)
+	{
+		return ret;
+	}
+	rb_set_queue_limits(rb_dev.rb_queue);
+	return 0;
+}
+
+static void rb_cleanup_queue(void)
+{
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(5,15,0))
+	blk_cleanup_queue(rb_dev.rb_queue);
+#endif
+	if (!use_bio)
+	{
+		blk_mq_free_tag_set(&rb_dev.tag_set);
+	}
+}
+#endif
 
 /* 
  * These are the file operations that performed on the ram block device
@@ -173,6 +532,17 @@ static struct block_device_operations rb_fops =
 	.release = rb_close,
 	.getgeo = rb_getgeo,
 };
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5,9,0))
+/* For the bio based mode, as the submit_bio is the device's, from 5.9 */
+static struct block_device_operations rb_bio_fops =
+{
+	.owner = THIS_MODULE,
+	.submit_bio = rb_submit_bio,
+	.open = rb_open,
+	.release = rb_close,
+	.getgeo = rb_getgeo,
+};
+#endif
 	
 /* 
  * This is the registration and initialization section of the ram block device
@@ -199,6 +569,7 @@ static int __init rb_init(void)
 	}
 
 	/* Get a request queue (here queue is created) */
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(4,13,0))
 	spin_lock_init(&rb_dev.lock);
 	rb_dev.rb_queue = blk_init_queue(rb_request, &rb_dev.lock);
 	if (rb_dev.rb_queue == NULL)
@@ -208,7 +579,17 @@ static int __init rb_init(void)
 		ramdevice_cleanup();
 		return -ENOMEM;
 	}
+#else
+	if ((ret = rb_init_queue()) < 0)
+	{
+		printk(KERN_ERR "rb: %s queue init failure\n", use_bio ? "bio" : "blk-mq");
+		unregister_blkdev(rb_major, "rb");
+		ramdevice_cleanup();
+		return ret;
+	}
+#endif
 	
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(5,15,0))
 	/*
 	 * Add the gendisk structure
 	 * By using this memory allocation is involved, 
@@ -219,18 +600,30 @@ static int __init rb_init(void)
 	if (!rb_dev.rb_disk)
 	{
 		printk(KERN_ERR "rb: alloc_disk failure\n");
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(4,13,0))
 		blk_cleanup_queue(rb_dev.rb_queue);
+#else
+		rb_cleanup_queue();
+#endif
 		unregister_blkdev(rb_major, "rb");
 		ramdevice_cleanup();
 		return -ENOMEM;
 	}
+#else
+	/* Allocated along with the queue, by blk_mq_alloc_disk */
+	rb_dev.rb_disk->minors = RB_MINOR_CNT;
+#endif
 
  	/* Setting the major number */
 	rb_dev.rb_disk->major = rb_major;
   	/* Setting the first mior number */
 	rb_dev.rb_disk->first_minor = RB_FIRST_MINOR;
  	/* Initializing the device operations */
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(5,9,0))
 	rb_dev.rb_disk->fops = &rb_fops;
+#else
+	rb_dev.rb_disk->fops = use_bio ? &rb_bio_fops : &rb_fops;
+#endif
  	/* Driver-specific own internal data */
 	rb_dev.rb_disk->private_data = &rb_dev;
 	rb_dev.rb_disk->queue = rb_dev.rb_queue;
@@ -244,10 +637,25 @@ static int __init rb_init(void)
 	set_capacity(rb_dev.rb_disk, rb_dev.size);
 
 	/* Adding the disk to the system */
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(5,15,0))
 	add_disk(rb_dev.rb_disk);
+#else
+	if ((ret = add_disk(rb_dev.rb_disk)) < 0)
+	{
+		printk(KERN_ERR "rb: add_disk failure\n");
+		blk_cleanup_disk(rb_dev.rb_disk);
+		rb_cleanup_queue();
+		unregister_blkdev(rb_major, "rb");
+		ramdevice_cleanup();
+		return ret;
+	}
+#endif
 	/* Now the disk is "live" */
-	printk(KERN_INFO "rb: Ram Block driver initialised (%d sectors; %d bytes)\n",
-		rb_dev.size, rb_dev.size * RB_SECTOR_SIZE);
+	/* Best effort, as the stats are just for observability */
+	rb_debugfs = debugfs_create_dir("rb", NULL);
+	debugfs_create_file("stats", 0644, rb_debugfs, NULL, &rb_stats_fops);
+	printk(KERN_INFO "rb: Ram Block driver initialised (%u sectors; %llu bytes)\n",
+		rb_dev.size, (unsigned long long)rb_dev.size * RB_SECTOR_SIZE);
 
 	return 0;
 }
@@ -257,9 +665,18 @@ static int __init rb_init(void)
  */
 static void __exit rb_cleanup(void)
 {
+	debugfs_remove_recursive(rb_debugfs);
 	del_gendisk(rb_dev.rb_disk);
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(4,13,0))
 	put_disk(rb_dev.rb_disk);
 	blk_cleanup_queue(rb_dev.rb_queue);
+#elif (LINUX_VERSION_CODE < KERNEL_VERSION(5,15,0))
+	put_disk(rb_dev.rb_disk);
+	rb_cleanup_queue();
+#else
+	blk_cleanup_disk(rb_dev.rb_disk);
+	rb_cleanup_queue();
+#endif
 	unregister_blkdev(rb_major, "rb");
 	ramdevice_cleanup();
 }
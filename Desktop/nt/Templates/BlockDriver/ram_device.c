@@ -1,5 +1,12 @@
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/version.h>
 #include <linux/types.h>
-#include <linux/vmalloc.h>
+#include <linux/gfp.h>
+#include <linux/mm.h>
+#include <linux/radix-tree.h>
+#include <linux/rcupdate.h>
+#include <linux/spinlock.h>
 #include <linux/string.h>
 #include <linux/errno.h>
 
@@ -7,33 +14,209 @@
 #include "partition.h"
 
 #define RB_DEVICE_SIZE 1024 /* sectors */
-/* So, total device size = 1024 * 512 bytes = 512 KiB */
+/* So, the default (& minimum) device size = 1024 * 512 bytes = 512 KiB */
 
-/* Array where the disk stores its data */
-static u8 *dev_data;
+#define RB_PAGE_SECTORS_SHIFT (PAGE_SHIFT - 9)
+#define RB_PAGE_SECTORS (1 << RB_PAGE_SECTORS_SHIFT)
+#define RB_FREE_BATCH 16
 
-int ramdevice_init(void)
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(4,13,0))
+/* As the legacy request_fn may be called in the atomic context */
+#define RB_PAGE_GFP GFP_ATOMIC
+#else
+/* As blk-mq dispatches with BLK_MQ_F_BLOCKING, & the bios come in process context */
+#define RB_PAGE_GFP GFP_NOIO
+#endif
+
+/*
+ * The partition table (partition.c) covers the first 512 KiB. Anything beyond
+ * is left unpartitioned, for the whole disk (/dev/rb) use
+ */
+static ulong size_kb = RB_DEVICE_SIZE * RB_SECTOR_SIZE / 1024;
+module_param(size_kb, ulong, 0444);
+MODULE_PARM_DESC(size_kb, "Device size in KiB (default & minimum: 512)");
+
+/*
+ * Pages where the disk stores its data, indexed by their page offset on the
+ * disk, & each allocated on its first write. So, only what is written costs
+ * memory, & the holes read back as zeroes. Lookups & copies are under RCU, &
+ * the inserts & deletes under dev_lock, with the deleted pages freed after an
+ * RCU grace period, i.e. once no copy can be on them
+ */
+static RADIX_TREE(dev_pages, GFP_ATOMIC);
+static DEFINE_SPINLOCK(dev_lock);
+
+static void rb_free_page_rcu(struct rcu_head *head)
 {
-	dev_data = vmalloc(RB_DEVICE_SIZE * RB_SECTOR_SIZE);
-	if (dev_data == NULL)
+	__free_page(container_of(head, struct page, rcu_head));
+}
+
+static int rb_insert_page(pgoff_t idx)
+/* Allocates & inserts the disk's page at idx, unless inserted by a racing writer */
+{
+	struct page *page;
+	unsigned long flags;
+	int ret;
+
+	if (!(page = alloc_page(RB_PAGE_GFP | __GFP_ZERO)))
+	{
 		return -ENOMEM;
+	}
+	page->index = idx;
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,13,0))
+	if ((ret = radix_tree_preload(RB_PAGE_GFP)) < 0)
+	{
+		__free_page(page);
+		return ret;
+	}
+#endif
+	spin_lock_irqsave(&dev_lock, flags);
+	ret = radix_tree_insert(&dev_pages, idx, page);
+	spin_unlock_irqrestore(&dev_lock, flags);
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,13,0))
+	radix_tree_preload_end();
+#endif
+	if (ret < 0)
+	{
+		__free_page(page);
+	}
+	return (ret == -EEXIST) ? 0 : ret;
+}
+
+static void rb_free_pages(pgoff_t idx, pgoff_t end)
+/* Frees the disk's pages in [idx, end) */
+{
+	struct page *pages[RB_FREE_BATCH];
+	unsigned long flags;
+	unsigned int i, cnt;
+
+	do
+	{
+		spin_lock_irqsave(&dev_lock, flags);
+		cnt = radix_tree_gang_lookup(&dev_pages, (void **)pages, idx, RB_FREE_BATCH);
+		for (i = 0; (i < cnt) && (pages[i]->index < end); i++)
+		{
+			radix_tree_delete(&dev_pages, pages[i]->index);
+		}
+		spin_unlock_irqrestore(&dev_lock, flags);
+		if (i)
+		{
+			idx = pages[i - 1]->index + 1;
+		}
+		cnt = i;
+		for (i = 0; i < cnt; i++)
+		{
+			call_rcu(&pages[i]->rcu_head, rb_free_page_rcu);
+		}
+	}
+	while (cnt == RB_FREE_BATCH);
+}
+
+int ramdevice_init(void)
+{
+	int ret;
+
+	if ((size_kb < RB_DEVICE_SIZE * RB_SECTOR_SIZE / 1024) || (size_kb > INT_MAX / (1024 / RB_SECTOR_SIZE)))
+	{
+		printk(KERN_ERR "rb: Invalid size_kb %lu\n", size_kb);
+		return -EINVAL;
+	}
 	/* Setup its partition table */
-	copy_mbr_n_br(dev_data);
-	return RB_DEVICE_SIZE;
+	if ((ret = copy_mbr_n_br(ramdevice_write)) < 0)
+	{
+		ramdevice_cleanup();
+		return ret;
+	}
+	return size_kb * (1024 / RB_SECTOR_SIZE);
 }
 
 void ramdevice_cleanup(void)
 {
-	vfree(dev_data);
+	rb_free_pages(0, ULONG_MAX);
+	/* For the frees to be done, before the module (with rb_free_page_rcu) goes */
+	rcu_barrier();
 }
 
-void ramdevice_write(sector_t sector_off, u8 *buffer, unsigned int sectors)
+int ramdevice_write(sector_t sector_off, u8 *buffer, unsigned int sectors)
 {
-	memcpy(dev_data + sector_off * RB_SECTOR_SIZE, buffer,
-		sectors * RB_SECTOR_SIZE);
+	unsigned int off, cnt;
+	struct page *page;
+	int ret;
+
+	while (sectors)
+	{
+		off = sector_off & (RB_PAGE_SECTORS - 1);
+		cnt = min_t(unsigned int, sectors, RB_PAGE_SECTORS - off);
+		rcu_read_lock();
+		if (!(page = radix_tree_lookup(&dev_pages, sector_off >> RB_PAGE_SECTORS_SHIFT)))
+		{
+			rcu_read_unlock();
+			if ((ret = rb_insert_page(sector_off >> RB_PAGE_SECTORS_SHIFT)) < 0)
+			{
+				return ret;
+			}
+			continue; /* Look it up again, as it may have been discarded already */
+		}
+		memcpy(page_address(page) + off * RB_SECTOR_SIZE, buffer, cnt * RB_SECTOR_SIZE);
+		rcu_read_unlock();
+		sector_off += cnt;
+		buffer += cnt * RB_SECTOR_SIZE;
+		sectors -= cnt;
+	}
+	return 0;
 }
 void ramdevice_read(sector_t sector_off, u8 *buffer, unsigned int sectors)
 {
-	memcpy(buffer, dev_data + sector_off * RB_SECTOR_SIZE,
-		sectors * RB_SECTOR_SIZE);
+	unsigned int off, cnt;
+	struct page *page;
+
+	while (sectors)
+	{
+		off = sector_off & (RB_PAGE_SECTORS - 1);
+		cnt = min_t(unsigned int, sectors, RB_PAGE_SECTORS - off);
+		rcu_read_lock();
+		if ((page = radix_tree_lookup(&dev_pages, sector_off >> RB_PAGE_SECTORS_SHIFT)))
+		{
+			memcpy(buffer, page_address(page) + off * RB_SECTOR_SIZE, cnt * RB_SECTOR_SIZE);
+		}
+		else /* Hole */
+		{
+			memset(buffer, 0, cnt * RB_SECTOR_SIZE);
+		}
+		rcu_read_unlock();
+		sector_off += cnt;
+		buffer += cnt * RB_SECTOR_SIZE;
+		sectors -= cnt;
+	}
+}
+void ramdevice_discard(sector_t sector_off, unsigned int sectors)
+/*
+ * Makes the range read back as zeroes, by freeing its whole pages, & zeroing
+ * its partial ones at either end
+ */
+{
+	sector_t end = sector_off + sectors;
+	unsigned int off, cnt;
+	struct page *page;
+
+	while (sector_off < end)
+	{
+		off = sector_off & (RB_PAGE_SECTORS - 1);
+		if ((off == 0) && (end - sector_off >= RB_PAGE_SECTORS))
+		{
+			cnt = (end - sector_off) >> RB_PAGE_SECTORS_SHIFT;
+			rb_free_pages(sector_off >> RB_PAGE_SECTORS_SHIFT,
+				(sector_off >> RB_PAGE_SECTORS_SHIFT) + cnt);
+			sector_off += (sector_t)cnt << RB_PAGE_SECTORS_SHIFT;
+			continue;
+		}
+		cnt = min_t(sector_t, end - sector_off, RB_PAGE_SECTORS - off);
+		rcu_read_lock();
+		if ((page = radix_tree_lookup(&dev_pages, sector_off >> RB_PAGE_SECTORS_SHIFT)))
+		{
+			memset(page_address(page) + off * RB_SECTOR_SIZE, 0, cnt * RB_SECTOR_SIZE);
+		}
+		rcu_read_unlock();
+		sector_off += cnt;
+	}
 }
@@ -5,6 +5,7 @@
 
 extern int ramdevice_init(void);
 extern void ramdevice_cleanup(void);
-extern void ramdevice_write(sector_t sector_off, u8 *buffer, unsigned int sectors);
+extern int ramdevice_write(sector_t sector_off, u8 *buffer, unsigned int sectors);
 extern void ramdevice_read(sector_t sector_off, u8 *buffer, unsigned int sectors);
+extern void ramdevice_discard(sector_t sector_off, unsigned int sectors);
 #endif
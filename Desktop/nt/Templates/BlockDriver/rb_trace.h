@@ -0,0 +1,43 @@
+/* Tracepoint for the per request detail of the ram block driver */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM rb
+
+#if !defined(RB_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define RB_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/*
+ * Off by default, costing just a not taken branch, till enabled by
+ * echo 1 > /sys/kernel/debug/tracing/events/rb/rb_transfer/enable
+ */
+TRACE_EVENT(rb_transfer,
+	TP_PROTO(int dir, sector_t sector, unsigned int sectors, u64 ns, int err),
+	TP_ARGS(dir, sector, sectors, ns, err),
+	TP_STRUCT__entry(
+		__field(int, dir)
+		__field(sector_t, sector)
+		__field(unsigned int, sectors)
+		__field(u64, ns)
+		__field(int, err)
+	),
+	TP_fast_assign(
+		__entry->dir = dir;
+		__entry->sector = sector;
+		__entry->sectors = sectors;
+		__entry->ns = ns;
+		__entry->err = err;
+	),
+	TP_printk("%s sector=%llu sectors=%u ns=%llu err=%d",
+		(__entry->dir == WRITE) ? "W" : "R",
+		(unsigned long long)__entry->sector, __entry->sectors,
+		(unsigned long long)__entry->ns, __entry->err)
+);
+#endif
+
+/* This part must be outside the header guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE rb_trace
+#include <trace/define_trace.h>
@@ -9,45 +9,312 @@
 
 #include "akpfs.h"
 
+static inline unsigned int akpfs_extents_per_block(struct super_block *sb)
+{
+	return sb->s_blocksize / sizeof(struct akpfs_extent);
+}
+
+static int akpfs_extent_map(struct inode *inode, sector_t iblock, int create,
+	unsigned int *phys, unsigned int *cnt, int *new)
+/*
+ * Gets the block # (in *phys) of the file block iblock, & the count of the
+ * contiguous blocks from it (in *cnt), alloting it if needed & asked for.
+ * *phys is 0, if not mapped. Expects the inode's map_lock to be held, & for
+ * create, a journal handle
+ */
+{
+	struct super_block *sb = inode->i_sb;
+	struct akpfs_inode_info *ai = AKPFS_I(inode);
+	struct akpfs_extent *ext[2], *e, *prev = NULL, *free = NULL;
+	unsigned int ext_cnt[2], block, ext_block;
+	struct buffer_head *bh = NULL;
+	int i, j;
+
+	*phys = 0;
+	ext[0] = ai->u.extents;
+	ext_cnt[0] = AKPFS_DIRECT_EXTENTS;
+	ext[1] = NULL;
+	ext_cnt[1] = 0;
+	if (ai->u.extents[AKPFS_EXTENT_BLOCK].block)
+	{
+		if (!(bh = sb_bread(sb, ai->u.extents[AKPFS_EXTENT_BLOCK].block)))
+		{
+			printk (KERN_ERR "akp_fs: unable to read extent block\n");
+			return -EIO;
+		}
+		ext[1] = (struct akpfs_extent *)(bh->b_data);
+		ext_cnt[1] = akpfs_extents_per_block(sb);
+	}
+	for (i = 0; i < 2; i++)
+	{
+		for (j = 0; j < ext_cnt[i]; j++)
+		{
+			e = &ext[i][j];
+			if (!e->block_cnt)
+			{
+				if (!free) free = e;
+				continue;
+			}
+			if ((e->file_block <= iblock) && (iblock < e->file_block + e->block_cnt))
+			{
+				*phys = e->block + (iblock - e->file_block);
+				*cnt = e->block_cnt - (iblock - e->file_block);
+				brelse(bh);
+				return 0;
+			}
+			if (e->file_block + e->block_cnt == iblock)
+			{
+				prev = e;
+			}
+		}
+	}
+	if (!create)
+	{
+		brelse(bh);
+		return 0;
+	}
+
+	/* Allot preferably the block just after the previous extent, so as to grow it */
+	if (!(block = akpfs_get_free_block_near(sb, prev ? prev->block + prev->block_cnt : 0)))
+	{
+		brelse(bh);
+		return -ENOSPC;
+	}
+	if (prev && (block == prev->block + prev->block_cnt))
+	{
+		prev->block_cnt++;
+		e = prev;
+	}
+	else
+	{
+		if (!free && !bh) // Time for the extent block
+		{
+			if (!(ext_block = akpfs_get_free_block(sb)) || !(bh = sb_getblk(sb, ext_block)))
+			{
+				if (ext_block) akpfs_put_free_block(sb, ext_block);
+				akpfs_put_free_block(sb, block);
+				return -ENOSPC;
+			}
+			lock_buffer(bh);
+			memset(bh->b_data, 0, bh->b_size);
+			set_buffer_uptodate(bh);
+			unlock_buffer(bh);
+			akpfs_journal_dirty(sb, bh);
+			ai->u.extents[AKPFS_EXTENT_BLOCK].block = ext_block;
+			free = (struct akpfs_extent *)(bh->b_data);
+		}
+		if (!free) // All extents in use
+		{
+			akpfs_put_free_block(sb, block);
+			brelse(bh);
+			return -ENOSPC;
+		}
+		free->file_block = iblock;
+		free->block = block;
+		free->block_cnt = 1;
+		e = free;
+	}
+	if (bh && ((char *)(e) >= bh->b_data) && ((char *)(e) < bh->b_data + bh->b_size))
+	{
+		akpfs_journal_dirty(sb, bh);
+		/* Extent block refers the new block. So, its free bits go in the same transaction */
+		akpfs_sync_free_bits(sb);
+	}
+	brelse(bh);
+	*phys = block;
+	*cnt = 1;
+	*new = 1;
+	return 0;
+}
+
+int akpfs_extent_truncate(struct inode *inode, unsigned int from)
+/*
+ * Frees the file blocks from the file block from onwards, & the extent block
+ * if no more needed. Expects the inode's map_lock to be held, & a journal handle
+ */
+{
+	struct super_block *sb = inode->i_sb;
+	struct akpfs_inode_info *ai = AKPFS_I(inode);
+	struct akpfs_extent *ext[2], *e;
+	unsigned int ext_cnt[2], keep, k;
+	struct buffer_head *bh = NULL;
+	int i, j, used = 0, dirty = 0;
+
+	ext[0] = ai->u.extents;
+	ext_cnt[0] = AKPFS_DIRECT_EXTENTS;
+	ext[1] = NULL;
+	ext_cnt[1] = 0;
+	if (ai->u.extents[AKPFS_EXTENT_BLOCK].block)
+	{
+		if (!(bh = sb_bread(sb, ai->u.extents[AKPFS_EXTENT_BLOCK].block)))
+		{
+			printk (KERN_ERR "akp_fs: unable to read extent block\n");
+			return -EIO;
+		}
+		ext[1] = (struct akpfs_extent *)(bh->b_data);
+		ext_cnt[1] = akpfs_extents_per_block(sb);
+	}
+	for (i = 0; i < 2; i++)
+	{
+		for (j = 0; j < ext_cnt[i]; j++)
+		{
+			e = &ext[i][j];
+			if (!e->block_cnt)
+			{
+				continue;
+			}
+			if (e->file_block + e->block_cnt <= from)
+			{
+				if (i) used++;
+				continue;
+			}
+			keep = (e->file_block < from) ? from - e->file_block : 0;
+			for (k = keep; k < e->block_cnt; k++)
+			{
+				akpfs_put_free_block(sb, e->block + k); // Even if the put fails, let's mark it free
+			}
+			e->block_cnt = keep;
+			if (i)
+			{
+				dirty = 1;
+				if (keep) used++;
+			}
+		}
+	}
+	if (bh)
+	{
+		if (!used)
+		{
+			akpfs_put_free_block(sb, ai->u.extents[AKPFS_EXTENT_BLOCK].block);
+			ai->u.extents[AKPFS_EXTENT_BLOCK].block = 0;
+		}
+		else if (dirty)
+		{
+			akpfs_journal_dirty(sb, bh);
+		}
+		brelse(bh);
+	}
+	return 0;
+}
+
+int akpfs_truncate_blocks(struct inode *inode, unsigned int from)
+/*
+ * Frees the file blocks from the file block from onwards, in the in-core copy
+ * of the file_blocks/extents. Expects the inode's map_lock to be held, & a
+ * journal handle, for the extents
+ */
+{
+	struct super_block *sb = inode->i_sb;
+	struct akpfs_inode_info *ai = AKPFS_I(inode);
+	int i;
+
+	if (akpfs_has_extents(sb))
+	{
+		return akpfs_extent_truncate(inode, from);
+	}
+	for (i = from; i < AKPFS_MAX_BLOCKS_PER_FILE; i++)
+	{
+		if (ai->u.file_blocks[i])
+		{
+			akpfs_put_free_block(sb, ai->u.file_blocks[i]);
+			// Even if the put fails, let's mark it free
+			ai->u.file_blocks[i] = 0;
+		}
+	}
+	return 0;
+}
+
+static int akpfs_extent_get_block(struct inode *inode, sector_t iblock, struct buffer_head *bh_result, int create)
+/* Maps as many of the requested blocks (bh_result->b_size) as are contiguous, in one go */
+{
+	struct super_block *sb = inode->i_sb;
+	struct akpfs_inode_info *ai = AKPFS_I(inode);
+	unsigned int phys, cnt, max_blocks;
+	struct akpfs_journal_handle handle;
+	int new = 0;
+	int err;
+
+	max_blocks = bh_result->b_size >> sb->s_blocksize_bits;
+
+	if (create)
+	{
+		akpfs_journal_start(sb, &handle);
+	}
+	mutex_lock(&ai->map_lock);
+	err = akpfs_extent_map(inode, iblock, create, &phys, &cnt, &new);
+	mutex_unlock(&ai->map_lock);
+	if (create)
+	{
+		akpfs_journal_stop(sb, &handle);
+	}
+	if (err < 0)
+	{
+		return err;
+	}
+	if (!phys)
+	{
+		return -EIO;
+	}
+	if (new)
+	{
+		set_buffer_new(bh_result);
+		mark_inode_dirty(inode);
+	}
+
+	map_bh(bh_result, sb, phys);
+	if (max_blocks > 1)
+	{
+		bh_result->b_size = ((cnt < max_blocks) ? cnt : max_blocks) << sb->s_blocksize_bits;
+	}
+
+	return 0;
+}
+
 static int akpfs_get_block(struct inode *inode, sector_t iblock, struct buffer_head *bh_result, int create)
+/*
+ * Maps from the in-core copy of the file_blocks. A newly alloted block just
+ * dirties the inode, to be written back by akpfs_super_write_inode. The check
+ * & the allotment are under the map_lock, as in the extent path, for the
+ * racing mappers of the same block to not allot it twice
+ */
 {
 	struct super_block *sb = inode->i_sb;
-	struct buffer_head *bh;
-	struct akpfs_inode *akpfs_inode;
-	sector_t phys;
+	struct akpfs_inode_info *ai = AKPFS_I(inode);
+	unsigned int phys;
 
 	printk(KERN_INFO "akp_fs: akpfs_get_block called for I: %ld, B: %llu, C: %d\n",
 			inode->i_ino, (unsigned long long)(iblock), create);
 
-	if (iblock >= AKPFS_MAX_BLOCKS_PER_FILE)
+	if (akpfs_has_extents(sb))
 	{
-		return -ENOSPC;
+		return akpfs_extent_get_block(inode, iblock, bh_result, create);
 	}
 
-	if (!(akpfs_inode = akpfs_get_inode(sb, inode->i_ino, &bh)))
+	if (iblock >= AKPFS_MAX_BLOCKS_PER_FILE)
 	{
-		printk (KERN_ERR "akp_fs: unable to read inode to get blocks\n");
-		return -EIO;
+		return -ENOSPC;
 	}
-	if (!akpfs_inode->u.file_blocks[iblock])
+
+	mutex_lock(&ai->map_lock);
+	if (!(phys = ai->u.file_blocks[iblock]))
 	{
 		if (!create)
 		{
-			brelse(bh);
+			mutex_unlock(&ai->map_lock);
 			return -EIO;
 		}
 		else
 		{
-			if (!(akpfs_inode->u.file_blocks[iblock] = akpfs_get_free_block(sb)))
+			if (!(phys = ai->u.file_blocks[iblock] = akpfs_get_free_block(sb)))
 			{
-				brelse(bh);
+				mutex_unlock(&ai->map_lock);
 				return -ENOSPC;
 			}
-			mark_buffer_dirty(bh);
+			set_buffer_new(bh_result);
+			mark_inode_dirty(inode);
 		}
 	}
-	phys = akpfs_inode->u.file_blocks[iblock];
-	brelse(bh);
+	mutex_unlock(&ai->map_lock);
 
 	map_bh(bh_result, sb, phys);
 
@@ -59,11 +326,29 @@ static int akpfs_readpage(struct file *file, struct page *page)
 	return mpage_readpage(page, akpfs_get_block);
 }
 
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(5,8,0))
+static int akpfs_readpages(struct file *file, struct address_space *mapping,
+	struct list_head *pages, unsigned nr_pages)
+{
+	return mpage_readpages(mapping, pages, nr_pages, akpfs_get_block);
+}
+#else
+static void akpfs_readahead(struct readahead_control *rac)
+{
+	mpage_readahead(rac, akpfs_get_block);
+}
+#endif
+
 static int akpfs_writepage(struct page *page, struct writeback_control *wbc)
 {
 	return block_write_full_page(page, akpfs_get_block, wbc);
 }
 
+static int akpfs_writepages(struct address_space *mapping, struct writeback_control *wbc)
+{
+	return mpage_writepages(mapping, wbc, akpfs_get_block);
+}
+
 static int akpfs_write_begin(struct file *file, struct address_space *mapping,
 	loff_t pos, unsigned len, unsigned flags, struct page **pagep, void **fsdata)
 {
@@ -79,7 +364,13 @@ static int akpfs_write_begin(struct file *file, struct address_space *mapping,
 struct address_space_operations akpfs_aops =
 {
 	.readpage = akpfs_readpage,
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(5,8,0))
+	.readpages = akpfs_readpages,
+#else
+	.readahead = akpfs_readahead,
+#endif
 	.writepage = akpfs_writepage,
+	.writepages = akpfs_writepages,
 	.write_begin = akpfs_write_begin,
 	.write_end = generic_write_end,
 };
@@ -1,8 +1,14 @@
 /* AKP File System Module's Init File */
 #include <linux/module.h>
 #include <linux/kernel.h>
+#include <linux/version.h>
 #include <linux/fs.h>
 #include <linux/buffer_head.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/bitops.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
 #include <linux/errno.h>
 
 #include "akpfs.h"
@@ -55,113 +61,673 @@ umode_t akpfs_get_inode_flags(struct akpfs_inode *ino)
 	}
 }
 
+static unsigned int akpfs_name_hash(const char *file_name)
+{
+	unsigned int hash = 0;
+	int i;
+
+	for (i = 0; (i < AKPFS_MAX_FILE_NAME_SIZE) && file_name[i]; i++)
+	{
+		hash = hash * 31 + file_name[i];
+	}
+	return hash & (AKPFS_DIR_HASH_SIZE - 1);
+}
+
+struct akpfs_dir_cache *akpfs_get_dir_cache(struct inode *dir)
 /*
- * TODO: Race condition between multiple invocations of the following 2
- * functions, not handled yet. It can be done by protecting the complete code of
- * both the functions using a common mutex
+ * Returns the directory's name -> inode cache, building it on the first call,
+ * by reading the directory inode & all its entries' inodes, just once
  */
-unsigned int akpfs_get_free_block(struct super_block *sb)
 {
-	struct akpfs_sb *akpfs_sb = ((struct akpfs_fs_info *)(sb->s_fs_info))->akpfs_sb;
-	unsigned int bi, bc /* block index & count */, ec = 0 /* entry (bitmask) count */;
-	unsigned int first_free_blk, i;
-	struct buffer_head *bh = NULL;
-	unsigned char *bitmask = NULL;
+	struct super_block *sb = dir->i_sb;
+	struct akpfs_dir_cache *dc;
+	struct buffer_head *bh, *bh2;
+	struct akpfs_inode *akpfs_inode, *akpfs_inode2;
+	unsigned int hash;
+	int i;
 
-	for (bi = 0, bc = akpfs_sb->free_bits_block_start;
-								bi < akpfs_sb->free_bits_block_cnt; bi++, bc++)
+	if ((dc = AKPFS_I(dir)->dir_cache))
+	{
+		return dc;
+	}
+
+	if (!(dc = (struct akpfs_dir_cache *)(kmalloc(sizeof(struct akpfs_dir_cache), GFP_KERNEL))))
+	{
+		printk (KERN_ERR "akp_fs: unable to allocate memory for dir cache\n");
+		return ERR_PTR(-ENOMEM);
+	}
+	memset(dc->hash, -1, sizeof(dc->hash));
+	if (!(akpfs_inode = akpfs_get_inode(sb, dir->i_ino, &bh)))
+	{
+		printk (KERN_ERR "akp_fs: unable to read dir inode\n");
+		kfree(dc);
+		return ERR_PTR(-EIO);
+	}
+	if (akpfs_inode->file_size != akpfs_dir)
+	{
+		brelse(bh);
+		kfree(dc);
+		return ERR_PTR(-ENOTDIR);
+	}
+	/* In reverse, so that the hash chains are in the slot order */
+	for (i = AKPFS_MAX_ENTRIES_PER_DIR - 1; i >= 0; i--)
 	{
-		if (!(bh = sb_bread(sb, bc)))
+		dc->next[i] = -1;
+		if (!(dc->entries[i].ino = akpfs_inode->u.dir_entries[i]))
 		{
-			printk (KERN_ERR "akp_fs: unable to read free bits block\n");
-			return -EIO;
+			continue;
+		}
+		if (!(akpfs_inode2 = akpfs_get_inode(sb, dc->entries[i].ino, &bh2)))
+		{
+			printk (KERN_ERR "akp_fs: unable to read inode\n");
+			brelse(bh);
+			kfree(dc);
+			return ERR_PTR(-EIO);
+		}
+		memcpy(dc->entries[i].file_name, akpfs_inode2->file_name, AKPFS_MAX_FILE_NAME_SIZE);
+		dc->entries[i].type = akpfs_get_file_type(akpfs_inode2);
+		brelse(bh2);
+		hash = akpfs_name_hash(dc->entries[i].file_name);
+		dc->next[i] = dc->hash[hash];
+		dc->hash[hash] = i;
+	}
+	brelse(bh);
+
+	/* Parallel lookups may race in building it. First one wins */
+	if (cmpxchg(&AKPFS_I(dir)->dir_cache, NULL, dc) != NULL)
+	{
+		kfree(dc);
+		dc = AKPFS_I(dir)->dir_cache;
+	}
+	return dc;
+}
+
+int akpfs_dir_cache_lookup(struct akpfs_dir_cache *dc, const char *file_name)
+{
+	int i;
+
+	for (i = dc->hash[akpfs_name_hash(file_name)]; i != -1; i = dc->next[i])
+	{
+		if (!strncmp(file_name, dc->entries[i].file_name, AKPFS_MAX_FILE_NAME_SIZE))
+		{
+			return i;
 		}
-		bitmask = (unsigned char *)(bh->b_data);
-		for (ec = 0; ec < akpfs_sb->free_bits_per_block / 8; ec++)
+	}
+	return -1;
+}
+
+void akpfs_invalidate_dir_cache(struct inode *dir)
+/*
+ * Expected to be called with the directory's i_mutex held, on a change in the
+ * directory, so that no lookup/readdir is using the cache. Or, on its eviction
+ */
+{
+	kfree(xchg(&AKPFS_I(dir)->dir_cache, NULL));
+}
+
+void akpfs_dir_cache_add(struct inode *dir, int slot, unsigned int ino, umode_t type,
+	const char *file_name)
+/* Updates the cache, if built, in place, instead of dropping it for a rebuild */
+{
+	struct akpfs_dir_cache *dc = AKPFS_I(dir)->dir_cache;
+	unsigned int hash;
+
+	if (!dc)
+	{
+		return;
+	}
+	dc->entries[slot].ino = ino;
+	dc->entries[slot].type = type;
+	strncpy(dc->entries[slot].file_name, file_name, AKPFS_MAX_FILE_NAME_SIZE);
+	hash = akpfs_name_hash(dc->entries[slot].file_name);
+	dc->next[slot] = dc->hash[hash];
+	dc->hash[hash] = slot;
+}
+
+void akpfs_dir_cache_remove(struct inode *dir, int slot)
+{
+	struct akpfs_dir_cache *dc = AKPFS_I(dir)->dir_cache;
+	signed char *p;
+
+	if (!dc || !dc->entries[slot].ino)
+	{
+		return;
+	}
+	for (p = &dc->hash[akpfs_name_hash(dc->entries[slot].file_name)]; *p != -1; p = &dc->next[*p])
+	{
+		if (*p == slot)
 		{
-			if (bitmask[ec] != 0xFF)
+			*p = dc->next[slot];
+			break;
+		}
+	}
+	dc->entries[slot].ino = 0;
+	dc->next[slot] = -1;
+}
+
+void akpfs_trans_init(struct akpfs_trans *trans, struct super_block *sb)
+{
+	trans->sb = sb;
+	trans->bh_cnt = 0;
+	akpfs_journal_start(sb, &trans->handle);
+}
+
+struct akpfs_inode *akpfs_trans_get_inode(struct akpfs_trans *trans, int ino)
+{
+	struct akpfs_sb *akpfs_sb = ((struct akpfs_fs_info *)(trans->sb->s_fs_info))->akpfs_sb;
+	sector_t block = akpfs_sb->inodes_block_start + (ino / akpfs_sb->inodes_per_block);
+	struct buffer_head *bh;
+	int i;
+
+	if ((ino <= 0) || (ino >= akpfs_sb->inodes_block_cnt * akpfs_sb->inodes_per_block))
+	{
+		printk (KERN_ERR "akp_fs: invalid inode #%d\n", ino);
+		return NULL;
+	}
+	for (i = 0; i < trans->bh_cnt; i++)
+	{
+		if (trans->bh[i]->b_blocknr == block)
+		{
+			break;
+		}
+	}
+	if (i == trans->bh_cnt)
+	{
+		if (i == AKPFS_TRANS_MAX_BH)
+		{
+			printk (KERN_ERR "akp_fs: too many blocks in transaction\n");
+			return NULL;
+		}
+		if (!(bh = sb_bread(trans->sb, block)))
+		{
+			printk (KERN_ERR "akp_fs: unable to read inode\n");
+			return NULL;
+		}
+		trans->bh[trans->bh_cnt++] = bh;
+	}
+	return ((struct akpfs_inode *)(trans->bh[i]->b_data)) + (ino % akpfs_sb->inodes_per_block);
+}
+
+static void akpfs_trans_release(struct akpfs_trans *trans)
+{
+	int i;
+
+	for (i = 0; i < trans->bh_cnt; i++)
+	{
+		brelse(trans->bh[i]);
+	}
+	trans->bh_cnt = 0;
+	akpfs_journal_stop(trans->sb, &trans->handle);
+}
+
+int akpfs_trans_commit(struct akpfs_trans *trans, int sync)
+/*
+ * With the journal, sync commits the running transaction having these blocks.
+ * Otherwise, the writes of all the blocks are issued together, & then waited on
+ */
+{
+	struct akpfs_fs_info *info = (struct akpfs_fs_info *)(trans->sb->s_fs_info);
+	int i, retval = 0;
+
+	for (i = 0; i < trans->bh_cnt; i++)
+	{
+		akpfs_journal_dirty(trans->sb, trans->bh[i]);
+	}
+	if (sync && !info->journal)
+	{
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(4,8,0))
+		ll_rw_block(WRITE, trans->bh_cnt, trans->bh);
+#else
+		ll_rw_block(REQ_OP_WRITE, 0, trans->bh_cnt, trans->bh);
+#endif
+		for (i = 0; i < trans->bh_cnt; i++)
+		{
+			wait_on_buffer(trans->bh[i]);
+			if (!buffer_uptodate(trans->bh[i]))
 			{
-				break;
+				printk (KERN_ERR "akp_fs: IO error syncing inode block %llu\n",
+						(unsigned long long)(trans->bh[i]->b_blocknr));
+				retval = -EIO;
 			}
 		}
-		if (ec < akpfs_sb->free_bits_per_block / 8)
+	}
+	akpfs_trans_release(trans);
+	if (sync && info->journal)
+	{
+		retval = akpfs_journal_commit(trans->sb);
+	}
+	return retval;
+}
+
+void akpfs_trans_abort(struct akpfs_trans *trans)
+{
+	akpfs_trans_release(trans);
+}
+
+/*
+ * The free bits are kept as a little endian bitmap, i.e. bit (b % 8) of byte
+ * (b / 8) for block b, as laid out by mkfs.akp
+ */
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,39))
+#define find_next_zero_bit_le(addr, size, off) ext2_find_next_zero_bit((unsigned long *)(addr), size, off)
+#define __set_bit_le(nr, addr) ext2_set_bit(nr, addr)
+#define __test_and_clear_bit_le(nr, addr) ext2_clear_bit(nr, addr)
+#define test_bit_le(nr, addr) ext2_test_bit(nr, addr)
+#endif
+
+static inline unsigned int free_bits_bytes_per_block(struct akpfs_sb *akpfs_sb)
+{
+	return akpfs_sb->free_bits_per_block / 8;
+}
+
+int akpfs_load_free_bits(struct super_block *sb)
+/* Reads in all the free bits blocks, to be searched & updated in memory */
+{
+	struct akpfs_fs_info *info = (struct akpfs_fs_info *)(sb->s_fs_info);
+	struct akpfs_sb *akpfs_sb = info->akpfs_sb;
+	unsigned int bi, bpb = free_bits_bytes_per_block(akpfs_sb);
+	struct buffer_head *bh;
+
+	if (!(info->free_bits = vmalloc(akpfs_sb->free_bits_block_cnt * bpb)))
+	{
+		printk (KERN_ERR "akp_fs: unable to allocate memory for free bits\n");
+		return -ENOMEM;
+	}
+	if (!(info->dirty_free_bits = kzalloc(BITS_TO_LONGS(akpfs_sb->free_bits_block_cnt) *
+									sizeof(unsigned long), GFP_KERNEL)))
+	{
+		printk (KERN_ERR "akp_fs: unable to allocate memory for free bits\n");
+		vfree(info->free_bits);
+		info->free_bits = NULL;
+		return -ENOMEM;
+	}
+	for (bi = 0; bi < akpfs_sb->free_bits_block_cnt; bi++)
+	{
+		if (!(bh = sb_bread(sb, akpfs_sb->free_bits_block_start + bi)))
 		{
-			break;
+			printk (KERN_ERR "akp_fs: unable to read free bits block\n");
+			akpfs_unload_free_bits(sb);
+			return -EIO;
 		}
+		memcpy((char *)(info->free_bits) + bi * bpb, bh->b_data, bpb);
 		brelse(bh);
 	}
-	if (bi >= akpfs_sb->free_bits_block_cnt)
+	info->free_cursor = akpfs_sb->data_block_start;
+	mutex_init(&info->free_bits_lock);
+	return 0;
+}
+void akpfs_unload_free_bits(struct super_block *sb)
+/* Expects the free bits to be already written back, if needed. Also drops the inode usage */
+{
+	struct akpfs_fs_info *info = (struct akpfs_fs_info *)(sb->s_fs_info);
+
+	if (info->used_inodes)
 	{
-		return 0; // No free block
+		vfree(info->used_inodes);
+		info->used_inodes = NULL;
 	}
-	first_free_blk = bi * akpfs_sb->free_bits_per_block + ec * 8;
-	for (i = 0; i < 8; i++, first_free_blk++)
+	if (info->dirty_free_bits)
 	{
-		if (!(bitmask[ec] & (1 << i)))
+		kfree(info->dirty_free_bits);
+		info->dirty_free_bits = NULL;
+	}
+	if (info->free_bits)
+	{
+		vfree(info->free_bits);
+		info->free_bits = NULL;
+	}
+}
+int akpfs_sync_free_bits(struct super_block *sb)
+/* Writes back the modified free bits blocks into the buffer cache */
+{
+	struct akpfs_fs_info *info = (struct akpfs_fs_info *)(sb->s_fs_info);
+	struct akpfs_sb *akpfs_sb = info->akpfs_sb;
+	unsigned int bi, bpb = free_bits_bytes_per_block(akpfs_sb);
+	struct buffer_head *bh;
+	int retval = 0;
+
+	mutex_lock(&info->free_bits_lock);
+	for_each_set_bit(bi, info->dirty_free_bits, akpfs_sb->free_bits_block_cnt)
+	{
+		if (!(bh = sb_bread(sb, akpfs_sb->free_bits_block_start + bi)))
 		{
+			printk (KERN_ERR "akp_fs: unable to read free bits block\n");
+			retval = -EIO;
 			break;
 		}
+		memcpy(bh->b_data, (char *)(info->free_bits) + bi * bpb, bpb);
+		akpfs_journal_dirty(sb, bh);
+		brelse(bh);
+		__clear_bit(bi, info->dirty_free_bits);
 	}
-	if ((i >= 8) /* Race condition case */ ||
-		(first_free_blk >= akpfs_sb->block_cnt))
+	mutex_unlock(&info->free_bits_lock);
+	return retval;
+}
+
+/*
+ * The following 2 functions work on the in-memory free bits, protected by
+ * free_bits_lock. So, the allocation costs a bitmap search from the rotating
+ * free_cursor, irrespective of the free_bits_block_cnt
+ */
+unsigned int akpfs_get_free_block(struct super_block *sb)
+/* Returns the free block #, or 0 if no free block */
+{
+	struct akpfs_fs_info *info = (struct akpfs_fs_info *)(sb->s_fs_info);
+	struct akpfs_sb *akpfs_sb = info->akpfs_sb;
+	unsigned int first_free_blk;
+
+	mutex_lock(&info->free_bits_lock);
+	first_free_blk = find_next_zero_bit_le(info->free_bits, akpfs_sb->block_cnt, info->free_cursor);
+	if (first_free_blk >= akpfs_sb->block_cnt)
 	{
-		brelse(bh);
+		first_free_blk = find_next_zero_bit_le(info->free_bits, akpfs_sb->block_cnt,
+												akpfs_sb->data_block_start);
+	}
+	if (first_free_blk >= akpfs_sb->block_cnt)
+	{
+		mutex_unlock(&info->free_bits_lock);
 		return 0; // No free block
 	}
-	else
+	__set_bit_le(first_free_blk, info->free_bits);
+	__set_bit(first_free_blk / akpfs_sb->free_bits_per_block, info->dirty_free_bits);
+	info->free_cursor = first_free_blk + 1;
+	mutex_unlock(&info->free_bits_lock);
+	printk(KERN_INFO "akp_fs: Alloted free block #%d\n", first_free_blk);
+	return first_free_blk;
+}
+unsigned int akpfs_get_free_block_near(struct super_block *sb, unsigned int goal)
+/* Gets the goal block, if free, so as to grow a file contiguously. Else, any free block */
+{
+	struct akpfs_fs_info *info = (struct akpfs_fs_info *)(sb->s_fs_info);
+	struct akpfs_sb *akpfs_sb = info->akpfs_sb;
+
+	if ((akpfs_sb->data_block_start <= goal) && (goal < akpfs_sb->block_cnt))
 	{
-		bitmask[ec] |= (1 << i);
-		mark_buffer_dirty(bh);
-		printk(KERN_INFO "akp_fs: Alloted free block #%d\n", first_free_blk);
-		brelse(bh);
-		return first_free_blk;
+		mutex_lock(&info->free_bits_lock);
+		if (!test_bit_le(goal, info->free_bits))
+		{
+			__set_bit_le(goal, info->free_bits);
+			__set_bit(goal / akpfs_sb->free_bits_per_block, info->dirty_free_bits);
+			info->free_cursor = goal + 1;
+			mutex_unlock(&info->free_bits_lock);
+			return goal;
+		}
+		mutex_unlock(&info->free_bits_lock);
 	}
+	return akpfs_get_free_block(sb);
 }
 int akpfs_put_free_block(struct super_block *sb, int block_no)
 {
-	struct akpfs_sb *akpfs_sb = ((struct akpfs_fs_info *)(sb->s_fs_info))->akpfs_sb;
-	struct buffer_head *bh;
-	unsigned char *bitmask;
-	int bitpos;
+	struct akpfs_fs_info *info = (struct akpfs_fs_info *)(sb->s_fs_info);
+	struct akpfs_sb *akpfs_sb = info->akpfs_sb;
 
 	if (block_no >= akpfs_sb->block_cnt)
 	{
 		return -EINVAL;
 	}
-	if (!(bh = sb_bread(sb, akpfs_sb->free_bits_block_start +
-								block_no / akpfs_sb->free_bits_per_block)))
+	mutex_lock(&info->free_bits_lock);
+	if (!__test_and_clear_bit_le(block_no, info->free_bits))
 	{
-		printk (KERN_ERR "akp_fs: unable to read free bits block\n");
-		return -EIO;
+		mutex_unlock(&info->free_bits_lock);
+		printk (KERN_WARNING "akp_fs: Block #%d already freed\n", block_no);
+		return 0;
 	}
-	bitmask = (unsigned char *)(bh->b_data);
-	bitmask += (block_no % akpfs_sb->free_bits_per_block) / 8;
-	bitpos = (block_no % akpfs_sb->free_bits_per_block) % 8;
-	if (!((*bitmask) & (1 << bitpos)))
+	__set_bit(block_no / akpfs_sb->free_bits_per_block, info->dirty_free_bits);
+	mutex_unlock(&info->free_bits_lock);
+	printk(KERN_INFO "akp_fs: Freed alloted block #%d\n", block_no);
+	return 0;
+}
+
+static inline unsigned int akpfs_inodes_block_init_cnt(struct akpfs_sb *akpfs_sb)
+{
+	return (akpfs_sb->feature_flags & AKPFS_FEATURE_LAZY_ITABLE) ?
+		akpfs_sb->inodes_block_init_cnt : akpfs_sb->inodes_block_cnt;
+}
+
+static int akpfs_init_inode_blocks(struct super_block *sb, unsigned int ino)
+/*
+ * Zeroes the uninitialized inode blocks up to the one having the ino, if not
+ * yet done, & records it in the super block. Expects the inode_bits_lock to be
+ * held, & a journal handle
+ */
+{
+	struct akpfs_fs_info *info = (struct akpfs_fs_info *)(sb->s_fs_info);
+	struct akpfs_sb *akpfs_sb = info->akpfs_sb;
+	unsigned int bi;
+	struct buffer_head *bh;
+
+	for (bi = akpfs_inodes_block_init_cnt(akpfs_sb); bi <= ino / akpfs_sb->inodes_per_block; bi++)
 	{
-		printk (KERN_WARNING "akp_fs: Block #%d already freed\n", block_no);
+		if (!(bh = sb_getblk(sb, akpfs_sb->inodes_block_start + bi)))
+		{
+			printk (KERN_ERR "akp_fs: unable to get inode block\n");
+			return -EIO;
+		}
+		lock_buffer(bh);
+		memset(bh->b_data, 0, bh->b_size);
+		set_buffer_uptodate(bh);
+		unlock_buffer(bh);
+		akpfs_journal_dirty(sb, bh);
+		brelse(bh);
+		akpfs_sb->inodes_block_init_cnt = bi + 1;
+		akpfs_journal_dirty(sb, info->bh);
 	}
-	else
+	return 0;
+}
+
+static int akpfs_load_used_inodes(struct super_block *sb)
+/*
+ * Expects the inode_bits_lock to be held. Inodes in the uninitialized inode
+ * blocks are all free, & so not read
+ */
+{
+	struct akpfs_fs_info *info = (struct akpfs_fs_info *)(sb->s_fs_info);
+	struct akpfs_sb *akpfs_sb = info->akpfs_sb;
+	unsigned int bi, i, inode_cnt = akpfs_sb->inodes_block_cnt * akpfs_sb->inodes_per_block;
+	struct buffer_head *bh;
+	struct akpfs_inode *akpfs_inode;
+
+	if (!(info->used_inodes = vmalloc(BITS_TO_LONGS(inode_cnt) * sizeof(unsigned long))))
 	{
-		(*bitmask) &= ~(1 << bitpos);
-		mark_buffer_dirty(bh);
-		printk(KERN_INFO "akp_fs: Freed alloted block #%d\n", block_no);
+		printk (KERN_ERR "akp_fs: unable to allocate memory for inode usage\n");
+		return -ENOMEM;
 	}
-	brelse(bh);
+	memset(info->used_inodes, 0, BITS_TO_LONGS(inode_cnt) * sizeof(unsigned long));
+	for (bi = 0; bi < akpfs_inodes_block_init_cnt(akpfs_sb); bi++)
+	{
+		if (!(bh = sb_bread(sb, akpfs_sb->inodes_block_start + bi)))
+		{
+			printk (KERN_ERR "akp_fs: unable to read inode block\n");
+			vfree(info->used_inodes);
+			info->used_inodes = NULL;
+			return -EIO;
+		}
+		akpfs_inode = (struct akpfs_inode *)(bh->b_data);
+		for (i = 0; i < akpfs_sb->inodes_per_block; i++)
+		{
+			if (akpfs_inode[i].file_name[0])
+			{
+				__set_bit(bi * akpfs_sb->inodes_per_block + i, info->used_inodes);
+			}
+		}
+		brelse(bh);
+	}
+	__set_bit(0, info->used_inodes); // 0 is an empty dir_entries slot, so never a valid inode #
+	__set_bit(akpfs_sb->root_inode, info->used_inodes);
+	info->inode_cursor = akpfs_sb->root_inode + 1;
+	return 0;
+}
+
+unsigned int akpfs_get_free_inode(struct super_block *sb)
+{
+	struct akpfs_fs_info *info = (struct akpfs_fs_info *)(sb->s_fs_info);
+	struct akpfs_sb *akpfs_sb = info->akpfs_sb;
+	unsigned int ino, inode_cnt = akpfs_sb->inodes_block_cnt * akpfs_sb->inodes_per_block;
+
+	mutex_lock(&info->inode_bits_lock);
+	if (!info->used_inodes && (akpfs_load_used_inodes(sb) < 0))
+	{
+		mutex_unlock(&info->inode_bits_lock);
+		return 0;
+	}
+	ino = find_next_zero_bit(info->used_inodes, inode_cnt, info->inode_cursor);
+	if (ino >= inode_cnt)
+	{
+		ino = find_first_zero_bit(info->used_inodes, inode_cnt);
+	}
+	if (ino >= inode_cnt)
+	{
+		mutex_unlock(&info->inode_bits_lock);
+		return 0; // No free inode
+	}
+	if ((akpfs_sb->feature_flags & AKPFS_FEATURE_LAZY_ITABLE) && (akpfs_init_inode_blocks(sb, ino) < 0))
+	{
+		mutex_unlock(&info->inode_bits_lock);
+		return 0;
+	}
+	__set_bit(ino, info->used_inodes);
+	info->inode_cursor = ino + 1;
+	mutex_unlock(&info->inode_bits_lock);
+	return ino;
+}
+void akpfs_put_free_inode(struct super_block *sb, unsigned int ino)
+/* Expects the inode to be already cleared on disk, for a later load to also find it free */
+{
+	struct akpfs_fs_info *info = (struct akpfs_fs_info *)(sb->s_fs_info);
+
+	mutex_lock(&info->inode_bits_lock);
+	if (info->used_inodes)
+	{
+		__clear_bit(ino, info->used_inodes);
+	}
+	mutex_unlock(&info->inode_bits_lock);
+}
+
+int akpfs_orphan_add(struct super_block *sb, unsigned int ino)
+{
+	struct akpfs_fs_info *info = (struct akpfs_fs_info *)(sb->s_fs_info);
+	struct akpfs_orphans *o = akpfs_orphans(info->akpfs_sb);
+	unsigned int max = akpfs_max_orphans(info->akpfs_sb->block_size);
+
+	mutex_lock(&info->orphan_lock);
+	if (o->cnt > max)
+	{
+		o->cnt = 0;
+	}
+	if (o->cnt == max)
+	{
+		mutex_unlock(&info->orphan_lock);
+		printk (KERN_ERR "akp_fs: orphan list full, with %u inodes\n", max);
+		return -ENOSPC;
+	}
+	o->ino[o->cnt++] = ino;
+	akpfs_journal_dirty(sb, info->bh);
+	mutex_unlock(&info->orphan_lock);
 	return 0;
 }
+void akpfs_orphan_del(struct super_block *sb, unsigned int ino)
+/* Fills its slot with the last one. A no-op for an inode not in the list */
+{
+	struct akpfs_fs_info *info = (struct akpfs_fs_info *)(sb->s_fs_info);
+	struct akpfs_orphans *o = akpfs_orphans(info->akpfs_sb);
+	unsigned int i;
+
+	mutex_lock(&info->orphan_lock);
+	for (i = 0; (o->cnt <= akpfs_max_orphans(info->akpfs_sb->block_size)) && (i < o->cnt); i++)
+	{
+		if (o->ino[i] == ino)
+		{
+			o->ino[i] = o->ino[--o->cnt];
+			o->ino[o->cnt] = 0;
+			akpfs_journal_dirty(sb, info->bh);
+			break;
+		}
+	}
+	mutex_unlock(&info->orphan_lock);
+}
+void akpfs_orphan_cleanup(struct super_block *sb)
+/*
+ * Each orphan is freed by its eviction (akpfs_remove_inode), once its link
+ * count is dropped, & that also takes it off the list. An orphan that can't be
+ * read in, or is already free on disk, is just taken off the list
+ */
+{
+	struct akpfs_fs_info *info = (struct akpfs_fs_info *)(sb->s_fs_info);
+	struct akpfs_sb *akpfs_sb = info->akpfs_sb;
+	struct akpfs_orphans *o = akpfs_orphans(akpfs_sb);
+	struct akpfs_journal_handle handle;
+	struct inode *inode;
+	unsigned int ino;
+
+	mutex_lock(&info->orphan_lock);
+	if (o->cnt > akpfs_max_orphans(akpfs_sb->block_size))
+	{
+		printk (KERN_ERR "akp_fs: invalid orphan count %u. Ignoring the orphan list\n", o->cnt);
+		o->cnt = 0;
+	}
+	mutex_unlock(&info->orphan_lock);
+	/* Each pass takes the last one off the list, till empty */
+	while (o->cnt)
+	{
+		ino = o->ino[o->cnt - 1];
+		printk(KERN_INFO "akp_fs: freeing orphan inode %u\n", ino);
+		if (!ino || (ino == akpfs_sb->root_inode) ||
+			(ino >= akpfs_sb->inodes_block_cnt * akpfs_sb->inodes_per_block))
+		{
+			inode = ERR_PTR(-EINVAL);
+		}
+		else
+		{
+			inode = akpfs_iget(sb, ino);
+		}
+		if (!IS_ERR(inode))
+		{
+			clear_nlink(inode);
+			iput(inode);
+		}
+		if (o->cnt && (o->ino[o->cnt - 1] == ino))
+		{
+			printk (KERN_ERR "akp_fs: unable to free orphan inode %u\n", ino);
+			akpfs_journal_start(sb, &handle);
+			akpfs_orphan_del(sb, ino);
+			akpfs_journal_stop(sb, &handle);
+		}
+	}
+}
+
+struct kmem_cache *akpfs_inode_cachep;
+
+static void akpfs_inode_init_once(void *obj)
+{
+	struct akpfs_inode_info *ai = (struct akpfs_inode_info *)(obj);
+
+	mutex_init(&ai->map_lock);
+	inode_init_once(&ai->vfs_inode);
+}
 
 static int __init akpfs_init(void)
 {
 	int err;
 
+	akpfs_inode_cachep = kmem_cache_create("akpfs_inode_cache", sizeof(struct akpfs_inode_info),
+								0, SLAB_RECLAIM_ACCOUNT, akpfs_inode_init_once);
+	if (!akpfs_inode_cachep)
+	{
+		return -ENOMEM;
+	}
 	err = register_filesystem(&akpfs);
+	if (err)
+	{
+		kmem_cache_destroy(akpfs_inode_cachep);
+	}
 	return err;
 }
 
 static void __exit akpfs_exit(void)
 {
 	unregister_filesystem(&akpfs);
+	rcu_barrier(); // Wait for the RCU delayed inode frees, before destroying their cache
+	kmem_cache_destroy(akpfs_inode_cachep);
 }
 
 module_init(akpfs_init);
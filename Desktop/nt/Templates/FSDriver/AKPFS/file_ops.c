@@ -10,6 +10,10 @@
 
 static int akpfs_file_open(struct inode *inode, struct file *file)
 {
+	if (!((struct akpfs_fs_info *)(inode->i_sb->s_fs_info))->readahead)
+	{
+		file->f_ra.ra_pages = 0; /* No read-ahead, as per the mount option */
+	}
 	return generic_file_open(inode, file);
 }
 
@@ -23,7 +27,6 @@ static ssize_t akpfs_file_read(struct file *file, char __user *buf, size_t len,
 {
 	printk(KERN_INFO "akp_fs: akpfs_file_read max_readahead = %d\n", file->f_ra.ra_pages);
 
-	file->f_ra.ra_pages = 0; /* No read-ahead */
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(3,16,0))
 	return do_sync_read(file, buf, len, off);
 #else
@@ -47,9 +50,7 @@ static ssize_t akpfs_file_write(struct file *file, const char __user *buf, size_
 static int akpfs_file_readdir(struct file *file, void *dirent, filldir_t filldir)
 {
 	struct dentry *de = file->f_dentry;
-	struct super_block *sb = de->d_inode->i_sb;
-	struct buffer_head *bh, *bh2;
-	struct akpfs_inode *akpfs_inode, *akpfs_inode2;
+	struct akpfs_dir_cache *dc;
 	int i, pos, retval;
 
 	printk(KERN_INFO "akp_fs: akpfs_file_readdir\n");
@@ -77,49 +78,36 @@ static int akpfs_file_readdir(struct file *file, void *dirent, filldir_t filldir
 		file->f_pos++;
 	}
 	pos = 1; /* For . & .. */
-	if (!(akpfs_inode = akpfs_get_inode(sb, de->d_inode->i_ino, &bh)))
+	dc = akpfs_get_dir_cache(de->d_inode);
+	if (IS_ERR(dc))
 	{
-		printk (KERN_ERR "akp_fs: unable to read parent inode\n");
-		return -EIO;
+		printk (KERN_ERR "akp_fs: unable to read dir\n");
+		return PTR_ERR(dc);
 	}
 	for (i = 0; i < AKPFS_MAX_ENTRIES_PER_DIR; i++)
 	{
-		if (akpfs_inode->u.dir_entries[i])
+		if (dc->entries[i].ino)
 		{
 			pos++;
-			if (!(akpfs_inode2 =
-						akpfs_get_inode(sb, akpfs_inode->u.dir_entries[i], &bh2)))
-			{
-				printk (KERN_ERR "akp_fs: unable to read inode\n");
-				brelse(bh);
-				return -EIO;
-			}
 			if (pos == file->f_pos)
 			{
-				retval = filldir(dirent, akpfs_inode2->file_name,
-						strnlen(akpfs_inode2->file_name, AKPFS_MAX_FILE_NAME_SIZE),
-						file->f_pos, akpfs_inode->u.dir_entries[i],
-						akpfs_get_file_type(akpfs_inode2));
+				retval = filldir(dirent, dc->entries[i].file_name,
+						strnlen(dc->entries[i].file_name, AKPFS_MAX_FILE_NAME_SIZE),
+						file->f_pos, dc->entries[i].ino, dc->entries[i].type);
 				if (retval)
 				{
-					brelse(bh2);
-					brelse(bh);
 					return retval;
 				}
 				file->f_pos++;
 			}
-			brelse(bh2);
 		}
 	}
-	brelse(bh);
 	return 0;
 }
 #else
 static int akpfs_file_iterate(struct file *file, struct dir_context *ctx)
 {
-	struct super_block *sb = file_inode(file)->i_sb;
-	struct buffer_head *bh, *bh2;
-	struct akpfs_inode *akpfs_inode, *akpfs_inode2;
+	struct akpfs_dir_cache *dc;
 	int i, pos;
 
 	printk(KERN_INFO "akp_fs: akpfs_file_iterate\n");
@@ -133,40 +121,29 @@ static int akpfs_file_iterate(struct file *file, struct dir_context *ctx)
 		return -ENOSPC;
 	}
 	pos = 1; /* For . & .. */
-	if (!(akpfs_inode = akpfs_get_inode(sb, file_inode(file)->i_ino, &bh)))
+	dc = akpfs_get_dir_cache(file_inode(file));
+	if (IS_ERR(dc))
 	{
-		printk (KERN_ERR "akp_fs: unable to read parent inode\n");
-		return -EIO;
+		printk (KERN_ERR "akp_fs: unable to read dir\n");
+		return PTR_ERR(dc);
 	}
 	for (i = 0; i < AKPFS_MAX_ENTRIES_PER_DIR; i++)
 	{
-		if (akpfs_inode->u.dir_entries[i])
+		if (dc->entries[i].ino)
 		{
 			pos++;
-			if (!(akpfs_inode2 =
-						akpfs_get_inode(sb, akpfs_inode->u.dir_entries[i], &bh2)))
-			{
-				printk (KERN_ERR "akp_fs: unable to read inode\n");
-				brelse(bh);
-				return -EIO;
-			}
 			if (pos == ctx->pos)
 			{
-				if (!dir_emit(ctx, akpfs_inode2->file_name,
-						strnlen(akpfs_inode2->file_name, AKPFS_MAX_FILE_NAME_SIZE),
-						akpfs_inode->u.dir_entries[i],
-						akpfs_get_file_type(akpfs_inode2)))
+				if (!dir_emit(ctx, dc->entries[i].file_name,
+						strnlen(dc->entries[i].file_name, AKPFS_MAX_FILE_NAME_SIZE),
+						dc->entries[i].ino, dc->entries[i].type))
 				{
-					brelse(bh2);
-					brelse(bh);
 					return -ENOSPC;
 				}
 				ctx->pos++;
 			}
-			brelse(bh2);
 		}
 	}
-	brelse(bh);
 	return 0;
 }
 #endif
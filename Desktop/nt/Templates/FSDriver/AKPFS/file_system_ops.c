@@ -9,6 +9,39 @@
 
 #include "akpfs.h"
 
+static int akpfs_parse_options(char *options, struct akpfs_fs_info *akpfs_fs_info)
+/* Comma separated options: readahead (default) / noreadahead */
+{
+	char *p;
+
+	akpfs_fs_info->readahead = 1;
+	if (!options)
+	{
+		return 0;
+	}
+	while ((p = strsep(&options, ",")) != NULL)
+	{
+		if (!*p)
+		{
+			continue;
+		}
+		if (!strcmp(p, "readahead"))
+		{
+			akpfs_fs_info->readahead = 1;
+		}
+		else if (!strcmp(p, "noreadahead"))
+		{
+			akpfs_fs_info->readahead = 0;
+		}
+		else
+		{
+			printk (KERN_ERR "akp_fs: unknown mount option %s\n", p);
+			return -EINVAL;
+		}
+	}
+	return 0;
+}
+
 static int akpfs_fill_super(struct super_block *sb, void *data, int silent)
 {
 	struct buffer_head *bh, *bh2;
@@ -16,6 +49,7 @@ static int akpfs_fill_super(struct super_block *sb, void *data, int silent)
 	struct akpfs_sb *akpfs_sb;
 	struct inode *root_inode;
 	struct akpfs_inode *akpfs_root_inode;
+	int err;
 
 	printk(KERN_INFO "akp_fs: akpfs_fill_super\n");
 
@@ -26,6 +60,13 @@ static int akpfs_fill_super(struct super_block *sb, void *data, int silent)
 		printk (KERN_ERR "akp_fs: unable to allocate memory for fs info\n");
 		return -ENOMEM;
 	}
+	mutex_init(&akpfs_fs_info->inode_bits_lock);
+	mutex_init(&akpfs_fs_info->orphan_lock);
+	if ((err = akpfs_parse_options((char *)(data), akpfs_fs_info)) < 0)
+	{
+		kfree(akpfs_fs_info);
+		return err;
+	}
 	if (!(bh = sb_bread(sb, 0 /* First block */)))
 	/* If all goes fine, this bh will be brelse in akpfs_kill_sb */
 	{
@@ -43,15 +84,60 @@ static int akpfs_fill_super(struct super_block *sb, void *data, int silent)
 		kfree(akpfs_fs_info);
 		return -EINVAL;
 	}
+	if (akpfs_sb->feature_flags & ~AKPFS_SUPPORTED_FEATURES)
+	{
+		printk (KERN_ERR "akp_fs: unsupported features 0x%X\n",
+			akpfs_sb->feature_flags & ~AKPFS_SUPPORTED_FEATURES);
+		brelse(bh);
+		kfree(akpfs_fs_info);
+		return -EINVAL;
+	}
 	sb->s_fs_info = akpfs_fs_info;
 	if (sb_min_blocksize(sb, akpfs_sb->block_size) != akpfs_sb->block_size)
 	{
 		printk (KERN_ERR "akp_fs: unable to set the block device block size to the file system block size\n");
+		sb->s_fs_info = NULL;
 		brelse(bh);
 		kfree(akpfs_fs_info);
 		return -EINVAL;
 	}
+	/* Re-reading, as in the file system block size now, for it to be journaled as is */
+	brelse(bh);
+	if (!(bh = sb_bread(sb, 0 /* First block */)))
+	{
+		printk (KERN_ERR "akp_fs: unable to re-read super block\n");
+		sb->s_fs_info = NULL;
+		kfree(akpfs_fs_info);
+		return -EIO;
+	}
+	akpfs_fs_info->bh = bh;
+	akpfs_sb = (struct akpfs_sb *)(bh->b_data);
+	akpfs_fs_info->akpfs_sb = akpfs_sb;
+	/* Replays the journal, if needed. So, before anything else reads the metadata */
+	if ((err = akpfs_journal_load(sb)) < 0)
+	{
+		sb->s_fs_info = NULL;
+		brelse(bh);
+		kfree(akpfs_fs_info);
+		return err;
+	}
+	if ((err = akpfs_load_free_bits(sb)) < 0)
+	{
+		akpfs_journal_unload(sb);
+		sb->s_fs_info = NULL;
+		brelse(bh);
+		kfree(akpfs_fs_info);
+		return err;
+	}
 	sb->s_magic = akpfs_sb->fs_type;
+	if (akpfs_sb->feature_flags & AKPFS_FEATURE_EXTENTS)
+	{
+		sb->s_maxbytes = 0x7FFFFFFF; // Limited by the inode's int file_size
+	}
+	else
+	{
+		sb->s_maxbytes = AKPFS_MAX_BLOCKS_PER_FILE * akpfs_sb->block_size;
+	}
 	sb->s_op = &akpfs_sops; // super block operations
 	sb->s_type = &akpfs; // file system type
 	printk(KERN_INFO "akp_fs: BS: %ld bytes = (1 << %d); Magic: 0x%lX; Root Inode: %d\n",
@@ -61,6 +147,8 @@ static int akpfs_fill_super(struct super_block *sb, void *data, int silent)
 	if (!root_inode)
 	{
 		printk(KERN_ERR "akp_fs: unable to get root inode\n");
+		akpfs_unload_free_bits(sb);
+		akpfs_journal_unload(sb);
 		sb->s_fs_info = NULL;
 		brelse(bh);
 		kfree(akpfs_fs_info);
@@ -72,6 +160,8 @@ static int akpfs_fill_super(struct super_block *sb, void *data, int silent)
 		{
 			printk(KERN_ERR "akp_fs: unable to read root inode\n");
 			iget_failed(root_inode);
+			akpfs_unload_free_bits(sb);
+			akpfs_journal_unload(sb);
 			sb->s_fs_info = NULL;
 			brelse(bh);
 			kfree(akpfs_fs_info);
@@ -82,6 +172,8 @@ static int akpfs_fill_super(struct super_block *sb, void *data, int silent)
 			printk(KERN_ERR "akp_fs: root is %s\n", akpfs_root_inode->file_name);
 			brelse(bh2);
 			iget_failed(root_inode);
+			akpfs_unload_free_bits(sb);
+			akpfs_journal_unload(sb);
 			sb->s_fs_info = NULL;
 			brelse(bh);
 			kfree(akpfs_fs_info);
@@ -108,11 +200,22 @@ static int akpfs_fill_super(struct super_block *sb, void *data, int silent)
 	{
 		printk(KERN_ERR "akp_fs: unable to attach root inode\n");
 		iget_failed(root_inode);
+		akpfs_unload_free_bits(sb);
+		akpfs_journal_unload(sb);
 		sb->s_fs_info = NULL;
 		brelse(bh);
 		kfree(akpfs_fs_info);
 		return -ENOMEM;
 	}
+	/* Orphans left by a crash, freed unless mounted read-only */
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(4,14,0))
+	if (!(sb->s_flags & MS_RDONLY))
+#else
+	if (!(sb->s_flags & SB_RDONLY))
+#endif
+	{
+		akpfs_orphan_cleanup(sb);
+	}
 
 	return 0;
 }
@@ -139,11 +242,18 @@ static struct dentry *akpfs_mount(struct file_system_type *fs_type, int flags, c
 
 static void akpfs_kill_sb(struct super_block *sb)
 {
-	struct akpfs_fs_info *akpfs_fs_info = (struct akpfs_fs_info *)(sb->s_fs_info);
+	struct akpfs_fs_info *akpfs_fs_info;
 
 	printk(KERN_INFO "akp_fs: akpfs_kill_sb\n");
 
-	if (akpfs_fs_info)
+	/*
+	 * Syncs (writing back the free bits through akpfs_sync_fs) & then calls
+	 * akpfs_put_super to release the akpfs_fs_info. So, it must precede the
+	 * following, which is only for whatever the put_super didn't release
+	 */
+	kill_block_super(sb);
+
+	if ((akpfs_fs_info = (struct akpfs_fs_info *)(sb->s_fs_info)))
 	{
 		if (akpfs_fs_info->bh)
 		{
@@ -151,7 +261,6 @@ static void akpfs_kill_sb(struct super_block *sb)
 		}
 		kfree(akpfs_fs_info);
 	}
-	kill_block_super(sb);
 }
 
 struct file_system_type akpfs =
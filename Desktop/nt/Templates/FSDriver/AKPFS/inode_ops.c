@@ -8,84 +8,423 @@
 
 #include "akpfs.h"
 
+static void akpfs_set_inode_ops(struct inode *inode)
+{
+	if (S_ISDIR(inode->i_mode))
+	{
+		inode->i_op = &akpfs_iops;
+	}
+	inode->i_mapping->a_ops = &akpfs_aops;
+	inode->i_fop = &akpfs_fops;
+}
+
+static int akpfs_find_slot(struct akpfs_inode *dir_inode, unsigned int ino)
+/* Returns the dir_entries slot having the ino (0 for a free one), or -1 if none */
+{
+	int i;
+
+	for (i = 0; i < AKPFS_MAX_ENTRIES_PER_DIR; i++)
+	{
+		if (dir_inode->u.dir_entries[i] == ino)
+		{
+			return i;
+		}
+	}
+	return -1;
+}
+
+static int akpfs_dir_is_empty(struct akpfs_inode *dir_inode)
+{
+	int i;
+
+	for (i = 0; i < AKPFS_MAX_ENTRIES_PER_DIR; i++)
+	{
+		if (dir_inode->u.dir_entries[i])
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+struct inode *akpfs_iget(struct super_block *sb, unsigned int ino)
+{
+	struct buffer_head *bh;
+	struct akpfs_inode *akpfs_inode;
+	struct inode *inode;
+
+	inode = iget_locked(sb, ino);
+	if (!inode)
+	{
+		return ERR_PTR(-EACCES);
+	}
+	if (!(inode->i_state & I_NEW))
+	{
+		printk(KERN_INFO "akp_fs: Got inode from inode cache\n");
+		return inode;
+	}
+	printk(KERN_INFO "akp_fs: Got new inode, let's fill in\n");
+	if (!(akpfs_inode = akpfs_get_inode(sb, ino, &bh)))
+	{
+		printk (KERN_ERR "akp_fs: unable to read inode\n");
+		iget_failed(inode);
+		return ERR_PTR(-EIO);
+	}
+	inode->i_size = akpfs_inode->file_size;
+	memcpy(AKPFS_I(inode)->u.file_blocks, akpfs_inode->u.file_blocks,
+			sizeof(AKPFS_I(inode)->u.file_blocks));
+	inode->i_mode = akpfs_get_inode_flags(akpfs_inode);
+	akpfs_set_inode_ops(inode);
+	brelse(bh);
+	unlock_new_inode(inode);
+	return inode;
+}
+
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(3,6,0))
 static struct dentry *akpfs_inode_lookup(struct inode *parent_inode, struct dentry *dentry, struct nameidata *nameidata)
 #else
 static struct dentry *akpfs_inode_lookup(struct inode *parent_inode, struct dentry *dentry, unsigned int flags)
 #endif
 {
-	struct super_block *sb = parent_inode->i_sb;
-	struct buffer_head *bh, *bh2;
-	struct akpfs_inode *akpfs_inode, *akpfs_inode2;
+	struct akpfs_dir_cache *dc;
 	int i;
 	struct inode *file_inode;
 
 	printk(KERN_INFO "akp_fs: akpfs_inode_lookup\n");
 
-	if (!(akpfs_inode = akpfs_get_inode(sb, parent_inode->i_ino, &bh)))
+	dc = akpfs_get_dir_cache(parent_inode);
+	if (IS_ERR(dc))
 	{
-		printk (KERN_ERR "akp_fs: unable to read parent inode\n");
-		return ERR_PTR(-EIO);
+		printk (KERN_ERR "akp_fs: unable to read parent dir\n");
+		return ERR_CAST(dc);
 	}
-	for (i = 0; i < AKPFS_MAX_ENTRIES_PER_DIR; i++)
+	if ((i = akpfs_dir_cache_lookup(dc, dentry->d_name.name)) == -1)
+	{
+		d_add(dentry, NULL); // Negative dentry, for the create to fill in
+		return NULL;
+	}
+
+	printk(KERN_INFO "akp_fs: Getting an inode\n");
+	file_inode = akpfs_iget(parent_inode->i_sb, dc->entries[i].ino);
+	if (IS_ERR(file_inode))
+	{
+		return ERR_CAST(file_inode);
+	}
+	d_add(dentry, file_inode);
+
+	return NULL;
+}
+
+static int akpfs_new_entry(struct inode *dir, struct dentry *dentry, int file_size)
+/*
+ * Creates an empty file (file_size 0) or directory (file_size akpfs_dir): The
+ * new inode & its dir_entries slot in the dir go in one transaction
+ */
+{
+	struct super_block *sb = dir->i_sb;
+	struct akpfs_trans trans;
+	struct akpfs_inode *dir_inode, *akpfs_inode;
+	struct inode *inode;
+	unsigned int ino;
+	int slot, err;
+
+	printk(KERN_INFO "akp_fs: akpfs_new_entry %s\n", dentry->d_name.name);
+
+	if (dentry->d_name.len > AKPFS_MAX_FILE_NAME_SIZE)
 	{
-		if (akpfs_inode->u.dir_entries[i])
+		return -ENAMETOOLONG;
+	}
+	akpfs_trans_init(&trans, sb);
+	if (!(dir_inode = akpfs_trans_get_inode(&trans, dir->i_ino)))
+	{
+		akpfs_trans_abort(&trans);
+		return -EIO;
+	}
+	if ((slot = akpfs_find_slot(dir_inode, 0)) == -1)
+	{
+		akpfs_trans_abort(&trans);
+		return -ENOSPC;
+	}
+	if (!(ino = akpfs_get_free_inode(sb)))
+	{
+		akpfs_trans_abort(&trans);
+		return -ENOSPC;
+	}
+	if (!(akpfs_inode = akpfs_trans_get_inode(&trans, ino)))
+	{
+		akpfs_put_free_inode(sb, ino);
+		akpfs_trans_abort(&trans);
+		return -EIO;
+	}
+	if (!(inode = new_inode(sb)))
+	{
+		akpfs_put_free_inode(sb, ino);
+		akpfs_trans_abort(&trans);
+		return -ENOMEM;
+	}
+	inode->i_ino = ino;
+	/* Waits for any earlier inode of the same #, still being evicted */
+	if ((err = insert_inode_locked(inode)) < 0)
+	{
+		iput(inode);
+		akpfs_put_free_inode(sb, ino);
+		akpfs_trans_abort(&trans);
+		return err;
+	}
+
+	memset(akpfs_inode, 0, sizeof(struct akpfs_inode));
+	strncpy(akpfs_inode->file_name, dentry->d_name.name, AKPFS_MAX_FILE_NAME_SIZE);
+	akpfs_inode->file_size = file_size;
+	dir_inode->u.dir_entries[slot] = ino;
+	inode->i_mode = akpfs_get_inode_flags(akpfs_inode);
+	akpfs_set_inode_ops(inode);
+	if ((err = akpfs_trans_commit(&trans, IS_DIRSYNC(dir))) < 0)
+	{
+		/* Undoes the dir slot, & frees the inode through its eviction, as by an unlink */
+		akpfs_trans_init(&trans, sb);
+		if ((dir_inode = akpfs_trans_get_inode(&trans, dir->i_ino)) &&
+			(dir_inode->u.dir_entries[slot] == ino))
 		{
-			if (!(akpfs_inode2 =
-						akpfs_get_inode(sb, akpfs_inode->u.dir_entries[i], &bh2)))
-			{
-				printk (KERN_ERR "akp_fs: unable to read inode\n");
-				brelse(bh);
-				return ERR_PTR(-EIO);
-			}
-			if (strncmp(dentry->d_name.name, akpfs_inode2->file_name,
-						AKPFS_MAX_FILE_NAME_SIZE))
+			dir_inode->u.dir_entries[slot] = 0;
+			akpfs_trans_commit(&trans, 0);
+		}
+		else
+		{
+			akpfs_trans_abort(&trans);
+		}
+		clear_nlink(inode);
+		unlock_new_inode(inode);
+		iput(inode);
+		return err;
+	}
+
+	akpfs_dir_cache_add(dir, slot, ino, inode->i_mode & S_IFMT, dentry->d_name.name);
+	unlock_new_inode(inode);
+	d_instantiate(dentry, inode);
+	return 0;
+}
+
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(3,3,0))
+static int akpfs_inode_create(struct inode *dir, struct dentry *dentry, int mode, struct nameidata *nd)
+#elif (LINUX_VERSION_CODE < KERNEL_VERSION(3,6,0))
+static int akpfs_inode_create(struct inode *dir, struct dentry *dentry, umode_t mode, struct nameidata *nd)
+#elif (LINUX_VERSION_CODE < KERNEL_VERSION(5,12,0))
+static int akpfs_inode_create(struct inode *dir, struct dentry *dentry, umode_t mode, bool excl)
+#else
+static int akpfs_inode_create(struct user_namespace *mnt_userns, struct inode *dir,
+	struct dentry *dentry, umode_t mode, bool excl)
+#endif
+/* Permissions are fixed by the file type, as not stored on disk */
+{
+	return akpfs_new_entry(dir, dentry, 0);
+}
+
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(3,3,0))
+static int akpfs_inode_mkdir(struct inode *dir, struct dentry *dentry, int mode)
+#elif (LINUX_VERSION_CODE < KERNEL_VERSION(5,12,0))
+static int akpfs_inode_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode)
+#else
+static int akpfs_inode_mkdir(struct user_namespace *mnt_userns, struct inode *dir,
+	struct dentry *dentry, umode_t mode)
+#endif
+{
+	return akpfs_new_entry(dir, dentry, akpfs_dir);
+}
+
+static int akpfs_remove_entry(struct inode *dir, struct dentry *dentry, int is_dir)
+/*
+ * Frees the inode's dir_entries slot in the dir. The inode itself, & its
+ * blocks, are freed on its eviction, once its last user is gone. Till then,
+ * it is on the orphan list, which goes in the same transaction, for a crash
+ * in between to not leak it
+ */
+{
+	struct inode *inode = dentry->d_inode;
+	struct akpfs_trans trans;
+	struct akpfs_inode *dir_inode, *akpfs_inode;
+	int slot, err;
+
+	printk(KERN_INFO "akp_fs: akpfs_remove_entry %s\n", dentry->d_name.name);
+
+	akpfs_trans_init(&trans, dir->i_sb);
+	if (!(dir_inode = akpfs_trans_get_inode(&trans, dir->i_ino)))
+	{
+		akpfs_trans_abort(&trans);
+		return -EIO;
+	}
+	if ((slot = akpfs_find_slot(dir_inode, inode->i_ino)) == -1)
+	{
+		akpfs_trans_abort(&trans);
+		return -ENOENT;
+	}
+	if (is_dir)
+	{
+		if (!(akpfs_inode = akpfs_trans_get_inode(&trans, inode->i_ino)))
+		{
+			akpfs_trans_abort(&trans);
+			return -EIO;
+		}
+		if (!akpfs_dir_is_empty(akpfs_inode))
+		{
+			akpfs_trans_abort(&trans);
+			return -ENOTEMPTY;
+		}
+	}
+	if ((err = akpfs_orphan_add(dir->i_sb, inode->i_ino)) < 0)
+	{
+		akpfs_trans_abort(&trans);
+		return err;
+	}
+
+	dir_inode->u.dir_entries[slot] = 0;
+	err = akpfs_trans_commit(&trans, IS_DIRSYNC(dir));
+
+	akpfs_dir_cache_remove(dir, slot);
+	if (is_dir)
+	{
+		clear_nlink(inode);
+	}
+	else
+	{
+		drop_nlink(inode);
+	}
+	return err;
+}
+
+static int akpfs_inode_unlink(struct inode *dir, struct dentry *dentry)
+{
+	return akpfs_remove_entry(dir, dentry, 0);
+}
+
+static int akpfs_inode_rmdir(struct inode *dir, struct dentry *dentry)
+{
+	return akpfs_remove_entry(dir, dentry, 1);
+}
+
+static int akpfs_rename_entry(struct inode *old_dir, struct dentry *old_dentry,
+	struct inode *new_dir, struct dentry *new_dentry)
+/*
+ * The name is in the inode itself. So, the rename updates it, along with
+ * moving its ino from its old dir's slot to the new dir's slot - the replaced
+ * inode's, if any, which goes on the orphan list, as by an unlink. All in one
+ * transaction
+ */
+{
+	struct inode *inode = old_dentry->d_inode, *new_inode = new_dentry->d_inode;
+	struct akpfs_trans trans;
+	struct akpfs_inode *old_dir_inode, *new_dir_inode, *akpfs_inode, *akpfs_new_inode;
+	int old_slot, new_slot, err;
+
+	printk(KERN_INFO "akp_fs: akpfs_inode_rename %s -> %s\n",
+		old_dentry->d_name.name, new_dentry->d_name.name);
+
+	if (new_dentry->d_name.len > AKPFS_MAX_FILE_NAME_SIZE)
+	{
+		return -ENAMETOOLONG;
+	}
+	akpfs_trans_init(&trans, old_dir->i_sb);
+	if (!(old_dir_inode = akpfs_trans_get_inode(&trans, old_dir->i_ino)) ||
+		!(new_dir_inode = akpfs_trans_get_inode(&trans, new_dir->i_ino)) ||
+		!(akpfs_inode = akpfs_trans_get_inode(&trans, inode->i_ino)))
+	{
+		akpfs_trans_abort(&trans);
+		return -EIO;
+	}
+	if ((old_slot = akpfs_find_slot(old_dir_inode, inode->i_ino)) == -1)
+	{
+		akpfs_trans_abort(&trans);
+		return -ENOENT;
+	}
+	if (new_inode)
+	{
+		if (S_ISDIR(new_inode->i_mode))
+		{
+			if (!(akpfs_new_inode = akpfs_trans_get_inode(&trans, new_inode->i_ino)))
 			{
-				brelse(bh2);
+				akpfs_trans_abort(&trans);
+				return -EIO;
 			}
-			else
+			if (!akpfs_dir_is_empty(akpfs_new_inode))
 			{
-				break;
+				akpfs_trans_abort(&trans);
+				return -ENOTEMPTY;
 			}
 		}
+		new_slot = akpfs_find_slot(new_dir_inode, new_inode->i_ino);
 	}
-	if (i == AKPFS_MAX_ENTRIES_PER_DIR)
+	else if (old_dir == new_dir)
 	{
-		brelse(bh);
-		return ERR_PTR(-ENOENT);
+		new_slot = old_slot;
 	}
-
-	printk(KERN_INFO "akp_fs: Getting an inode\n");
-	file_inode = iget_locked(sb, akpfs_inode->u.dir_entries[i]);
-	if (!file_inode)
+	else
 	{
-		brelse(bh2);
-		brelse(bh);
-		return ERR_PTR(-EACCES);
+		new_slot = akpfs_find_slot(new_dir_inode, 0);
 	}
-	if (file_inode->i_state & I_NEW)
+	if (new_slot == -1)
 	{
-		printk(KERN_INFO "akp_fs: Got new inode, let's fill in\n");
-		file_inode->i_size = akpfs_inode2->file_size;
-		file_inode->i_mode = akpfs_get_inode_flags(akpfs_inode2);
-		file_inode->i_mapping->a_ops = &akpfs_aops;
-		file_inode->i_fop = &akpfs_fops;
-		unlock_new_inode(file_inode);
+		akpfs_trans_abort(&trans);
+		return new_inode ? -ENOENT : -ENOSPC;
 	}
-	else
+	if (new_inode && ((err = akpfs_orphan_add(new_dir->i_sb, new_inode->i_ino)) < 0))
 	{
-		printk(KERN_INFO "akp_fs: Got inode from inode cache\n");
+		akpfs_trans_abort(&trans);
+		return err;
 	}
-	d_add(dentry, file_inode);
-	brelse(bh2);
-	brelse(bh);
 
-	return NULL;
+	old_dir_inode->u.dir_entries[old_slot] = 0;
+	new_dir_inode->u.dir_entries[new_slot] = inode->i_ino;
+	strncpy(akpfs_inode->file_name, new_dentry->d_name.name, AKPFS_MAX_FILE_NAME_SIZE);
+	err = akpfs_trans_commit(&trans, IS_DIRSYNC(old_dir) || IS_DIRSYNC(new_dir));
+
+	akpfs_dir_cache_remove(old_dir, old_slot);
+	if (new_inode)
+	{
+		akpfs_dir_cache_remove(new_dir, new_slot);
+		if (S_ISDIR(new_inode->i_mode))
+		{
+			clear_nlink(new_inode);
+		}
+		else
+		{
+			drop_nlink(new_inode);
+		}
+	}
+	akpfs_dir_cache_add(new_dir, new_slot, inode->i_ino, inode->i_mode & S_IFMT,
+		new_dentry->d_name.name);
+	return err;
 }
 
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(4,9,0))
+static int akpfs_inode_rename(struct inode *old_dir, struct dentry *old_dentry,
+	struct inode *new_dir, struct dentry *new_dentry)
+{
+	return akpfs_rename_entry(old_dir, old_dentry, new_dir, new_dentry);
+}
+#else
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(5,12,0))
+static int akpfs_inode_rename(struct inode *old_dir, struct dentry *old_dentry,
+	struct inode *new_dir, struct dentry *new_dentry, unsigned int flags)
+#else
+static int akpfs_inode_rename(struct user_namespace *mnt_userns, struct inode *old_dir,
+	struct dentry *old_dentry, struct inode *new_dir, struct dentry *new_dentry, unsigned int flags)
+#endif
+{
+	if (flags & ~RENAME_NOREPLACE) // No-replace is already checked by the VFS
+	{
+		return -EINVAL;
+	}
+	return akpfs_rename_entry(old_dir, old_dentry, new_dir, new_dentry);
+}
+#endif
+
 struct inode_operations akpfs_iops =
 {
-	lookup: akpfs_inode_lookup
+	create: akpfs_inode_create,
+	lookup: akpfs_inode_lookup,
+	unlink: akpfs_inode_unlink,
+	mkdir: akpfs_inode_mkdir,
+	rmdir: akpfs_inode_rmdir,
+	rename: akpfs_inode_rename
 };
 
 MODULE_LICENSE("GPL");
@@ -0,0 +1,595 @@
+/* AKP File System Module's Metadata Journal */
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/version.h>
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/blkdev.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/rwsem.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <linux/crc32.h>
+#include <linux/sched.h>
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,12,0))
+#include <linux/sched/mm.h>
+#endif
+#include <linux/errno.h>
+
+#include "akpfs.h"
+
+/*
+ * A write-ahead journal of the metadata blocks, having just the last committed
+ * transaction. The running transaction collects the buffers updated by the
+ * handles, without dirtying them. So, they reach their home blocks only through
+ * the commit, which:
+ * 1. Copies them into the journal buffers, with the handles held off
+ * 2. Writes the copies, the tags & the header together, & issues one flush -
+ *    the commit point, as the header's checksum covers the rest
+ * 3. Writes the copies (not the buffers, which may already be having the next
+ *    transaction's updates) to their home blocks
+ * The flush making 3 durable is issued just before the next commit's 2
+ * overwrites the journal. So, a mount has at most one transaction to replay,
+ * bounded by the journal size, & not the device size.
+ * Each handle reserves akpfs_journal_handle_blocks of the running transaction
+ * at its start, & uses them up as it adds the buffers, with the unused ones
+ * returned at its stop. So, running_cnt + reserved never exceeds the capacity,
+ * & a buffer is never left out of the journal for the lack of room. A handle
+ * going beyond its reservation is a bug, warned about. If that also leaves no
+ * room, the journal is aborted, leaving the last committed transaction as the
+ * on-disk state, with the fs remounted read-only
+ */
+#define AKPFS_COMMIT_DELAY (5 * HZ) /* Commit interval, for the running transaction */
+
+/* Marks a buffer already in the running transaction */
+enum { BH_Akpfs_Journaled = BH_PrivateStart };
+BUFFER_FNS(Akpfs_Journaled, akpfs_journaled)
+
+struct akpfs_journal
+{
+	struct super_block *sb;
+	unsigned int block_start; // Header block
+	unsigned int block_cnt;
+	unsigned int tags_per_block;
+	unsigned int capacity; // Most blocks in a transaction
+	unsigned int handle_blocks; // Reserved by each handle
+	unsigned int seq; // Next transaction #
+	struct rw_semaphore barrier; // Shared by the handles, & exclusive for the commit's copying
+	struct mutex commit_lock; // Serializes the commits
+	spinlock_t lock; // Protects running, running_cnt, reserved & aborted
+	struct buffer_head **running; // Buffers in the running transaction, each with a reference
+	unsigned int running_cnt;
+	unsigned int reserved; // Blocks reserved, & not yet used, by the handles in progress
+	int aborted; // No more commits, on a handle overflowing the journal
+	wait_queue_head_t wait; // For the room in the running transaction
+	struct buffer_head **committing; // The committing transaction's buffers
+	struct buffer_head **jbh; // All the journal buffers, held through the mount
+	struct buffer_head **tmp; // For writing the copies to their home blocks
+	int checkpoint_unflushed; // Home block writes of the last commit not yet flushed
+	struct delayed_work commit_work;
+};
+
+static inline struct akpfs_journal *akpfs_journal(struct super_block *sb)
+{
+	return ((struct akpfs_fs_info *)(sb->s_fs_info))->journal;
+}
+
+static int akpfs_journal_flush(struct super_block *sb)
+{
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,35))
+	return blkdev_issue_flush(sb->s_bdev, NULL);
+#elif (LINUX_VERSION_CODE < KERNEL_VERSION(5,8,0))
+	return blkdev_issue_flush(sb->s_bdev, GFP_KERNEL, NULL);
+#elif (LINUX_VERSION_CODE < KERNEL_VERSION(5,12,0))
+	return blkdev_issue_flush(sb->s_bdev, GFP_KERNEL);
+#else
+	return blkdev_issue_flush(sb->s_bdev);
+#endif
+}
+
+static int akpfs_journal_write_wait(struct buffer_head **bhs, int cnt)
+/* Issues the writes of all the (dirty) buffers together, & then waits on them */
+{
+	int i, retval = 0;
+
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(4,8,0))
+	ll_rw_block(WRITE, cnt, bhs);
+#else
+	ll_rw_block(REQ_OP_WRITE, 0, cnt, bhs);
+#endif
+	for (i = 0; i < cnt; i++)
+	{
+		wait_on_buffer(bhs[i]);
+		if (!buffer_uptodate(bhs[i]))
+		{
+			retval = -EIO;
+		}
+	}
+	return retval;
+}
+
+static u32 akpfs_journal_checksum(struct akpfs_journal_header *h, struct buffer_head **bhs, int cnt)
+{
+	u32 crc = ~0;
+	int i;
+
+	for (i = 0; i < cnt; i++)
+	{
+		crc = crc32_le(crc, bhs[i]->b_data, bhs[i]->b_size);
+	}
+	crc = crc32_le(crc, (unsigned char *)(&h->seq), sizeof(h->seq));
+	crc = crc32_le(crc, (unsigned char *)(&h->block_cnt), sizeof(h->block_cnt));
+	return crc;
+}
+
+static int akpfs_journal_clear(struct akpfs_journal *j)
+/* Zeroes the header on disk, leaving nothing to be replayed */
+{
+	struct buffer_head *bh = j->jbh[0];
+
+	lock_buffer(bh);
+	memset(bh->b_data, 0, bh->b_size);
+	unlock_buffer(bh);
+	mark_buffer_dirty(bh);
+	if (sync_dirty_buffer(bh) < 0)
+	{
+		return -EIO;
+	}
+	return akpfs_journal_flush(j->sb);
+}
+
+static int akpfs_journal_replay(struct akpfs_journal *j)
+/* Redoes the last committed transaction, if any & intact, from the journal buffers */
+{
+	struct super_block *sb = j->sb;
+	struct akpfs_sb *akpfs_sb = ((struct akpfs_fs_info *)(sb->s_fs_info))->akpfs_sb;
+	struct akpfs_journal_header *h = (struct akpfs_journal_header *)(j->jbh[0]->b_data);
+	struct buffer_head *bh;
+	unsigned int cnt, tag_cnt, i, home;
+	int retval = 0;
+
+	if (h->magic != AKPFS_JOURNAL_MAGIC)
+	{
+		return 0; // Nothing to replay
+	}
+	j->seq = h->seq + 1;
+	cnt = h->block_cnt;
+	tag_cnt = (cnt + j->tags_per_block - 1) / j->tags_per_block;
+	if (!cnt || (cnt > j->capacity) ||
+		(akpfs_journal_checksum(h, j->jbh + 1, tag_cnt + cnt) != h->checksum))
+	{
+		/* Crashed before the commit point. So, the home blocks are as they were */
+		printk (KERN_WARNING "akp_fs: discarding incomplete journal transaction %u\n", h->seq);
+		return akpfs_journal_clear(j);
+	}
+	printk(KERN_INFO "akp_fs: replaying journal transaction %u of %u blocks\n", h->seq, cnt);
+	for (i = 0; i < cnt; i++)
+	{
+		home = ((unsigned int *)(j->jbh[1 + i / j->tags_per_block]->b_data))[i % j->tags_per_block];
+		if ((home >= akpfs_sb->block_cnt) ||
+			((home >= j->block_start) && (home < j->block_start + j->block_cnt)))
+		{
+			printk (KERN_ERR "akp_fs: invalid block #%u in journal\n", home);
+			retval = -EINVAL;
+			break;
+		}
+		if (!(bh = j->tmp[i] = sb_getblk(sb, home)))
+		{
+			printk (KERN_ERR "akp_fs: unable to get block #%u for replay\n", home);
+			retval = -EIO;
+			break;
+		}
+		lock_buffer(bh);
+		memcpy(bh->b_data, j->jbh[1 + tag_cnt + i]->b_data, bh->b_size);
+		set_buffer_uptodate(bh);
+		unlock_buffer(bh);
+		mark_buffer_dirty(bh);
+	}
+	if (!retval && ((retval = akpfs_journal_write_wait(j->tmp, cnt)) < 0))
+	{
+		printk (KERN_ERR "akp_fs: unable to write the replayed blocks\n");
+	}
+	cnt = i;
+	for (i = 0; i < cnt; i++)
+	{
+		brelse(j->tmp[i]);
+	}
+	if (retval < 0)
+	{
+		return retval;
+	}
+	if ((retval = akpfs_journal_flush(sb)) < 0)
+	{
+		return retval;
+	}
+	return akpfs_journal_clear(j);
+}
+
+static int akpfs_journal_checkpoint(struct akpfs_journal *j, unsigned int cnt, unsigned int tag_cnt)
+/*
+ * Writes the committed copies in the journal buffers to their home blocks,
+ * through temporary buffer heads over the journal buffers' pages
+ */
+{
+	struct buffer_head *bh, *jbh;
+	unsigned int i;
+	int retval = 0;
+
+	for (i = 0; i < cnt; i++)
+	{
+		if (!(bh = j->tmp[i] = alloc_buffer_head(GFP_NOFS)))
+		{
+			retval = -ENOMEM;
+			break;
+		}
+		jbh = j->jbh[1 + tag_cnt + i];
+		set_bh_page(bh, jbh->b_page, bh_offset(jbh));
+		bh->b_size = jbh->b_size;
+		bh->b_bdev = j->sb->s_bdev;
+		bh->b_blocknr = j->committing[i]->b_blocknr;
+		set_buffer_mapped(bh);
+		set_buffer_uptodate(bh);
+		lock_buffer(bh);
+		get_bh(bh); // Dropped by end_buffer_write_sync
+		bh->b_end_io = end_buffer_write_sync;
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(4,8,0))
+		submit_bh(WRITE, bh);
+#else
+		submit_bh(REQ_OP_WRITE, 0, bh);
+#endif
+	}
+	cnt = i;
+	for (i = 0; i < cnt; i++)
+	{
+		wait_on_buffer(j->tmp[i]);
+		if (!buffer_uptodate(j->tmp[i]))
+		{
+			retval = -EIO;
+		}
+		free_buffer_head(j->tmp[i]);
+	}
+	j->checkpoint_unflushed = 1;
+	return retval;
+}
+
+int akpfs_journal_commit(struct super_block *sb)
+{
+	struct akpfs_journal *j = akpfs_journal(sb);
+	struct akpfs_journal_header *h;
+	struct buffer_head **bhs, *jbh;
+	unsigned int cnt, tag_cnt, i;
+	int retval;
+
+	if (!j)
+	{
+		return 0;
+	}
+
+	mutex_lock(&j->commit_lock);
+	spin_lock(&j->lock);
+	cnt = j->running_cnt;
+	retval = j->aborted ? -EROFS : 0;
+	spin_unlock(&j->lock);
+	if (!cnt || retval)
+	{
+		mutex_unlock(&j->commit_lock);
+		return retval;
+	}
+	/* The last commit's home blocks need to be durable, before its journal copy is overwritten */
+	if (j->checkpoint_unflushed)
+	{
+		if ((retval = akpfs_journal_flush(sb)) < 0)
+		{
+			mutex_unlock(&j->commit_lock);
+			return retval;
+		}
+		j->checkpoint_unflushed = 0;
+	}
+
+	/* 1: Freeze the running transaction into the journal buffers */
+	down_write(&j->barrier);
+	spin_lock(&j->lock);
+	bhs = j->running;
+	j->running = j->committing;
+	j->committing = bhs;
+	cnt = j->running_cnt;
+	j->running_cnt = 0;
+	spin_unlock(&j->lock);
+	tag_cnt = (cnt + j->tags_per_block - 1) / j->tags_per_block;
+	for (i = 0; i < cnt; i++)
+	{
+		jbh = j->jbh[1 + tag_cnt + i];
+		lock_buffer(jbh);
+		memcpy(jbh->b_data, bhs[i]->b_data, jbh->b_size);
+		unlock_buffer(jbh);
+		clear_buffer_akpfs_journaled(bhs[i]);
+	}
+	up_write(&j->barrier);
+	wake_up(&j->wait); // Room for the waiting handles
+
+	/* 2: Tags & header, & then their write with one flush - the commit point */
+	for (i = 0; i < tag_cnt; i++)
+	{
+		memset(j->jbh[1 + i]->b_data, 0, j->jbh[1 + i]->b_size);
+	}
+	for (i = 0; i < cnt; i++)
+	{
+		((unsigned int *)(j->jbh[1 + i / j->tags_per_block]->b_data))[i % j->tags_per_block] =
+			bhs[i]->b_blocknr;
+	}
+	h = (struct akpfs_journal_header *)(j->jbh[0]->b_data);
+	memset(h, 0, j->jbh[0]->b_size);
+	h->magic = AKPFS_JOURNAL_MAGIC;
+	h->seq = j->seq++;
+	h->block_cnt = cnt;
+	h->checksum = akpfs_journal_checksum(h, j->jbh + 1, tag_cnt + cnt);
+	for (i = 0; i < 1 + tag_cnt + cnt; i++)
+	{
+		mark_buffer_dirty(j->jbh[i]);
+	}
+	if (((retval = akpfs_journal_write_wait(j->jbh, 1 + tag_cnt + cnt)) < 0) ||
+		((retval = akpfs_journal_flush(sb)) < 0))
+	{
+		printk (KERN_ERR "akp_fs: unable to commit journal transaction %u\n", h->seq);
+	}
+	/*
+	 * 3: Checkpoint, even if the commit failed, as the buffers are not dirty &
+	 * so would otherwise never reach their home blocks
+	 */
+	if ((akpfs_journal_checkpoint(j, cnt, tag_cnt) < 0) && !retval)
+	{
+		printk (KERN_ERR "akp_fs: unable to checkpoint journal transaction %u\n", h->seq);
+		retval = -EIO;
+	}
+
+	for (i = 0; i < cnt; i++)
+	{
+		brelse(bhs[i]);
+	}
+	mutex_unlock(&j->commit_lock);
+	return retval;
+}
+
+static void akpfs_journal_commit_work(struct work_struct *work)
+{
+	struct akpfs_journal *j = container_of(to_delayed_work(work), struct akpfs_journal, commit_work);
+
+	akpfs_journal_commit(j->sb);
+}
+
+static int akpfs_journal_has_room(struct akpfs_journal *j)
+/* Room for one more handle, or no handle in progress (for a commit to make the room) */
+{
+	int retval;
+
+	spin_lock(&j->lock);
+	retval = !j->reserved ||
+		(j->running_cnt + j->reserved + j->handle_blocks <= j->capacity);
+	spin_unlock(&j->lock);
+	return retval;
+}
+
+void akpfs_journal_start(struct super_block *sb, struct akpfs_journal_handle *handle)
+/* Reserves the room for a handle in the running transaction, committing it if needed */
+{
+	struct akpfs_journal *j = akpfs_journal(sb);
+
+	if (!j)
+	{
+		return;
+	}
+	WARN_ON_ONCE(current->journal_info); // Nested handle
+	spin_lock(&j->lock);
+	while (j->running_cnt + j->reserved + j->handle_blocks > j->capacity)
+	{
+		spin_unlock(&j->lock);
+		wait_event(j->wait, akpfs_journal_has_room(j));
+		spin_lock(&j->lock);
+		if (!j->reserved && (j->running_cnt + j->handle_blocks > j->capacity))
+		{
+			spin_unlock(&j->lock);
+			akpfs_journal_commit(sb);
+			spin_lock(&j->lock);
+		}
+	}
+	j->reserved += j->handle_blocks;
+	spin_unlock(&j->lock);
+	down_read(&j->barrier);
+	handle->credits = j->handle_blocks;
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,12,0))
+	handle->nofs_flags = memalloc_nofs_save();
+#endif
+	current->journal_info = handle;
+}
+
+void akpfs_journal_stop(struct super_block *sb, struct akpfs_journal_handle *handle)
+{
+	struct akpfs_journal *j = akpfs_journal(sb);
+
+	if (!j)
+	{
+		return;
+	}
+	current->journal_info = NULL;
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,12,0))
+	memalloc_nofs_restore(handle->nofs_flags);
+#endif
+	up_read(&j->barrier);
+	spin_lock(&j->lock);
+	j->reserved -= handle->credits; // Unused
+	spin_unlock(&j->lock);
+	wake_up(&j->wait);
+}
+
+static void akpfs_journal_abort(struct akpfs_journal *j)
+/* Called with j->lock held */
+{
+	if (j->aborted)
+	{
+		return;
+	}
+	j->aborted = 1;
+	printk (KERN_CRIT "akp_fs: journal overflow. Aborting the journal, & remounting read-only\n");
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(4,14,0))
+	j->sb->s_flags |= MS_RDONLY;
+#else
+	j->sb->s_flags |= SB_RDONLY;
+#endif
+}
+
+void akpfs_journal_dirty(struct super_block *sb, struct buffer_head *bh)
+/* Adds the buffer to the running transaction, to be written back by the commit */
+{
+	struct akpfs_journal *j = akpfs_journal(sb);
+	struct akpfs_journal_handle *handle = current->journal_info;
+
+	if (!j)
+	{
+		mark_buffer_dirty(bh);
+		return;
+	}
+	spin_lock(&j->lock);
+	if (!buffer_akpfs_journaled(bh) && !j->aborted)
+	{
+		if (handle && handle->credits)
+		{
+			handle->credits--;
+			j->reserved--; // Now in running_cnt, instead
+		}
+		else if (WARN_ONCE(1, "akp_fs: block %llu journaled beyond the handle's reservation\n",
+				(unsigned long long)(bh->b_blocknr)) &&
+			(j->running_cnt + j->reserved >= j->capacity)) // No unreserved room, either
+		{
+			akpfs_journal_abort(j);
+			spin_unlock(&j->lock);
+			return;
+		}
+		set_buffer_akpfs_journaled(bh);
+		get_bh(bh);
+		j->running[j->running_cnt++] = bh;
+	}
+	spin_unlock(&j->lock);
+	schedule_delayed_work(&j->commit_work, AKPFS_COMMIT_DELAY);
+}
+
+static void akpfs_journal_free(struct akpfs_journal *j)
+{
+	unsigned int i;
+
+	for (i = 0; i < j->block_cnt; i++)
+	{
+		brelse(j->jbh[i]); // NULL safe
+	}
+	kfree(j->jbh);
+	kfree(j->tmp);
+	kfree(j->committing);
+	kfree(j->running);
+	kfree(j);
+}
+
+int akpfs_journal_load(struct super_block *sb)
+/*
+ * Reads in the journal blocks, & replays the last committed transaction. So,
+ * to be called before anything else reads the metadata blocks
+ */
+{
+	struct akpfs_fs_info *info = (struct akpfs_fs_info *)(sb->s_fs_info);
+	struct akpfs_sb *akpfs_sb = info->akpfs_sb;
+	struct akpfs_journal *j;
+	unsigned int i;
+	int err;
+
+	if (!(akpfs_sb->feature_flags & AKPFS_FEATURE_JOURNAL))
+	{
+		return 0;
+	}
+	if ((akpfs_sb->journal_block_start <= akpfs_sb->free_bits_block_start) ||
+		(akpfs_sb->journal_block_start + akpfs_sb->journal_block_cnt > akpfs_sb->block_cnt) ||
+		(akpfs_journal_capacity(akpfs_sb->journal_block_cnt, akpfs_sb->block_size) <
+			akpfs_journal_handle_blocks(akpfs_sb->free_bits_block_cnt)))
+	{
+		printk (KERN_ERR "akp_fs: invalid journal of %u blocks at %u\n",
+			akpfs_sb->journal_block_cnt, akpfs_sb->journal_block_start);
+		return -EINVAL;
+	}
+	if (!(j = (struct akpfs_journal *)(kzalloc(sizeof(struct akpfs_journal), GFP_KERNEL))))
+	{
+		printk (KERN_ERR "akp_fs: unable to allocate memory for journal\n");
+		return -ENOMEM;
+	}
+	j->sb = sb;
+	j->block_start = akpfs_sb->journal_block_start;
+	j->block_cnt = akpfs_sb->journal_block_cnt;
+	j->tags_per_block = akpfs_sb->block_size / sizeof(unsigned int);
+	j->capacity = akpfs_journal_capacity(j->block_cnt, akpfs_sb->block_size);
+	j->handle_blocks = akpfs_journal_handle_blocks(akpfs_sb->free_bits_block_cnt);
+	init_rwsem(&j->barrier);
+	mutex_init(&j->commit_lock);
+	spin_lock_init(&j->lock);
+	init_waitqueue_head(&j->wait);
+	INIT_DELAYED_WORK(&j->commit_work, akpfs_journal_commit_work);
+	if (!(j->running = kcalloc(j->capacity, sizeof(struct buffer_head *), GFP_KERNEL)) ||
+		!(j->committing = kcalloc(j->capacity, sizeof(struct buffer_head *), GFP_KERNEL)) ||
+		!(j->tmp = kcalloc(j->capacity, sizeof(struct buffer_head *), GFP_KERNEL)) ||
+		!(j->jbh = kcalloc(j->block_cnt, sizeof(struct buffer_head *), GFP_KERNEL)))
+	{
+		printk (KERN_ERR "akp_fs: unable to allocate memory for journal\n");
+		akpfs_journal_free(j);
+		return -ENOMEM;
+	}
+	for (i = 0; i < j->block_cnt; i++)
+	{
+		if (!(j->jbh[i] = sb_bread(sb, j->block_start + i)))
+		{
+			printk (KERN_ERR "akp_fs: unable to read journal\n");
+			akpfs_journal_free(j);
+			return -EIO;
+		}
+	}
+	if ((err = akpfs_journal_replay(j)) < 0)
+	{
+		printk (KERN_ERR "akp_fs: unable to replay journal\n");
+		akpfs_journal_free(j);
+		return err;
+	}
+	info->journal = j;
+	return 0;
+}
+
+void akpfs_journal_unload(struct super_block *sb)
+/* Commits the running transaction, & leaves an empty journal */
+{
+	struct akpfs_fs_info *info = (struct akpfs_fs_info *)(sb->s_fs_info);
+	struct akpfs_journal *j = info->journal;
+	unsigned int i;
+
+	if (!j)
+	{
+		return;
+	}
+	cancel_delayed_work_sync(&j->commit_work);
+	if (j->aborted)
+	{
+		/* Dropping the uncommitted updates, for the last commit to be replayed on the next mount */
+		for (i = 0; i < j->running_cnt; i++)
+		{
+			clear_buffer_akpfs_journaled(j->running[i]);
+			brelse(j->running[i]);
+		}
+	}
+	else if (akpfs_journal_commit(sb) < 0)
+	{
+		printk (KERN_ERR "akp_fs: unable to commit journal on unmount\n");
+	}
+	/* Clearing the header only after all the home blocks are durable */
+	else if (!j->checkpoint_unflushed || (akpfs_journal_flush(sb) == 0))
+	{
+		akpfs_journal_clear(j);
+	}
+	info->journal = NULL;
+	akpfs_journal_free(j);
+}
+
+MODULE_LICENSE("GPL");
@@ -5,6 +5,10 @@
 #include <linux/fs.h>
 #include <linux/buffer_head.h>
 #include <linux/writeback.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/rcupdate.h>
+#include <linux/seq_file.h>
 #include <linux/errno.h>
 
 #include "akpfs.h"
@@ -18,54 +22,244 @@ static int akpfs_super_write_inode(struct inode *inode, struct writeback_control
 	int do_sync = (wbc->sync_mode == WB_SYNC_ALL);
 #endif
 	struct super_block *sb = inode->i_sb;
+	struct akpfs_fs_info *info = (struct akpfs_fs_info *)(sb->s_fs_info);
 	struct buffer_head *bh;
 	struct akpfs_inode *akpfs_inode;
-	struct akpfs_sb *akpfs_sb = ((struct akpfs_fs_info *)(sb->s_fs_info))->akpfs_sb;
-	int i;
+	struct akpfs_inode_info *ai = AKPFS_I(inode);
+	struct akpfs_sb *akpfs_sb = info->akpfs_sb;
+	struct akpfs_journal_handle handle;
+	int retval = 0;
 
 	printk(KERN_INFO "akp_fs: akpfs_super_write_inode (i_ino = %ld) = %lld bytes\n",
 		inode->i_ino, i_size_read(inode));
 
+	/* The inode & the free bits of its blocks go in one journal transaction */
+	akpfs_journal_start(sb, &handle);
 	if (!(akpfs_inode = akpfs_get_inode(sb, inode->i_ino, &bh)))
 	{
 		printk (KERN_ERR "akp_fs: unable to read inode\n");
+		akpfs_journal_stop(sb, &handle);
 		return -EIO;
 	}
 	if ((inode->i_mode & S_IFREG) && (akpfs_inode->file_size >= 0))
    	{
 		akpfs_inode->file_size = i_size_read(inode);
-		for (i = (akpfs_inode->file_size + akpfs_sb->block_size - 1) /
-					akpfs_sb->block_size; i < AKPFS_MAX_BLOCKS_PER_FILE; i++)
+		mutex_lock(&ai->map_lock);
+		akpfs_truncate_blocks(inode, (akpfs_inode->file_size + akpfs_sb->block_size - 1) /
+				akpfs_sb->block_size); // Even if it fails, the rest are still fine
+		/* Blocks alloted by akpfs_get_block are only in the in-core copy, till now */
+		memcpy(akpfs_inode->u.file_blocks, ai->u.file_blocks, sizeof(ai->u.file_blocks));
+		mutex_unlock(&ai->map_lock);
+		akpfs_journal_dirty(sb, bh);
+	}
+	/* Write back the free bits of the blocks alloted/freed since last time */
+	if (akpfs_sync_free_bits(sb) < 0)
+	{
+		retval = -EIO;
+	}
+	akpfs_journal_stop(sb, &handle);
+
+	if (do_sync && !retval)
+	{
+		if (info->journal)
 		{
-			if (akpfs_inode->u.file_blocks[i])
-			{
-				akpfs_put_free_block(sb, akpfs_inode->u.file_blocks[i]);
-				// Even if the put fails, let's mark it free
-				akpfs_inode->u.file_blocks[i] = 0;
-			}
+			retval = akpfs_journal_commit(sb);
 		}
-		mark_buffer_dirty(bh);
-		if (do_sync)
+		else if (buffer_dirty(bh))
 		{
 			sync_dirty_buffer(bh);
 			if (buffer_req(bh) && !buffer_uptodate(bh))
 			{
 				printk ("akpfs: IO error syncing inode [%s:%08lx]\n",
 						sb->s_id, inode->i_ino);
-				brelse(bh);
-				return -EIO;
+				retval = -EIO;
 			}
 		}
+	}
+	brelse(bh);
+
+	return retval;
+}
 
+static struct inode *akpfs_alloc_inode(struct super_block *sb)
+{
+	struct akpfs_inode_info *ai;
+
+	if (!(ai = (struct akpfs_inode_info *)(kmem_cache_alloc(akpfs_inode_cachep, GFP_KERNEL))))
+	{
+		return NULL;
 	}
+	memset(ai->u.file_blocks, 0, sizeof(ai->u.file_blocks));
+	ai->dir_cache = NULL;
+	return &ai->vfs_inode;
+}
+
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,38))
+static void akpfs_destroy_inode(struct inode *inode)
+{
+	kmem_cache_free(akpfs_inode_cachep, AKPFS_I(inode));
+}
+#elif (LINUX_VERSION_CODE < KERNEL_VERSION(5,2,0))
+static void akpfs_i_callback(struct rcu_head *head)
+{
+	struct inode *inode = container_of(head, struct inode, i_rcu);
+
+	kmem_cache_free(akpfs_inode_cachep, AKPFS_I(inode));
+}
+static void akpfs_destroy_inode(struct inode *inode)
+{
+	/* Freed after the RCU grace period, as the RCU path walk may still access it */
+	call_rcu(&inode->i_rcu, akpfs_i_callback);
+}
+#else
+static void akpfs_free_inode(struct inode *inode)
+{
+	kmem_cache_free(akpfs_inode_cachep, AKPFS_I(inode));
+}
+#endif
+
+static void akpfs_remove_inode(struct inode *inode)
+/*
+ * Frees the blocks & the inode of an unlinked inode, on its last reference
+ * going away. Clears it on disk first, & then frees its inode #, so that it is
+ * not reused with a stale copy. It leaves the orphan list in the same
+ * transaction as the clearing
+ */
+{
+	struct super_block *sb = inode->i_sb;
+	struct akpfs_inode_info *ai = AKPFS_I(inode);
+	struct buffer_head *bh;
+	struct akpfs_inode *akpfs_inode;
+	struct akpfs_journal_handle handle;
+
+	printk(KERN_INFO "akp_fs: akpfs_remove_inode (i_ino = %ld)\n", inode->i_ino);
+
+	akpfs_journal_start(sb, &handle);
+	if (S_ISREG(inode->i_mode))
+	{
+		mutex_lock(&ai->map_lock);
+		akpfs_truncate_blocks(inode, 0); // Even if it fails, the inode is still freed
+		mutex_unlock(&ai->map_lock);
+	}
+	if (!(akpfs_inode = akpfs_get_inode(sb, inode->i_ino, &bh)))
+	{
+		printk (KERN_ERR "akp_fs: unable to read inode\n");
+		akpfs_sync_free_bits(sb);
+		akpfs_journal_stop(sb, &handle);
+		return; // Not freeing the inode #, as it is still in use on disk
+	}
+	memset(akpfs_inode, 0, sizeof(struct akpfs_inode));
+	akpfs_journal_dirty(sb, bh);
 	brelse(bh);
+	akpfs_orphan_del(sb, inode->i_ino);
+	/* Freed blocks go in the same transaction as the cleared inode */
+	akpfs_sync_free_bits(sb);
+	akpfs_journal_stop(sb, &handle);
+	akpfs_put_free_inode(sb, inode->i_ino);
+}
 
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,36))
+static void akpfs_delete_inode(struct inode *inode)
+{
+	truncate_inode_pages(&inode->i_data, 0);
+	if (!is_bad_inode(inode))
+	{
+		akpfs_remove_inode(inode);
+	}
+	clear_inode(inode);
+}
+
+static void akpfs_clear_inode(struct inode *inode)
+{
+	akpfs_invalidate_dir_cache(inode);
+}
+#else
+static void akpfs_evict_inode(struct inode *inode)
+{
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(3,15,0))
+	truncate_inode_pages(&inode->i_data, 0);
+#else
+	truncate_inode_pages_final(&inode->i_data);
+#endif
+	if (!inode->i_nlink && !is_bad_inode(inode))
+	{
+		akpfs_remove_inode(inode);
+	}
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(3,5,0))
+	end_writeback(inode);
+#else
+	clear_inode(inode);
+#endif
+	akpfs_invalidate_dir_cache(inode);
+}
+#endif
+
+static int akpfs_sync_fs(struct super_block *sb, int wait)
+{
+	struct akpfs_journal_handle handle;
+	int retval;
+
+	printk(KERN_INFO "akp_fs: akpfs_sync_fs\n");
+
+	akpfs_journal_start(sb, &handle);
+	retval = akpfs_sync_free_bits(sb);
+	akpfs_journal_stop(sb, &handle);
+	if (wait && (akpfs_journal_commit(sb) < 0))
+	{
+		retval = -EIO;
+	}
+	return retval;
+}
+
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(3,3,0))
+static int akpfs_show_options(struct seq_file *m, struct vfsmount *mnt)
+{
+	struct akpfs_fs_info *akpfs_fs_info = (struct akpfs_fs_info *)(mnt->mnt_sb->s_fs_info);
+#else
+static int akpfs_show_options(struct seq_file *m, struct dentry *root)
+{
+	struct akpfs_fs_info *akpfs_fs_info = (struct akpfs_fs_info *)(root->d_sb->s_fs_info);
+#endif
+
+	if (!akpfs_fs_info->readahead)
+	{
+		seq_puts(m, ",noreadahead");
+	}
 	return 0;
 }
 
+static void akpfs_put_super(struct super_block *sb)
+{
+	struct akpfs_fs_info *akpfs_fs_info = (struct akpfs_fs_info *)(sb->s_fs_info);
+
+	printk(KERN_INFO "akp_fs: akpfs_put_super\n");
+
+	/* Free bits are already written back by akpfs_sync_fs, & then committed by the following */
+	akpfs_journal_unload(sb);
+	akpfs_unload_free_bits(sb);
+	brelse(akpfs_fs_info->bh);
+	kfree(akpfs_fs_info);
+	sb->s_fs_info = NULL;
+}
+
 struct super_operations akpfs_sops =
 {
+	alloc_inode: akpfs_alloc_inode,
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(5,2,0))
+	destroy_inode: akpfs_destroy_inode,
+#else
+	free_inode: akpfs_free_inode,
+#endif
+	put_super: akpfs_put_super,
+	sync_fs: akpfs_sync_fs,
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,36))
+	delete_inode: akpfs_delete_inode,
+	clear_inode: akpfs_clear_inode,
+#else
+	evict_inode: akpfs_evict_inode,
+#endif
 	statfs: simple_statfs, /* handler from libfs */
+	show_options: akpfs_show_options,
 	write_inode: akpfs_super_write_inode
 };
 
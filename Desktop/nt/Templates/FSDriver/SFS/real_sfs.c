@@ -6,7 +6,9 @@
 #include <linux/errno.h> /* For error codes */
 #include <linux/slab.h> /* For kzalloc, ... */
 #include <linux/buffer_head.h> /* map_bh, block_write_begin, block_write_full_page, generic_write_end, ... */
-#include <linux/mpage.h> /* mpage_readpage, ... */
+#include <linux/statfs.h> /* For struct kstatfs */
+#include <linux/seq_file.h> /* For seq_printf */
+#include <linux/mpage.h> /* mpage_readpage, mpage_readpages, mpage_writepages, ... */
 
 #include "real_sfs_ds.h" /* For SFS related defines, data structures, ... */
 #include "real_sfs_ops.h" /* For SFS related operations */
@@ -22,6 +24,15 @@ static struct address_space_operations sfs_aops;
 
 static struct inode *sfs_root_inode;
 
+/*
+ * Extent allocation mode: Reserve a contiguous run of blocks for a file, when
+ * it is first extended, & grow it contiguously from there on, so that its
+ * blocks can be read back with merged bios
+ */
+static int extent_alloc = 1;
+module_param(extent_alloc, int, 0644);
+MODULE_PARM_DESC(extent_alloc, "Allocate file blocks contiguously (1) or one by one (0)");
+
 /*
  * File Operations
  */
@@ -106,41 +117,38 @@ static int sfs_get_block(struct inode *inode, sector_t iblock, struct buffer_hea
 {
 	struct super_block *sb = inode->i_sb;
 	sfs_info_t *info = (sfs_info_t *)(sb->s_fs_info);
-	sfs_file_entry_t fe;
-	sector_t phys;
-	int retval;
+	int phys, next, new;
+	unsigned int max_blocks, cnt;
 
-	printk(KERN_INFO "sfs: sfs_get_block called for I: %ld, B: %llu, C: %d\n",
-		inode->i_ino, (unsigned long long)(iblock), create);
+	printk(KERN_INFO "sfs: sfs_get_block called for I: %ld, B: %llu, S: %zu, C: %d\n",
+		inode->i_ino, (unsigned long long)(iblock), bh_result->b_size, create);
 
-	if (iblock >= SIMULA_FS_DATA_BLOCK_CNT)
+	if ((phys = sfs_map_block(info, inode->i_ino, iblock, create, &new)) < 0)
 	{
-		return -ENOSPC;
+		return phys;
 	}
-	if ((retval = sfs_get_file_entry(info, inode->i_ino, &fe)) < 0)
+	if (!phys)
 	{
-		return retval;
+		return -EIO;
 	}
-	if (!fe.blocks[iblock])
+	map_bh(bh_result, sb, phys);
+	if (new)
 	{
-		if (!create)
-		{
-			return -EIO;
-		}
-		else
-		{
-			if ((fe.blocks[iblock] = sfs_get_data_block(info)) == INV_BLOCK)
-			{
-				return -ENOSPC;
-			}
-			if ((retval = sfs_update_file_entry(info, inode->i_ino, &fe)) < 0)
-			{
-				return retval;
-			}
-		}
+		set_buffer_new(bh_result);
 	}
-	phys = fe.blocks[iblock];
-	map_bh(bh_result, sb, phys);
+
+	/*
+	 * Map as many of the requested blocks as are physically contiguous, so
+	 * that mpage can issue them as a single bio
+	 */
+	max_blocks = bh_result->b_size >> sb->s_blocksize_bits;
+	for (cnt = 1; cnt < max_blocks; cnt++)
+	{
+		next = sfs_map_block(info, inode->i_ino, iblock + cnt, 0, NULL);
+		if (next != phys + cnt)
+			break;
+	}
+	bh_result->b_size = cnt << sb->s_blocksize_bits;
 
 	return 0;
 }
@@ -149,6 +157,20 @@ static int sfs_readpage(struct file *file, struct page *page)
 	printk(KERN_INFO "sfs: sfs_readpage\n");
 	return mpage_readpage(page, sfs_get_block);
 }
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(5,8,0))
+static int sfs_readpages(struct file *file, struct address_space *mapping,
+	struct list_head *pages, unsigned nr_pages)
+{
+	printk(KERN_INFO "sfs: sfs_readpages (%u pages)\n", nr_pages);
+	return mpage_readpages(mapping, pages, nr_pages, sfs_get_block);
+}
+#else
+static void sfs_readahead(struct readahead_control *rac)
+{
+	printk(KERN_INFO "sfs: sfs_readahead (%u pages)\n", readahead_count(rac));
+	mpage_readahead(rac, sfs_get_block);
+}
+#endif
 static int sfs_write_begin(struct file *file, struct address_space *mapping,
 	loff_t pos, unsigned len, unsigned flags, struct page **pagep, void **fsdata)
 {
@@ -166,11 +188,22 @@ static int sfs_writepage(struct page *page, struct writeback_control *wbc)
 	printk(KERN_INFO "sfs: sfs_writepage\n");
 	return block_write_full_page(page, sfs_get_block, wbc);
 }
+static int sfs_writepages(struct address_space *mapping, struct writeback_control *wbc)
+{
+	printk(KERN_INFO "sfs: sfs_writepages\n");
+	return mpage_writepages(mapping, wbc, sfs_get_block);
+}
 static struct address_space_operations sfs_aops =
 {
 	.readpage = sfs_readpage,
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(5,8,0))
+	.readpages = sfs_readpages,
+#else
+	.readahead = sfs_readahead,
+#endif
 	.write_begin = sfs_write_begin,
 	.writepage = sfs_writepage,
+	.writepages = sfs_writepages,
 	.write_end = generic_write_end
 };
 
@@ -346,11 +379,53 @@ static int sfs_write_inode(struct inode *inode, struct writeback_control *wbc)
 
 	return sfs_update(info, inode->i_ino, &size, &timestamp, &perms);
 }
+static int sfs_sync_fs(struct super_block *sb, int wait)
+{
+	sfs_info_t *info = (sfs_info_t *)(sb->s_fs_info);
+
+	printk(KERN_INFO "sfs: sfs_sync_fs\n");
+	return sfs_flush_entries(info);
+}
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(3,3,0))
+static int sfs_show_stats(struct seq_file *m, struct vfsmount *mnt)
+#else
+static int sfs_show_stats(struct seq_file *m, struct dentry *root)
+#endif
+/* Shows up in /proc/<pid>/mountstats */
+{
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(3,3,0))
+	sfs_info_t *info = (sfs_info_t *)(mnt->mnt_sb->s_fs_info);
+#else
+	sfs_info_t *info = (sfs_info_t *)(root->d_sb->s_fs_info);
+#endif
+
+	seq_printf(m, " entry_updates=%lu entry_block_writes=%lu entry_block_writes_saved=%lu",
+		atomic_long_read(&info->entry_updates), atomic_long_read(&info->entry_block_writes),
+		atomic_long_read(&info->entry_updates) - atomic_long_read(&info->entry_block_writes));
+	return 0;
+}
+static int sfs_statfs(struct dentry *dentry, struct kstatfs *buf)
+/* All from the counters kept up to date by the allocators, for df to be cheap */
+{
+	sfs_info_t *info = (sfs_info_t *)(dentry->d_sb->s_fs_info);
+
+	buf->f_type = info->sb.type;
+	buf->f_bsize = info->sb.block_size;
+	buf->f_blocks = info->sb.partition_size;
+	buf->f_bfree = sfs_free_block_cnt(info);
+	buf->f_bavail = buf->f_bfree;
+	buf->f_files = info->sb.entry_count;
+	buf->f_ffree = info->free_entry_cnt;
+	buf->f_namelen = SIMULA_FS_FILENAME_LEN;
+	return 0;
+}
 
 static struct super_operations sfs_sops =
 {
 	put_super: sfs_put_super,
-	//statfs: sfs_statfs, /* implement for df to show it up */
+	sync_fs: sfs_sync_fs,
+	statfs: sfs_statfs, /* for df to show it up */
+	show_stats: sfs_show_stats,
 	write_inode: sfs_write_inode
 };
 
@@ -375,6 +450,7 @@ static int sfs_fill_super(struct super_block *sb, void *data, int silent)
 	if (!(info = (sfs_info_t *)(kzalloc(sizeof(sfs_info_t), GFP_KERNEL))))
 		return -ENOMEM;
 	info->vfs_sb = sb;
+	info->extent_alloc = extent_alloc;
 	if (init_browsing(info) < 0)
 	{
 		kfree(info);
@@ -384,6 +460,7 @@ static int sfs_fill_super(struct super_block *sb, void *data, int silent)
 	sb->s_magic = info->sb.type;
 	sb->s_blocksize = info->sb.block_size;
 	sb->s_blocksize_bits = get_bit_pos(info->sb.block_size);
+	sb->s_maxbytes = sfs_max_file_size(info);
 	sb->s_type = &sfs; // file_system_type
 	sb->s_op = &sfs_sops; // super block operations
 
@@ -4,11 +4,22 @@
 #include <linux/buffer_head.h> /* struct buffer_head, sb_bread, ... */
 #include <linux/string.h> /* For memcpy */
 #include <linux/vmalloc.h> /* For vmalloc, ... */
+#include <linux/slab.h> /* For kmalloc, ... */
 #include <linux/time.h> /* For get_seconds, ... */
+#include <linux/log2.h> /* For roundup_pow_of_two, is_power_of_2 */
+#include <linux/bitmap.h> /* For bitmap_zero, bitmap_set, bitmap_weight, ... */
+#include <linux/bitops.h> /* For find_next_zero_bit, __set_bit, for_each_set_bit, ... */
+#include <linux/mutex.h> /* For mutex_init, mutex_lock, ... */
+#include <linux/workqueue.h> /* For INIT_DELAYED_WORK, schedule_delayed_work, ... */
+#include <linux/percpu.h> /* For alloc_percpu, per_cpu_ptr, ... */
+#include <linux/smp.h> /* For get_cpu, put_cpu */
 
 #include "real_sfs_ds.h"
 #include "real_sfs_ops.h"
 
+#define SFS_FLUSH_DELAY (5 * HZ) /* Max delay for writing back an updated entry */
+#define SFS_POOL_BLOCKS 64 /* Max blocks reserved at a time, for a CPU's pool */
+
 static int read_sb_from_real_sfs(sfs_info_t *info, sfs_super_block_t *sb)
 {
 	struct buffer_head *bh;
@@ -23,16 +34,14 @@ static int read_sb_from_real_sfs(sfs_info_t *info, sfs_super_block_t *sb)
 }
 static int read_from_real_sfs(sfs_info_t *info, byte4_t block, byte4_t offset, void *buf, byte4_t len)
 {
-	byte4_t block_size = info->sb.block_size;
-	byte4_t bd_block_size = info->vfs_sb->s_bdev->bd_block_size;
-	byte4_t abs;
 	struct buffer_head *bh;
 
-	// Translating the real SFS block numbering to underlying block device block numbering, for sb_bread()
-	abs = block * block_size + offset;
-	block = abs / bd_block_size;
-	offset = abs % bd_block_size;
-	if (offset + len > bd_block_size) // Should never happen
+	/*
+	 * The underlying block device's block size is already set to the SFS
+	 * block size (by init_browsing), so no translation is needed, & so no
+	 * 32-bit byte offset to wrap on partitions over 4 GiB
+	 */
+	if (offset + len > info->sb.block_size) // Should never happen
 	{
 		return -EINVAL;
 	}
@@ -46,16 +55,10 @@ static int read_from_real_sfs(sfs_info_t *info, byte4_t block, byte4_t offset, v
 }
 static int write_to_real_sfs(sfs_info_t *info, byte4_t block, byte4_t offset, void *buf, byte4_t len)
 {
-	byte4_t block_size = info->sb.block_size;
-	byte4_t bd_block_size = info->vfs_sb->s_bdev->bd_block_size;
-	byte4_t abs;
 	struct buffer_head *bh;
 
-	// Translating the real SFS block numbering to underlying block device block numbering, for sb_bread()
-	abs = block * block_size + offset;
-	block = abs / bd_block_size;
-	offset = abs % bd_block_size;
-	if (offset + len > bd_block_size) // Should never happen
+	/* As in read_from_real_sfs, the device block is the SFS block */
+	if (offset + len > info->sb.block_size) // Should never happen
 	{
 		return -EINVAL;
 	}
@@ -68,24 +71,368 @@ static int write_to_real_sfs(sfs_info_t *info, byte4_t block, byte4_t offset, vo
 	brelse(bh);
 	return 0;
 }
+static int read_entry_table_from_real_sfs(sfs_info_t *info, sfs_file_entry_t *entries)
+{
+	byte4_t i;
+	int retval;
+
+	for (i = 0; i < info->sb.entry_table_size; i++)
+	{
+		if ((retval = read_from_real_sfs(info, info->sb.entry_table_block_start + i, 0,
+				(byte1_t *)(entries) + i * info->sb.block_size, info->sb.block_size)) < 0)
+		{
+			return retval;
+		}
+	}
+	return 0;
+}
+/*
+ * Entries are served from the in-memory entry table (loaded in init_browsing).
+ * Updates only mark their entry table block dirty, & all the dirty blocks get
+ * written back together by sfs_flush_entries - on sync_fs or at the latest
+ * SFS_FLUSH_DELAY after the update - so that a burst of updates to the entries
+ * of a block costs a single block write.
+ * Every read-modify-write of an entry (& of its indirect blocks) happens under
+ * the lock of its entry table block, so that the writers of different blocks
+ * don't contend. read_entry_from_real_sfs & write_entry_to_real_sfs expect it
+ * to be held by the caller
+ */
+static inline byte4_t entry_block(sfs_info_t *info, int ino)
+{
+	return ino * sizeof(sfs_file_entry_t) / info->sb.block_size;
+}
+static inline void lock_entry(sfs_info_t *info, int ino)
+{
+	mutex_lock(&info->entry_block_lock[entry_block(info, ino)]);
+}
+static inline void unlock_entry(sfs_info_t *info, int ino)
+{
+	mutex_unlock(&info->entry_block_lock[entry_block(info, ino)]);
+}
 static int read_entry_from_real_sfs(sfs_info_t *info, int ino, sfs_file_entry_t *fe)
 {
-	return read_from_real_sfs(info, info->sb.entry_table_block_start,
-				ino * sizeof(sfs_file_entry_t), fe, sizeof(sfs_file_entry_t));
+	memcpy(fe, &info->entries[ino], sizeof(sfs_file_entry_t));
+	return 0;
 }
 static int write_entry_to_real_sfs(sfs_info_t *info, int ino, sfs_file_entry_t *fe)
 {
-	return write_to_real_sfs(info, info->sb.entry_table_block_start,
-				ino * sizeof(sfs_file_entry_t), fe, sizeof(sfs_file_entry_t));
+	memcpy(&info->entries[ino], fe, sizeof(sfs_file_entry_t));
+	set_bit(entry_block(info, ino), info->dirty_entry_blocks);
+	atomic_long_inc(&info->entry_updates);
+	schedule_delayed_work(&info->flush_work, SFS_FLUSH_DELAY); // No-op, if already scheduled
+	return 0;
+}
+int sfs_flush_entries(sfs_info_t *info)
+{
+	byte4_t i;
+	int retval = 0;
+
+	for_each_set_bit(i, info->dirty_entry_blocks, info->sb.entry_table_size)
+	{
+		mutex_lock(&info->entry_block_lock[i]);
+		if (test_and_clear_bit(i, info->dirty_entry_blocks)) // May have been flushed meanwhile
+		{
+			if ((retval = write_to_real_sfs(info, info->sb.entry_table_block_start + i, 0,
+					(byte1_t *)(info->entries) + i * info->sb.block_size, info->sb.block_size)) < 0)
+			{
+				set_bit(i, info->dirty_entry_blocks);
+				mutex_unlock(&info->entry_block_lock[i]);
+				break;
+			}
+			atomic_long_inc(&info->entry_block_writes);
+		}
+		mutex_unlock(&info->entry_block_lock[i]);
+	}
+	return retval;
+}
+static void flush_entries_work(struct work_struct *work)
+{
+	sfs_info_t *info = container_of(to_delayed_work(work), sfs_info_t, flush_work);
+
+	if (sfs_flush_entries(info) < 0)
+	{
+		printk(KERN_ERR "Unable to write back the entry table\n");
+	}
+}
+
+/*
+ * Name index over the in-memory entry table: Used entries are chained by
+ * their name hash, & free entries are chained into the free list - both
+ * through next_entry, as an entry is always on exactly one of them. All of
+ * these expect ns_lock to be held by the caller. As names are set only before
+ * hashing & cleared only after unhashing, a hashed entry's name is stable
+ * under ns_lock, even without its entry block lock
+ */
+static unsigned int name_hash(sfs_info_t *info, char *fn)
+{
+	unsigned int hash = 0;
+
+	while (*fn)
+	{
+		hash = hash * 31 + *fn++;
+	}
+	return hash & info->name_hash_mask;
+}
+static void hash_entry(sfs_info_t *info, int ino)
+{
+	unsigned int hash = name_hash(info, info->entries[ino].name);
+
+	info->next_entry[ino] = info->name_hash[hash];
+	info->name_hash[hash] = ino;
+}
+static void unhash_entry(sfs_info_t *info, int ino)
+{
+	int *link = &info->name_hash[name_hash(info, info->entries[ino].name)];
+
+	while (*link != INV_INODE)
+	{
+		if (*link == ino)
+		{
+			*link = info->next_entry[ino];
+			return;
+		}
+		link = &info->next_entry[*link];
+	}
+}
+static int find_entry(sfs_info_t *info, char *fn)
+{
+	int ino;
+
+	for (ino = info->name_hash[name_hash(info, fn)]; ino != INV_INODE; ino = info->next_entry[ino])
+	{
+		if (strcmp(info->entries[ino].name, fn) == 0)
+		{
+			return ino;
+		}
+	}
+	return INV_INODE;
+}
+static int get_free_entry(sfs_info_t *info)
+{
+	int ino = info->free_entry;
+
+	if (ino != INV_INODE)
+	{
+		info->free_entry = info->next_entry[ino];
+		info->free_entry_cnt--;
+	}
+	return ino;
+}
+static void put_free_entry(sfs_info_t *info, int ino)
+{
+	info->next_entry[ino] = info->free_entry;
+	info->free_entry = ino;
+	info->free_entry_cnt++;
+}
+
+/*
+ * File block tree: Version SIMULA_FS_VERSION_DIRECT has all of blocks[] as
+ * direct data blocks. Version SIMULA_FS_VERSION_INDIRECT has all but the last
+ * 2 as direct, followed by a single indirect block (of data block #s) & a
+ * double indirect block (of single indirect block #s)
+ */
+static inline byte4_t direct_block_cnt(sfs_info_t *info)
+{
+	return (info->sb.version == SIMULA_FS_VERSION_DIRECT) ?
+		SIMULA_FS_DATA_BLOCK_CNT : SIMULA_FS_IND_BLOCK;
+}
+static inline byte4_t ptrs_per_block(sfs_info_t *info)
+{
+	return info->sb.block_size / sizeof(byte4_t);
+}
+static int clear_block_on_real_sfs(sfs_info_t *info, byte4_t block)
+/* Block size is same as that of the underlying block device - see init_browsing */
+{
+	struct buffer_head *bh;
+
+	if (!(bh = sb_getblk(info->vfs_sb, block)))
+	{
+		return -EIO;
+	}
+	lock_buffer(bh);
+	memset(bh->b_data, 0, bh->b_size);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	mark_buffer_dirty(bh);
+	brelse(bh);
+	return 0;
+}
+static int mark_ptr_block(sfs_info_t *info, byte4_t ptr_block, int depth)
+/* Marks the pointer block & all blocks under it, as used */
+{
+	byte4_t *ptrs;
+	byte4_t i;
+	int retval;
+
+	__set_bit(ptr_block, info->used_blocks);
+	if (!(ptrs = kmalloc(info->sb.block_size, GFP_KERNEL)))
+	{
+		return -ENOMEM;
+	}
+	if ((retval = read_from_real_sfs(info, ptr_block, 0, ptrs, info->sb.block_size)) < 0)
+	{
+		kfree(ptrs);
+		return retval;
+	}
+	for (i = 0; i < ptrs_per_block(info); i++)
+	{
+		if (!ptrs[i]) continue;
+		if (depth == 1)
+		{
+			__set_bit(ptrs[i], info->used_blocks);
+		}
+		else if ((retval = mark_ptr_block(info, ptrs[i], depth - 1)) < 0)
+		{
+			break;
+		}
+	}
+	kfree(ptrs);
+	return retval;
+}
+static int mark_file_blocks(sfs_info_t *info, sfs_file_entry_t *fe)
+{
+	byte4_t i;
+	int retval;
+
+	for (i = 0; i < direct_block_cnt(info); i++)
+	{
+		if (fe->blocks[i]) __set_bit(fe->blocks[i], info->used_blocks);
+	}
+	if (info->sb.version == SIMULA_FS_VERSION_DIRECT)
+	{
+		return 0;
+	}
+	if (fe->blocks[SIMULA_FS_IND_BLOCK] &&
+		((retval = mark_ptr_block(info, fe->blocks[SIMULA_FS_IND_BLOCK], 1)) < 0))
+	{
+		return retval;
+	}
+	if (fe->blocks[SIMULA_FS_DIND_BLOCK] &&
+		((retval = mark_ptr_block(info, fe->blocks[SIMULA_FS_DIND_BLOCK], 2)) < 0))
+	{
+		return retval;
+	}
+	return 0;
+}
+static int free_ptr_block(sfs_info_t *info, byte4_t ptr_block, int depth, byte4_t from)
+/*
+ * Frees the blocks under the pointer block, from the relative file block from
+ * onwards. Returns 1, if that was all of them & hence the pointer block also
+ * got freed, 0 otherwise, or -ve error. The pointer block is written back only
+ * if a pointer in it got cleared, as it is visited on every sfs_update
+ */
+{
+	byte4_t span = (depth == 1) ? 1 : ptrs_per_block(info); /* File blocks per pointer */
+	byte4_t *ptrs;
+	byte4_t i;
+	int modified = 0;
+	int retval = 0;
+
+	if (!(ptrs = kmalloc(info->sb.block_size, GFP_KERNEL)))
+	{
+		return -ENOMEM;
+	}
+	if ((retval = read_from_real_sfs(info, ptr_block, 0, ptrs, info->sb.block_size)) < 0)
+	{
+		kfree(ptrs);
+		return retval;
+	}
+	for (i = from / span; i < ptrs_per_block(info); i++)
+	{
+		if (!ptrs[i]) continue;
+		if (depth == 1)
+		{
+			sfs_put_data_block(info, ptrs[i]);
+			ptrs[i] = 0;
+			modified = 1;
+		}
+		else if ((retval = free_ptr_block(info, ptrs[i], depth - 1,
+				(i == from / span) ? from % span : 0)) > 0)
+		{
+			ptrs[i] = 0;
+			modified = 1;
+		}
+		else if (retval < 0)
+		{
+			break;
+		}
+	}
+	if (retval >= 0)
+	{
+		if (from == 0)
+		{
+			sfs_put_data_block(info, ptr_block);
+			retval = 1;
+		}
+		else if (modified)
+		{
+			retval = write_to_real_sfs(info, ptr_block, 0, ptrs, info->sb.block_size);
+		}
+	}
+	kfree(ptrs);
+	return retval;
+}
+static int free_file_blocks(sfs_info_t *info, sfs_file_entry_t *fe, byte4_t from)
+/* Frees the file blocks from the file block from onwards. Caller writes back fe */
+{
+	byte4_t direct_cnt = direct_block_cnt(info), ppb = ptrs_per_block(info);
+	byte4_t i;
+	int retval;
+
+	for (i = from; i < direct_cnt; i++)
+	{
+		if (fe->blocks[i])
+		{
+			sfs_put_data_block(info, fe->blocks[i]);
+			fe->blocks[i] = 0;
+		}
+	}
+	if (info->sb.version == SIMULA_FS_VERSION_DIRECT)
+	{
+		return 0;
+	}
+	from = (from > direct_cnt) ? from - direct_cnt : 0;
+	if (fe->blocks[SIMULA_FS_IND_BLOCK] && (from < ppb))
+	{
+		if ((retval = free_ptr_block(info, fe->blocks[SIMULA_FS_IND_BLOCK], 1, from)) < 0)
+			return retval;
+		if (retval > 0)
+			fe->blocks[SIMULA_FS_IND_BLOCK] = 0;
+	}
+	from = (from > ppb) ? from - ppb : 0;
+	if (fe->blocks[SIMULA_FS_DIND_BLOCK])
+	{
+		if ((retval = free_ptr_block(info, fe->blocks[SIMULA_FS_DIND_BLOCK], 2, from)) < 0)
+			return retval;
+		if (retval > 0)
+			fe->blocks[SIMULA_FS_DIND_BLOCK] = 0;
+	}
+	return 0;
+}
+static int map_file_block(sfs_info_t *info, int vfs_ino, byte4_t iblock, int create, int *new);
+static int get_new_block(sfs_info_t *info, int vfs_ino, byte4_t iblock)
+/* Allocation policy for the file block iblock. Returns block number or INV_BLOCK */
+{
+	int prev;
+
+	if (!info->extent_alloc)
+		return sfs_get_data_block(info);
+	if (iblock == 0)
+		return sfs_get_data_extent(info, SIMULA_FS_DATA_BLOCK_CNT);
+	if ((prev = map_file_block(info, vfs_ino, iblock - 1, 0, NULL)) > 0)
+		return sfs_get_data_block_near(info, prev + 1);
+	return sfs_get_data_block(info);
 }
 
 int init_browsing(sfs_info_t *info)
 {
-	byte1_t *used_blocks;
-	int i, j;
-	sfs_file_entry_t fe;
+	unsigned long *used_blocks;
+	int i;
 	int retval;
 
+	mutex_init(&info->ns_lock);
+	INIT_DELAYED_WORK(&info->flush_work, flush_entries_work);
+
 	if ((retval = read_sb_from_real_sfs(info, &info->sb)) < 0)
 	{
 		return retval;
@@ -95,69 +442,297 @@ int init_browsing(sfs_info_t *info)
 		printk(KERN_ERR "Invalid SFS detected. Giving up.\n");
 		return -EINVAL;
 	}
+	if (info->sb.version > SIMULA_FS_VERSION)
+	{
+		printk(KERN_ERR "Unsupported SFS version %u. Giving up.\n", info->sb.version);
+		return -EINVAL;
+	}
+	if ((info->sb.block_size < SIMULA_FS_BLOCK_SIZE) || (info->sb.block_size > SIMULA_FS_MAX_BLOCK_SIZE) ||
+		!is_power_of_2(info->sb.block_size) ||
+		(sb_set_blocksize(info->vfs_sb, info->sb.block_size) != info->sb.block_size))
+	{
+		printk(KERN_ERR "Unsupported SFS block size %u. Giving up.\n", info->sb.block_size);
+		return -EINVAL;
+	}
 
-	/* Mark used blocks */
-	used_blocks = (byte1_t *)(vmalloc(info->sb.partition_size));
-	if (!used_blocks)
+	/* Load the entry table */
+	info->entries = (sfs_file_entry_t *)(vmalloc(info->sb.entry_table_size * info->sb.block_size));
+	if (!info->entries)
 	{
 		return -ENOMEM;
 	}
-	for (i = 0; i < info->sb.data_block_start; i++)
+	if ((retval = read_entry_table_from_real_sfs(info, info->entries)) < 0)
 	{
-		used_blocks[i] = 1;
+		shut_browsing(info);
+		return retval;
 	}
-	for (; i < info->sb.partition_size; i++)
+	info->entry_block_lock = (struct mutex *)(vmalloc(info->sb.entry_table_size * sizeof(struct mutex)));
+	if (!info->entry_block_lock)
 	{
-		used_blocks[i] = 0;
+		shut_browsing(info);
+		return -ENOMEM;
 	}
+	for (i = 0; i < info->sb.entry_table_size; i++)
+	{
+		mutex_init(&info->entry_block_lock[i]);
+	}
+	info->dirty_entry_blocks = (unsigned long *)(vmalloc(BITS_TO_LONGS(info->sb.entry_table_size) * sizeof(unsigned long)));
+	if (!info->dirty_entry_blocks)
+	{
+		shut_browsing(info);
+		return -ENOMEM;
+	}
+	bitmap_zero(info->dirty_entry_blocks, info->sb.entry_table_size);
+
+	/* Index the entries by name, & chain up the free ones */
+	info->name_hash_mask = roundup_pow_of_two(info->sb.entry_count ? info->sb.entry_count : 1) - 1;
+	info->name_hash = (int *)(vmalloc((info->name_hash_mask + 1) * sizeof(int)));
+	info->next_entry = (int *)(vmalloc(info->sb.entry_count * sizeof(int)));
+	if (!info->name_hash || !info->next_entry)
+	{
+		shut_browsing(info);
+		return -ENOMEM;
+	}
+	for (i = 0; i <= info->name_hash_mask; i++)
+	{
+		info->name_hash[i] = INV_INODE;
+	}
+	info->free_entry = INV_INODE;
+	info->free_entry_cnt = 0;
+	for (i = info->sb.entry_count - 1; i >= 0; i--) // Lowest free entry # comes out first
+	{
+		if (info->entries[i].name[0])
+			hash_entry(info, i);
+		else
+			put_free_entry(info, i);
+	}
+
+	/* Mark used blocks */
+	used_blocks = (unsigned long *)(vmalloc(BITS_TO_LONGS(info->sb.partition_size) * sizeof(unsigned long)));
+	if (!used_blocks)
+	{
+		shut_browsing(info);
+		return -ENOMEM;
+	}
+	bitmap_zero(used_blocks, info->sb.partition_size);
+	bitmap_set(used_blocks, 0, info->sb.data_block_start);
+	info->used_blocks = used_blocks;
 
 	for (i = 0; i < info->sb.entry_count; i++)
 	{
-		if ((retval = read_entry_from_real_sfs(info, i, &fe)) < 0)
+		if (!info->entries[i].name[0]) continue;
+		if ((retval = mark_file_blocks(info, &info->entries[i])) < 0)
 		{
-			vfree(used_blocks);
+			shut_browsing(info);
 			return retval;
 		}
-		if (!fe.name[0]) continue;
-		for (j = 0; j < SIMULA_FS_DATA_BLOCK_CNT; j++)
-		{
-			if (fe.blocks[j] == 0) break;
-			used_blocks[fe.blocks[j]] = 1;
-		}
 	}
 
-	info->used_blocks = used_blocks;
+	if (!(info->pools = alloc_percpu(sfs_block_pool_t))) // Zeroed, i.e. all empty
+	{
+		shut_browsing(info);
+		return -ENOMEM;
+	}
+	for_each_possible_cpu(i)
+	{
+		spin_lock_init(&per_cpu_ptr(info->pools, i)->lock);
+	}
+	info->alloc_cursor = info->sb.data_block_start;
+	info->free_block_cnt = info->sb.partition_size - bitmap_weight(used_blocks, info->sb.partition_size);
 	info->vfs_sb->s_fs_info = info;
 	spin_lock_init(&info->lock);
 	return 0;
 }
 void shut_browsing(sfs_info_t *info)
 {
+	if (info->dirty_entry_blocks)
+	{
+		cancel_delayed_work_sync(&info->flush_work);
+		if (sfs_flush_entries(info) < 0)
+		{
+			printk(KERN_ERR "Unable to write back the entry table\n");
+		}
+		vfree(info->dirty_entry_blocks);
+	}
+	if (info->entry_block_lock)
+		vfree(info->entry_block_lock);
+	if (info->pools)
+		free_percpu(info->pools);
 	if (info->used_blocks)
 		vfree(info->used_blocks);
+	if (info->next_entry)
+		vfree(info->next_entry);
+	if (info->name_hash)
+		vfree(info->name_hash);
+	if (info->entries)
+		vfree(info->entries);
+	info->dirty_entry_blocks = NULL;
+	info->entry_block_lock = NULL;
+	info->pools = NULL;
+	info->used_blocks = NULL;
+	info->next_entry = NULL;
+	info->name_hash = NULL;
+	info->entries = NULL;
+}
+
+static void refill_block_pool(sfs_info_t *info, sfs_block_pool_t *pool)
+/*
+ * Next-fit: Reserves the run of up to SFS_POOL_BLOCKS free blocks, from where
+ * the last reservation left off, wrapping around once. Leaves the pool empty,
+ * if no block is free. Called with info->lock held
+ */
+{
+	byte4_t i, end;
+
+	i = find_next_zero_bit(info->used_blocks, info->sb.partition_size, info->alloc_cursor);
+	if (i >= info->sb.partition_size)
+	{
+		i = find_next_zero_bit(info->used_blocks, info->sb.partition_size, info->sb.data_block_start);
+	}
+	if (i >= info->sb.partition_size)
+	{
+		return;
+	}
+	end = find_next_bit(info->used_blocks, min(info->sb.partition_size, i + SFS_POOL_BLOCKS), i);
+	bitmap_set(info->used_blocks, i, end - i);
+	info->free_block_cnt -= end - i;
+	info->alloc_cursor = (end < info->sb.partition_size) ? end : info->sb.data_block_start;
+	pool->next = i;
+	pool->end = end;
 }
+static int steal_pool_block(sfs_info_t *info, int this_cpu)
+/*
+ * Takes a block from any other CPU's pool, for when no block is left free
+ * outside the pools. Each pool's lock is taken alone, so as to never nest
+ */
+{
+	sfs_block_pool_t *pool;
+	int cpu, i = INV_BLOCK;
 
+	for_each_possible_cpu(cpu)
+	{
+		if (cpu == this_cpu) continue;
+		pool = per_cpu_ptr(info->pools, cpu);
+		spin_lock(&pool->lock);
+		if (pool->next < pool->end)
+		{
+			i = pool->next++;
+		}
+		spin_unlock(&pool->lock);
+		if (i != INV_BLOCK) break;
+	}
+	return i;
+}
 int sfs_get_data_block(sfs_info_t *info)
+/*
+ * Served from the current CPU's pool of reserved blocks, so that concurrent
+ * allocators contend on info->lock only once per pool refill. Only when no
+ * block is left free outside the pools, one is stolen from another CPU's
+ */
 {
-	int i;
+	sfs_block_pool_t *pool;
+	int cpu, i = INV_BLOCK;
 
-	spin_lock(&info->lock); // To prevent racing on used_blocks access
-	for (i = info->sb.data_block_start; i < info->sb.partition_size; i++)
+	cpu = get_cpu();
+	pool = per_cpu_ptr(info->pools, cpu);
+	spin_lock(&pool->lock);
+	if (pool->next == pool->end)
+	{
+		spin_lock(&info->lock); // To prevent racing on used_blocks access
+		refill_block_pool(info, pool);
+		spin_unlock(&info->lock);
+	}
+	if (pool->next < pool->end)
+	{
+		i = pool->next++;
+	}
+	spin_unlock(&pool->lock);
+	if (i == INV_BLOCK)
+	{
+		i = steal_pool_block(info, cpu);
+	}
+	put_cpu();
+	return i;
+}
+int sfs_get_data_block_near(sfs_info_t *info, int goal)
+/* Gets the goal block, if free, so as to grow a file contiguously */
+{
+	sfs_block_pool_t *pool;
+
+	pool = per_cpu_ptr(info->pools, get_cpu());
+	spin_lock(&pool->lock);
+	if ((pool->next == goal) && (pool->next < pool->end)) // Already reserved for us
 	{
-		if (info->used_blocks[i] == 0)
+		pool->next++;
+		spin_unlock(&pool->lock);
+		put_cpu();
+		return goal;
+	}
+	spin_unlock(&pool->lock);
+	put_cpu();
+	if ((info->sb.data_block_start <= goal) && (goal < info->sb.partition_size))
+	{
+		spin_lock(&info->lock); // To prevent racing on used_blocks access
+		if (!__test_and_set_bit(goal, info->used_blocks))
 		{
-			info->used_blocks[i] = 1;
+			info->free_block_cnt--;
 			spin_unlock(&info->lock);
-			return i;
+			return goal;
 		}
+		spin_unlock(&info->lock);
+	}
+	return sfs_get_data_block(info);
+}
+int sfs_get_data_extent(sfs_info_t *info, int cnt)
+/*
+ * Finds a contiguous run of cnt free blocks & gets its first block. The rest
+ * of the run is left free, but the allocation cursor is moved past it, so
+ * that the other files' allocations don't land in it, while this file grows
+ * into it through sfs_get_data_block_near
+ */
+{
+	byte4_t i;
+
+	spin_lock(&info->lock); // To prevent racing on used_blocks access
+	i = bitmap_find_next_zero_area(info->used_blocks, info->sb.partition_size,
+			info->alloc_cursor, cnt, 0);
+	if (i + cnt > info->sb.partition_size)
+	{
+		i = bitmap_find_next_zero_area(info->used_blocks, info->sb.partition_size,
+				info->sb.data_block_start, cnt, 0);
+	}
+	if (i + cnt > info->sb.partition_size) // No such run. So, settle for any block
+	{
+		spin_unlock(&info->lock);
+		return sfs_get_data_block(info);
 	}
+	__set_bit(i, info->used_blocks);
+	info->free_block_cnt--;
+	info->alloc_cursor = (i + cnt < info->sb.partition_size) ? i + cnt : info->sb.data_block_start;
 	spin_unlock(&info->lock);
-	return INV_BLOCK;
+	return i;
+}
+byte4_t sfs_free_block_cnt(sfs_info_t *info)
+/* Includes the blocks reserved in the CPU pools, as those are yet to be used */
+{
+	byte4_t cnt = info->free_block_cnt;
+	sfs_block_pool_t *pool;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+	{
+		pool = per_cpu_ptr(info->pools, cpu);
+		cnt += pool->end - pool->next;
+	}
+	return cnt;
 }
 void sfs_put_data_block(sfs_info_t *info, int i)
 {
 	spin_lock(&info->lock); // To prevent racing on used_blocks access
-	info->used_blocks[i] = 0;
+	if (__test_and_clear_bit(i, info->used_blocks))
+	{
+		info->free_block_cnt++;
+	}
 	spin_unlock(&info->lock);
 }
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(3,11,0))
@@ -165,26 +740,28 @@ int sfs_list(sfs_info_t *info, struct file *file, void *dirent, filldir_t filldi
 {
 	loff_t pos;
 	int ino;
-	sfs_file_entry_t fe;
+	sfs_file_entry_t *fe;
 	int retval;
 
+	mutex_lock(&info->ns_lock);
 	pos = 1; /* Starts at 1 as . is position 0 & .. is position 1 */
 	for (ino = 0; ino < info->sb.entry_count; ino++)
 	{
-		if ((retval = read_entry_from_real_sfs(info, ino, &fe)) < 0)
-			return retval;
-		if (!fe.name[0]) continue;
+		fe = &info->entries[ino];
+		if (!fe->name[0]) continue;
 		pos++; /* Position of this file */
 		if (file->f_pos == pos)
 		{
-			retval = filldir(dirent, fe.name, strlen(fe.name), file->f_pos, S2V_INODE_NUM(ino), DT_REG);
+			retval = filldir(dirent, fe->name, strlen(fe->name), file->f_pos, S2V_INODE_NUM(ino), DT_REG);
 			if (retval)
 			{
+				mutex_unlock(&info->ns_lock);
 				return retval;
 			}
 			file->f_pos++;
 		}
 	}
+	mutex_unlock(&info->ns_lock);
 	return 0;
 }
 #else
@@ -192,46 +769,39 @@ int sfs_list(sfs_info_t *info, struct file *file, struct dir_context *ctx)
 {
 	loff_t pos;
 	int ino;
-	sfs_file_entry_t fe;
-	int retval;
+	sfs_file_entry_t *fe;
 
+	mutex_lock(&info->ns_lock);
 	pos = 1; /* Starts at 1 as . is position 0 & .. is position 1 */
 	for (ino = 0; ino < info->sb.entry_count; ino++)
 	{
-		if ((retval = read_entry_from_real_sfs(info, ino, &fe)) < 0)
-			return retval;
-		if (!fe.name[0]) continue;
+		fe = &info->entries[ino];
+		if (!fe->name[0]) continue;
 		pos++; /* Position of this file */
 		if (ctx->pos == pos)
 		{
-			if (!dir_emit(ctx, fe.name, strlen(fe.name), S2V_INODE_NUM(ino), DT_REG))
+			if (!dir_emit(ctx, fe->name, strlen(fe->name), S2V_INODE_NUM(ino), DT_REG))
 			{
+				mutex_unlock(&info->ns_lock);
 				return -ENOSPC;
 			}
 			ctx->pos++;
 		}
 	}
+	mutex_unlock(&info->ns_lock);
 	return 0;
 }
 #endif
 int sfs_create(sfs_info_t *info, char *fn, int perms, sfs_file_entry_t *fe)
 /* This function is called only if the file doesn't exist */
 {
-	int ino, free_ino, i;
+	int free_ino, i;
+	int retval;
 
-	free_ino = INV_INODE;
-	for (ino = 0; ino < info->sb.entry_count; ino++)
-	{
-		if (read_entry_from_real_sfs(info, ino, fe) < 0)
-			return INV_INODE;
-		if (!fe->name[0])
-		{
-			free_ino = ino;
-			break;
-		}
-	}
-	if (free_ino == INV_INODE)
+	mutex_lock(&info->ns_lock);
+	if ((free_ino = get_free_entry(info)) == INV_INODE)
 	{
+		mutex_unlock(&info->ns_lock);
 		printk(KERN_ERR "No entries left\n");
 		return INV_INODE;
 	}
@@ -246,81 +816,227 @@ int sfs_create(sfs_info_t *info, char *fn, int perms, sfs_file_entry_t *fe)
 		fe->blocks[i] = 0;
 	}
 
-	if (write_entry_to_real_sfs(info, free_ino, fe) < 0)
+	lock_entry(info, free_ino);
+	if ((retval = write_entry_to_real_sfs(info, free_ino, fe)) < 0)
+	{
+		memset(&info->entries[free_ino], 0, sizeof(sfs_file_entry_t));
+	}
+	unlock_entry(info, free_ino);
+	if (retval < 0)
+	{
+		put_free_entry(info, free_ino);
+		mutex_unlock(&info->ns_lock);
 		return INV_INODE;
+	}
+	hash_entry(info, free_ino);
+	mutex_unlock(&info->ns_lock);
 
 	return S2V_INODE_NUM(free_ino);
 }
 int sfs_lookup(sfs_info_t *info, char *fn, sfs_file_entry_t *fe)
 {
 	int ino;
+	int retval;
 
-	for (ino = 0; ino < info->sb.entry_count; ino++)
+	mutex_lock(&info->ns_lock);
+	if ((ino = find_entry(info, fn)) != INV_INODE)
 	{
-		if (read_entry_from_real_sfs(info, ino, fe) < 0)
-			return INV_INODE;
-		if (!fe->name[0]) continue;
-		if (strcmp(fe->name, fn) == 0) return S2V_INODE_NUM(ino);
+		lock_entry(info, ino);
+		retval = read_entry_from_real_sfs(info, ino, fe);
+		unlock_entry(info, ino);
+		if (retval < 0)
+			ino = INV_INODE;
 	}
+	mutex_unlock(&info->ns_lock);
 
-	return INV_INODE;
+	return (ino == INV_INODE) ? INV_INODE : S2V_INODE_NUM(ino);
 }
 int sfs_remove(sfs_info_t *info, char *fn)
+/*
+ * The entry is unhashed first, & so is invisible to the lookups, while its
+ * blocks are being freed - without holding ns_lock. It is put in the free
+ * list only after that
+ */
 {
-	int vfs_ino, block_i;
+	int ino;
 	sfs_file_entry_t fe;
+	int retval;
 
-	if ((vfs_ino = sfs_lookup(info, fn, &fe)) == INV_INODE)
+	mutex_lock(&info->ns_lock);
+	if ((ino = find_entry(info, fn)) == INV_INODE)
 	{
+		mutex_unlock(&info->ns_lock);
 		printk(KERN_ERR "File %s doesn't exist\n", fn);
 		return INV_INODE;
 	}
+	unhash_entry(info, ino);
+	mutex_unlock(&info->ns_lock);
+
+	lock_entry(info, ino);
+	read_entry_from_real_sfs(info, ino, &fe);
 	/* Free up all allocated blocks, if any */
-	for (block_i = 0; block_i < SIMULA_FS_DATA_BLOCK_CNT; block_i++)
+	if (free_file_blocks(info, &fe, 0) < 0)
 	{
-		if (!fe.blocks[block_i])
-		{
-			break;
-		}
-		sfs_put_data_block(info, fe.blocks[block_i]);
+		printk(KERN_ERR "Unable to free all blocks of %s\n", fn);
 	}
 	memset(&fe, 0, sizeof(sfs_file_entry_t));
+	retval = write_entry_to_real_sfs(info, ino, &fe);
+	unlock_entry(info, ino);
 
-	if (write_entry_to_real_sfs(info, V2S_INODE_NUM(vfs_ino), &fe) < 0)
-		return INV_INODE;
+	if (retval < 0)
+		return INV_INODE; // Entry stays out of the free list, till the next mount
+	mutex_lock(&info->ns_lock);
+	put_free_entry(info, ino);
+	mutex_unlock(&info->ns_lock);
 
-	return vfs_ino;
+	return S2V_INODE_NUM(ino);
 }
 int sfs_get_file_entry(sfs_info_t *info, int vfs_ino, sfs_file_entry_t *fe)
 {
-	return read_entry_from_real_sfs(info, V2S_INODE_NUM(vfs_ino), fe);
+	int retval;
+
+	lock_entry(info, V2S_INODE_NUM(vfs_ino));
+	retval = read_entry_from_real_sfs(info, V2S_INODE_NUM(vfs_ino), fe);
+	unlock_entry(info, V2S_INODE_NUM(vfs_ino));
+	return retval;
 }
 int sfs_update(sfs_info_t *info, int vfs_ino, int *size, int *timestamp, int *perms)
 {
 	sfs_file_entry_t fe;
-	int i;
 	int retval;
 
-	if ((retval = sfs_get_file_entry(info, vfs_ino, &fe)) < 0)
-	{
-		return retval;
-	}
+	lock_entry(info, V2S_INODE_NUM(vfs_ino));
+	read_entry_from_real_sfs(info, V2S_INODE_NUM(vfs_ino), &fe);
 	if (size) fe.size = *size;
 	if (timestamp) fe.timestamp = *timestamp;
 	if (perms && (*perms <= 07)) fe.perms = *perms;
 
-	for (i = (fe.size + info->sb.block_size - 1) / info->sb.block_size; i < SIMULA_FS_DATA_BLOCK_CNT; i++)
+	if ((retval = free_file_blocks(info, &fe,
+			((byte8_t)(fe.size) + info->sb.block_size - 1) / info->sb.block_size)) >= 0)
+	{
+		retval = write_entry_to_real_sfs(info, V2S_INODE_NUM(vfs_ino), &fe);
+	}
+	unlock_entry(info, V2S_INODE_NUM(vfs_ino));
+
+	return retval;
+}
+int sfs_update_file_entry(sfs_info_t *info, int vfs_ino, sfs_file_entry_t *fe)
+{
+	int retval;
+
+	lock_entry(info, V2S_INODE_NUM(vfs_ino));
+	retval = write_entry_to_real_sfs(info, V2S_INODE_NUM(vfs_ino), fe);
+	unlock_entry(info, V2S_INODE_NUM(vfs_ino));
+	return retval;
+}
+static int map_file_block(sfs_info_t *info, int vfs_ino, byte4_t iblock, int create, int *new)
+/* Called with the entry's block lock held */
+{
+	byte4_t direct_cnt = direct_block_cnt(info), ppb = ptrs_per_block(info);
+	sfs_file_entry_t fe;
+	byte4_t *slot, ptr_block, rel, idx, ptr;
+	int depth, block;
+	int retval;
+
+	if (new) *new = 0;
+	if ((retval = read_entry_from_real_sfs(info, V2S_INODE_NUM(vfs_ino), &fe)) < 0)
 	{
-		if (fe.blocks[i])
+		return retval;
+	}
+
+	if (iblock < direct_cnt)
+	{
+		depth = 0;
+		slot = &fe.blocks[iblock];
+	}
+	else if (info->sb.version == SIMULA_FS_VERSION_DIRECT)
+	{
+		return -ENOSPC;
+	}
+	else if (iblock - direct_cnt < ppb)
+	{
+		depth = 1;
+		slot = &fe.blocks[SIMULA_FS_IND_BLOCK];
+	}
+	else if (iblock - direct_cnt - ppb < ppb * ppb)
+	{
+		depth = 2;
+		slot = &fe.blocks[SIMULA_FS_DIND_BLOCK];
+	}
+	else
+	{
+		return -ENOSPC;
+	}
+
+	/* The block # in the entry itself */
+	if (!*slot)
+	{
+		if (!create)
+			return 0;
+		if ((block = (depth ? sfs_get_data_block(info) : get_new_block(info, vfs_ino, iblock))) == INV_BLOCK)
+			return -ENOSPC;
+		if (depth && ((retval = clear_block_on_real_sfs(info, block)) < 0))
 		{
-			sfs_put_data_block(info, fe.blocks[i]);
-			fe.blocks[i] = 0;
+			sfs_put_data_block(info, block);
+			return retval;
 		}
+		*slot = block;
+		if ((retval = write_entry_to_real_sfs(info, V2S_INODE_NUM(vfs_ino), &fe)) < 0)
+			return retval;
+		if (!depth && new) *new = 1;
 	}
+	if (!depth)
+	{
+		return *slot;
+	}
+
+	/* Walking down the indirect block(s) */
+	ptr_block = *slot;
+	rel = iblock - direct_cnt - ((depth == 1) ? 0 : ppb); /* Relative to the indirect block */
+	for (; depth; depth--)
+	{
+		idx = (depth == 1) ? rel % ppb : rel / ppb;
+		if ((retval = read_from_real_sfs(info, ptr_block, idx * sizeof(byte4_t), &ptr, sizeof(byte4_t))) < 0)
+			return retval;
+		if (!ptr)
+		{
+			if (!create)
+				return 0;
+			if ((block = ((depth > 1) ? sfs_get_data_block(info) : get_new_block(info, vfs_ino, iblock))) == INV_BLOCK)
+				return -ENOSPC;
+			if ((depth > 1) && ((retval = clear_block_on_real_sfs(info, block)) < 0))
+			{
+				sfs_put_data_block(info, block);
+				return retval;
+			}
+			ptr = block;
+			if ((retval = write_to_real_sfs(info, ptr_block, idx * sizeof(byte4_t), &ptr, sizeof(byte4_t))) < 0)
+				return retval;
+			if ((depth == 1) && new) *new = 1;
+		}
+		ptr_block = ptr;
+	}
+	return ptr_block;
+}
+int sfs_map_block(sfs_info_t *info, int vfs_ino, byte4_t iblock, int create, int *new)
+{
+	int retval;
 
-	return write_entry_to_real_sfs(info, V2S_INODE_NUM(vfs_ino), &fe);
+	lock_entry(info, V2S_INODE_NUM(vfs_ino));
+	retval = map_file_block(info, vfs_ino, iblock, create, new);
+	unlock_entry(info, V2S_INODE_NUM(vfs_ino));
+	return retval;
 }
-int sfs_update_file_entry(sfs_info_t *info, int vfs_ino, sfs_file_entry_t *fe)
+loff_t sfs_max_file_size(sfs_info_t *info)
 {
-	return write_entry_to_real_sfs(info, V2S_INODE_NUM(vfs_ino), fe);
+	byte8_t blocks = direct_block_cnt(info);
+	byte8_t size;
+
+	if (info->sb.version != SIMULA_FS_VERSION_DIRECT)
+	{
+		blocks += ptrs_per_block(info) + (byte8_t)(ptrs_per_block(info)) * ptrs_per_block(info);
+	}
+	size = blocks * info->sb.block_size;
+	/* Limited by the entry's size field */
+	return (size > 0xFFFFFFFFULL) ? 0xFFFFFFFFULL : size;
 }
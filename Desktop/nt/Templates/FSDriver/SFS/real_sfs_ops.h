@@ -20,9 +20,18 @@
 
 int init_browsing(sfs_info_t *info);
 void shut_browsing(sfs_info_t *info);
+int sfs_flush_entries(sfs_info_t *info); // Writes back the updated entries
 
 int sfs_get_data_block(sfs_info_t *info); // Returns block number or INV_BLOCK
+/* The following 2 APIs also return block number or INV_BLOCK */
+int sfs_get_data_block_near(sfs_info_t *info, int goal);
+int sfs_get_data_extent(sfs_info_t *info, int cnt);
 void sfs_put_data_block(sfs_info_t *info, int i);
+byte4_t sfs_free_block_cnt(sfs_info_t *info);
+
+/* Returns block number, 0 if unmapped (& !create), or -ve error */
+int sfs_map_block(sfs_info_t *info, int vfs_ino, byte4_t iblock, int create, int *new);
+loff_t sfs_max_file_size(sfs_info_t *info);
 
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(3,11,0))
 int sfs_list(sfs_info_t *info, struct file *file, void *dirent, filldir_t filldir);